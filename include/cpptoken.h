@@ -136,6 +136,16 @@ namespace cpptoken {
 
 class FABase;
 class NFA;
+class DFA;
+class CompressedDFA;
+class TieredDFA;
+class PartitionedDFA;
+class RuleSetDFA;
+class DFAProfile;
+class LazyDFA;
+class IncrementalBuild;
+class SharedLazyDFA;
+class Scanner;
 class REToken;
 
 struct TokenList2;
@@ -272,6 +282,24 @@ class SyntaxError : public std::exception {
 
 /*******************************************************/
 
+/**
+ * Thrown when building a scanner goes over one of the
+ * limits in a BuilderLimits object.
+ */
+class LimitExceeded : public std::exception {
+  private:
+    const char *m_reason;
+
+  public:
+    LimitExceeded(const char *msg)
+      : std::exception(),
+        m_reason(msg) {;};
+
+    const char *what() const throw();
+};
+
+/*******************************************************/
+
 /// Function to be called when a token is matched
 typedef void *(*action_func)(void *userArg, const char *str, size_t len);
 
@@ -283,17 +311,84 @@ typedef list<uchar, Alloc<uchar> > UCharList2;
 /**
  * Represents run time limits for DFA construction.
  *
- * Currently the limits are unused, but are in place for the future.
+ * A value of zero means there is no limit. The limits are checked
+ * in every build stage, going over one throws LimitExceeded. The
+ * state limit counts DFA states, the byte limit the memory held by
+ * the NFA, the subset or derivative tables and the DFA being built.
+ * The time limit runs from the start of the Build call.
+ *
+ * Another thread may call cancel() on the object while a build is
+ * using it; the build then throws LimitExceeded soon after. A
+ * cancelled object stays cancelled.
  */
 class BuilderLimits {
   size_t m_maxTimeInSeconds;
   size_t m_maxStates;
+  size_t m_maxBytes;
+  size_t m_startTime;
+  bool m_cancelled;
+  const BuilderLimits *m_parent;
 
  public:
-  BuilderLimits() : m_maxTimeInSeconds(0), m_maxStates(0) {;};
-  BuilderLimits(size_t tm, size_t st)
+  BuilderLimits()
     : m_maxTimeInSeconds(0),
-      m_maxStates(0) {;};
+      m_maxStates(0),
+      m_maxBytes(0),
+      m_startTime(0),
+      m_cancelled(false),
+      m_parent(0) {;};
+  BuilderLimits(size_t tm, size_t st)
+    : m_maxTimeInSeconds(tm),
+      m_maxStates(st),
+      m_maxBytes(0),
+      m_startTime(0),
+      m_cancelled(false),
+      m_parent(0) {;};
+  BuilderLimits(size_t tm, size_t st, size_t bytes)
+    : m_maxTimeInSeconds(tm),
+      m_maxStates(st),
+      m_maxBytes(bytes),
+      m_startTime(0),
+      m_cancelled(false),
+      m_parent(0) {;};
+
+  size_t getMaxTimeInSeconds() const { return this->m_maxTimeInSeconds; };
+  size_t getMaxStates() const { return this->m_maxStates; };
+  size_t getMaxBytes() const { return this->m_maxBytes; };
+
+  /// Make the build using this object stop. Safe from any thread.
+  void cancel() {
+    __atomic_store_n(&this->m_cancelled, true, __ATOMIC_RELAXED);
+  };
+  bool isCancelled() const {
+    return __atomic_load_n(&this->m_cancelled, __ATOMIC_RELAXED)
+      || (this->m_parent && this->m_parent->isCancelled());
+  };
+
+  /* not for external use */
+  void setParent(const BuilderLimits *parent) {
+    this->m_parent = parent;
+  };
+  void startClock();
+  void check(size_t numStates, size_t numBytes) const;
+};
+
+/**
+ * How a match is chosen when several rules match at the start of
+ * the input.
+ *
+ * LEFTMOST_LONGEST - the longest match wins, the lower numbered rule
+ *                    on a tie. The default.
+ * LEFTMOST_FIRST   - the lowest numbered rule that matches at all
+ *                    wins, with its longest match, like a Perl style
+ *                    alternation of the rules in order.
+ * SHORTEST_MATCH   - the match ends at the first byte where any rule
+ *                    accepts, the lower numbered rule on a tie.
+ */
+enum MatchSemantics {
+  LEFTMOST_LONGEST,
+  LEFTMOST_FIRST,
+  SHORTEST_MATCH
 };
 
 /**
@@ -311,10 +406,13 @@ class Builder {
  private:
   MemoryControl *m_mc;
   list<PatternAction *, Alloc<PatternAction *> > *m_pats;
+  MatchSemantics m_semantics;
 
   UCharList2 *m_tmpCharList;
   UCharList2 *m_tmpInvCharList;
 
+  IncrementalBuild *m_inc;
+
  public:
   /**
    * Only way of creating a Builder object.
@@ -337,16 +435,154 @@ class Builder {
 
   /**
    * Add a regular expression to the builder.
+   *
+   * Rules are numbered in the order they are added, starting
+   * at zero. When two rules match the same text the rule with
+   * the lower number wins.
    */
   void addRegEx(const char *regex, action_func, void *userArg);
 
   /**
-   *
+   * Add a regular expression that returns a token value
+   * instead of calling an action function.
    */
   void addRegEx(const char *regex, void *tok);
+
+  /**
+   * Choose the match semantics of everything built afterwards.
+   * Both LEFTMOST_FIRST and SHORTEST_MATCH are resolved while the
+   * DFA is built: once a state accepts a rule, the lower priority
+   * rules are dropped from it, and with SHORTEST_MATCH every way
+   * out of it. The DFA often stops early and is smaller.
+   */
+  void setMatchSemantics(MatchSemantics);
   
   /* not for external use */
   NFA *BuildNFA(MemoryControl *, BuilderLimits *);
+  NFA *BuildNFA(MemoryControl *, BuilderLimits *, bool reverse);
+
+  /**
+   * Build a DFA for all the rules added so far.
+   *
+   * The DFA is allocated from the given MemoryControl object,
+   * temporary data comes from the builder's MemoryControl object.
+   * The limits pointer may be NULL.
+   */
+  DFA *BuildDFA(MemoryControl *, BuilderLimits *);
+
+  /**
+   * Same as BuildDFA, with subset construction and minimization
+   * spread over numThreads threads. Zero means one thread per online processor.
+   * The DFA is the same whatever the number of threads.
+   */
+  DFA *BuildDFA(MemoryControl *, BuilderLimits *, size_t numThreads);
+
+  /**
+   * Build a DFA for the rules with their input reversed. It is run
+   * with DFA::longestMatchReverse, from the end of a match towards
+   * its start.
+   */
+  DFA *BuildReverseDFA(MemoryControl *, BuilderLimits *);
+
+  /**
+   * Build an unanchored DFA that can find where the first match in
+   * a buffer ends, wherever it starts. See DFA::search.
+   */
+  DFA *BuildSearchDFA(MemoryControl *, BuilderLimits *);
+
+  /**
+   * Same result as BuildDFA, but the builder keeps its NFA and the
+   * unminimized DFA between calls. Rules added since the previous
+   * call are merged in by determinizing only the states they reach,
+   * then the result is minimized again.
+   */
+  DFA *BuildDFAIncremental(MemoryControl *, BuilderLimits *);
+
+  /**
+   * Same result as BuildDFA, but the DFA states are built directly
+   * from the rules with regular expression derivatives, without an
+   * NFA. Often faster for small rule sets.
+   */
+  DFA *BuildDerivativeDFA(MemoryControl *, BuilderLimits *);
+
+  /**
+   * Build a DFA and store it with compressed rows. Slower to scan
+   * than BuildDFA, but far smaller for very large rule sets.
+   */
+  CompressedDFA *BuildCompressedDFA(MemoryControl *, BuilderLimits *);
+
+  /**
+   * Build a DFA and keep its hotStates most used states as dense
+   * rows, the rest compressed and decoded on demand into a cache of
+   * cacheRows rows. Hotness comes from the profile when it matches
+   * the DFA, otherwise from the distance to the start state.
+   */
+  TieredDFA *BuildTieredDFA(MemoryControl *, BuilderLimits *,
+			    const DFAProfile *, size_t hotStates,
+			    size_t cacheRows);
+
+  /**
+   * Build one DFA per group of rules, with groups chosen so none
+   * needs more than groupStates DFA states. Rules that blow up
+   * together end up in different groups, so the total size grows
+   * with the number of groups instead of with their product. A
+   * rule too big alone gets a group of its own, built within the
+   * limits only, so that group can have more than groupStates
+   * states.
+   */
+  PartitionedDFA *BuildPartitionedDFA(MemoryControl *, BuilderLimits *,
+				      size_t groupStates);
+
+  /**
+   * Build a DFA whose accepting states list every rule they match,
+   * so one pass tells which of the rules match the input. With
+   * anywhere set the rules may match any substring, otherwise
+   * they are anchored at the start. The match semantics is not
+   * used, no rule hides another.
+   */
+  RuleSetDFA *BuildRuleSetDFA(MemoryControl *, BuilderLimits *,
+			      bool anywhere);
+
+  /**
+   * Build a lazy DFA for all the rules added so far.
+   *
+   * Only the NFA is built up front, DFA states are created as the
+   * scanner reaches them. At most maxStates states are cached at
+   * any time, so memory use stays bounded no matter how large the
+   * full DFA would be.
+   */
+  LazyDFA *BuildLazyDFA(MemoryControl *, BuilderLimits *, size_t maxStates);
+
+  /**
+   * Build a DFA within the limits. If it cannot be built within
+   * them, fall back to a LazyDFA with a cache of lazyStates states,
+   * which in turn falls back to simulating the NFA. Cancelling the
+   * limits still throws LimitExceeded.
+   */
+  Scanner *BuildScanner(MemoryControl *, BuilderLimits *, size_t lazyStates);
+
+  /**
+   * Build a scanner that picks an engine per rule. A rule whose
+   * DFA alone needs more than ruleStates states, or that makes the
+   * DFA of the rules before it need more than unionStates states
+   * or break the limits, is matched by a LazyDFA with a cache of
+   * lazyStates states; the others share a DFA. Matches are longest
+   * first, then lowest rule number, as if all rules were in one
+   * DFA.
+   */
+  Scanner *BuildHybridScanner(MemoryControl *, BuilderLimits *,
+			      size_t ruleStates, size_t unionStates,
+			      size_t lazyStates);
+
+  /**
+   * Build a lazy DFA whose state cache can be shared by many
+   * threads. Each thread scans through its own SharedLazyScanner.
+   *
+   * The cache is never flushed. Once maxStates states exist, a
+   * scan that needs a new state finishes with NFA simulation.
+   */
+  SharedLazyDFA *BuildSharedLazyDFA(MemoryControl *, BuilderLimits *,
+				    size_t maxStates);
 
   /* tokenize regex */
   TokenList2 *tokenizeRegEx(const char *regex, size_t start, size_t len);
@@ -354,6 +590,16 @@ class Builder {
  private:
   Builder(const Builder &);
   Builder &operator=(const Builder &);
+
+  DFA *buildDFAFromNFA(MemoryControl *, BuilderLimits *, NFA *,
+		       size_t numThreads);
+  void addRules(NFA *, size_t first, const BuilderLimits *);
+  void addRules(NFA *, size_t first, const BuilderLimits *,
+		const vector<bool, Alloc<bool> > *use);
+  NFA *buildRulesNFA(MemoryControl *, const BuilderLimits *,
+		     const vector<bool, Alloc<bool> > &use);
+  DFA *tryRulesDFA(MemoryControl *, BuilderLimits *,
+		   const vector<bool, Alloc<bool> > &use);
 };
 
 
@@ -36,6 +36,7 @@
 #include <memory>
 #include <list>
 #include <vector>
+#include <pthread.h>
 #include <exception>
 using namespace std;
 
@@ -37,6 +37,17 @@ namespace cpptoken {
 
 /********************************/
 
+template <class T>
+Alloc<T>
+makeAlloc(MemoryControl *mc)
+{
+  Alloc<T> res;
+  res.setMC(mc);
+  return res;
+}
+
+/********************************/
+
 enum TokType {
   TT_SELF_CHAR,
 
@@ -62,6 +73,7 @@ enum TokType {
 struct RETokQuantifier {
   bool m_v1Valid;
   bool m_v2Valid;
+  bool m_exact;   /* {X} as opposed to {X,} */
   size_t m_v1;
   size_t m_v2;
 };
@@ -195,6 +207,7 @@ private:
   void createInverseRange();
 
   void simpleAddToken(TokType, uchar = '\0');
+  void addPlusQuantifier();
   void addTokenAndMaybeCcat(TokType, uchar = '\0');
   void maybeAddCcat(TokType);
 
@@ -206,38 +219,1230 @@ private:
 
 struct PatternAction {
   const char *regex;
+  size_t len;
   action_func fp;
   void *arg;
 };
 
 /********************************/
 typedef size_t stateNum;
+typedef vector<stateNum, Alloc<stateNum> > StateVec;
+
+/* marker for a missing / not yet patched state */
+const stateNum NO_STATE = ~((stateNum)0);
 
-class NextState {
-  stateNum idx;
-  stateNum cnt;
+/* accept token value for non accepting states */
+const size_t NO_TOKEN = ~((size_t)0);
+
+/* largest count allowed in a {m,n} quantifier, they are unrolled */
+const size_t RE_MAX_REPEAT = 1000;
+
+/* a set of bytes - one bit per possible byte value */
+struct CharSet {
+  uchar m_bits[32];
+
+  void clear();
+  void add(uchar);
+  bool contains(uchar c) const {
+    return ((this->m_bits[c >> 3] >> (c & 7)) & 1) != 0;
+  };
+
+  static size_t computeByteClasses(const CharSet *sets, size_t numSets,
+				   uchar *byteClass);
 };
 
-class NFAContext {
-  vector<stateNum, Alloc<stateNum> > stateBuf;
+/********************************/
+
+enum NFAStateType {
+  NS_CHAR,      /* consume one byte in the char set, go to m_out1 */
+  NS_SPLIT,     /* epsilon moves to m_out1 and m_out2 */
+  NS_EPSILON,   /* epsilon move to m_out1 */
+  NS_ACCEPT     /* accepting state for one rule */
 };
 
+struct NFAState {
+  NFAStateType m_type;
+  stateNum m_out1;
+  stateNum m_out2;
+  size_t m_arg;     /* NS_CHAR - char set index, NS_ACCEPT - token id */
+};
+
+/*
+ * Thompson style NFA holding the union of all rules. Each rule
+ * has its own start state, the token id of a rule is the order in
+ * which it was added to the builder.
+ */
 class NFA {
 private:
-  stateNum start;
-  vector<bool, Alloc<bool> > acceptingStates;
-  vector<NextState, Alloc<NextState> > transTbl;
+  struct Frag {
+    stateNum m_lo;      /* all states >= m_lo belong to the fragment */
+    stateNum m_start;
+    stateNum m_end;     /* m_out1 of this state is not yet patched */
+  };
+  typedef vector<Frag, Alloc<Frag> > FragStack;
+
+  MemoryControl *m_mc;
+  vector<NFAState, Alloc<NFAState> > m_states;
+  vector<CharSet, Alloc<CharSet> > m_charSets;
+  StateVec m_ruleStarts;
+  vector<size_t, Alloc<size_t> > m_stateRule;  /* token id of each state */
+  bool m_reverse;           /* rules match their input backwards */
+  MatchSemantics m_semantics;   /* see NFAContext::prune() */
+  stateNum m_searchStart;   /* see makeUnanchored() */
+  const BuilderLimits *m_lim;
+
+public:
+  NFA(MemoryControl *, bool reverse);
+
+  static void *operator new(size_t sz);
+  static void *operator new(size_t sz, MemoryControl *mc);
+  static void operator delete(void *ptr, size_t sz, MemoryControl *mc);
+
+  void addRule(TokenList2 *postfix, size_t tokId);
+  void makeUnanchored();
+  void setLimits(const BuilderLimits *lim) {
+    this->m_lim = lim;
+  };
+  void setSemantics(MatchSemantics sem) {
+    this->m_semantics = sem;
+  };
+  MatchSemantics getSemantics() const {
+    return this->m_semantics;
+  };
+
+  stateNum getNumStates() const;
+  size_t getNumRules() const;
+  stateNum getRuleStart(size_t tokId) const;
+  stateNum getSearchStart() const {
+    return this->m_searchStart;
+  };
+  size_t computeByteClasses(uchar *byteClass) const;
+  size_t getMemoryBytes() const;
+  const NFAState &getState(stateNum s) const {
+    return this->m_states[s];
+  };
+  /* NO_TOKEN for states added by makeUnanchored() */
+  size_t getStateRule(stateNum s) const {
+    return s < this->m_stateRule.size() ? this->m_stateRule[s] : NO_TOKEN;
+  };
+  const CharSet &getCharSet(size_t idx) const {
+    return this->m_charSets[idx];
+  };
+
+private:
+  stateNum addState(NFAStateType, stateNum out1, stateNum out2, size_t arg);
+  void patch(stateNum s, stateNum target);
+
+  Frag charFrag(const REToken *);
+  Frag epsilonFrag();
+  Frag concatFrag(Frag, Frag);
+  Frag reverseConcatFrag(Frag, Frag);
+  Frag altFrag(Frag, Frag);
+  Frag starFrag(Frag);
+  Frag qmarkFrag(Frag);
+  Frag quantifierFrag(Frag, const RETokQuantifier &);
+  Frag copyFrag(Frag, stateNum hi);
+};
+
+/********************************/
+
+/*
+ * Scratch space for working with sets of NFA states - epsilon
+ * closures, moves, and simulating the NFA directly. Sets only keep
+ * the char and accept states, sorted, since those are the only ones
+ * that matter for moves and accepting.
+ */
+class NFAContext {
+private:
+  const NFA *m_nfa;
+  StateVec m_stack;
+  StateVec m_cur;
+  StateVec m_next;
+  vector<size_t, Alloc<size_t> > m_mark;
+  size_t m_gen;
+
+public:
+  NFAContext(const NFA *, MemoryControl *);
+
+  void startSet(StateVec *set);
+  void closure(StateVec *set);
+  void prune(StateVec *set) const;
+  void step(const stateNum *set, size_t len, uchar ch, StateVec *next);
+  size_t acceptToken(const stateNum *set, size_t len) const;
+  void acceptRules(const stateNum *set, size_t len, StateVec *rules) const;
+
+  size_t longestMatch(const uchar *buf, size_t len, size_t *tokId);
+};
+
+/********************************/
+
+/* state 0 of every DFA is the dead state - no way out and no match */
+const stateNum DFA_DEAD_STATE = 0;
+const size_t DFA_SHUFFLE_STATES = 16;
+const size_t DFA_STRIDE2_MAX_ENTRIES = 1 << 16;
+const size_t DFA_CHAIN_MIN = 3;
+const size_t DFA_CHAIN_MAX = 32;
+
+/*
+ * One transition of the stride-2 table: the state after both bytes,
+ * premultiplied, and the accept tokens plus one (0 for none) after
+ * the first and the second byte.
+ */
+struct DFAStride2Entry {
+  unsigned int m_next;
+  unsigned short m_midAcc;
+  unsigned short m_endAcc;
+};
+
+/*
+ * How to skip a run of bytes that keep a DFA state on its self loop.
+ * Either the state leaves on at most three bytes, or it stays on
+ * one contiguous range of bytes.
+ */
+struct DFAAccel {
+  enum Kind {
+    ACCEL_BYTES,
+    ACCEL_RANGE
+  };
+
+  Kind m_kind;
+  size_t m_num;
+  uchar m_bytes[3];
+  uchar m_lo;
+  uchar m_hi;
+
+  size_t skip(const uchar *buf, size_t i, size_t len) const;
+};
+
+/*
+ * A run of states that each leave on exactly one byte, as in the
+ * middle of a keyword. The scanner compares the bytes after the
+ * first state with the literal all at once; where they differ the
+ * DFA would have died, so only the accept tokens of the states
+ * passed over need to be looked at.
+ */
+struct DFAChain {
+  uchar m_lit[DFA_CHAIN_MAX];
+  size_t m_len;
+  size_t m_headTok;     /* accept token of the first state */
+  size_t m_end;         /* state after the literal, premultiplied */
+  size_t m_accStart;    /* tokens of the inner states in m_chainAcc, */
+                        /* NO_STATE when none of them accepts        */
+
+  size_t match(const uchar *buf, size_t i, size_t len) const;
+};
+
+class DFAProfile;
+
+/*
+ * Table driven DFA. Bytes are first mapped to their equivalence
+ * class, rows are indexed by class. Each state also has the token
+ * id that is matched when the scan ends in that state.
+ */
+class DFA {
+private:
+  MemoryControl *m_mc;
+  stateNum m_start;
+  size_t m_numClasses;
+  uchar m_byteClass[256];
+  StateVec m_transTbl;
+  vector<size_t, Alloc<size_t> > m_acceptTok;
+
+  /*
+   * Scan form of the table, see pack(). Entries are 1, 2 or 4
+   * bytes; 0 means the table has changed since it was packed.
+   * Packed rows are in their own order: the dead state and every
+   * other state the scan has to look at come first, so any state
+   * below m_packedSpecial (premultiplied) needs the slow path.
+   */
+  vector<uchar, Alloc<uchar> > m_packed;
+  size_t m_width;
+  size_t m_packedStart;
+  size_t m_packedSpecial;
+  vector<DFAAccel, Alloc<DFAAccel> > m_accel;
+
+  /*
+   * Chains, see DFAChain. In the packed table the accept column of
+   * the first state of a chain holds m_chainBase plus the chain's
+   * index, which is above every accept token plus one.
+   */
+  vector<DFAChain, Alloc<DFAChain> > m_chains;
+  vector<size_t, Alloc<size_t> > m_chainAcc;
+  size_t m_chainBase;
+
+  /*
+   * DFAs with at most DFA_SHUFFLE_STATES states also get one 16 byte
+   * vector per byte class, entry i being the next state from state i.
+   */
+  vector<uchar, Alloc<uchar> > m_shuffle;
+  bool m_useShuffle;
+  unsigned int m_shufAccept;
+  uchar m_shufAccel[16];
+
+  /* optional table indexed by pairs of classes, see buildStride2() */
+  vector<DFAStride2Entry, Alloc<DFAStride2Entry> > m_stride2;
+  bool m_useStride2;
+  unsigned short m_clsTimesK[256];
+
+public:
+  DFA(MemoryControl *);
+
+  static void *operator new(size_t sz);
+  static void *operator new(size_t sz, MemoryControl *mc);
+  static void operator delete(void *ptr, size_t sz, MemoryControl *mc);
+
+  void setByteClasses(const uchar *byteClass, size_t numClasses);
+  stateNum addState(size_t tokId);
+  void setStartState(stateNum s);
+  void setTransition(stateNum from, size_t cls, stateNum to) {
+    this->m_transTbl[from * this->m_numClasses + cls] = to;
+    this->m_width = 0;
+  };
+
+  stateNum getNumStates() const;
+  stateNum getStartState() const;
+  size_t getNumClasses() const {
+    return this->m_numClasses;
+  };
+  size_t getByteClass(uchar ch) const {
+    return this->m_byteClass[ch];
+  };
+  const uchar *getByteClassMap() const {
+    return this->m_byteClass;
+  };
+  stateNum getNextState(stateNum s, uchar ch) const {
+    return this->m_transTbl[s * this->m_numClasses + this->m_byteClass[ch]];
+  };
+  stateNum getClassNextState(stateNum s, size_t cls) const {
+    return this->m_transTbl[s * this->m_numClasses + cls];
+  };
+  size_t getAcceptToken(stateNum s) const {
+    return this->m_acceptTok[s];
+  };
+
+  size_t longestMatch(const uchar *buf, size_t len, size_t *tokId) const;
+  size_t longestMatchReverse(const uchar *buf, size_t end,
+			     size_t *tokId) const;
+  size_t shortestMatch(const uchar *buf, size_t len, size_t *tokId) const;
+  bool firstMatchEnd(const uchar *buf, size_t len, size_t *end) const;
+  static bool search(const DFA *fwd, const DFA *rev,
+		     const uchar *buf, size_t len,
+		     size_t *start, size_t *end, size_t *tokId);
+
+  void renumber(const StateVec &newId, stateNum newCount);
+  void reclassify(const uchar *byteClass, size_t numClasses);
+  void copyFrom(const DFA *);
+  void removeUnreachable();
+  bool relayout(const DFAProfile &);
+  size_t fingerprint() const;
+
+  void pack();
+  size_t getTableWidth() const {
+    return this->m_width;
+  };
+  size_t getTableBytes() const {
+    return this->m_width ? this->m_packed.size() : 0;
+  };
+  size_t getNumAccelStates() const {
+    return this->m_width ? this->m_accel.size() : 0;
+  };
+  bool isAccelerated(stateNum s) const;
+  size_t getNumChains() const {
+    return this->m_width ? this->m_chains.size() : 0;
+  };
+  size_t getNumSpecialStates() const {
+    return this->m_width ? this->m_packedSpecial / (this->m_numClasses + 2)
+      : 0;
+  };
+  bool usingShuffle() const {
+    return this->m_width && this->m_useShuffle;
+  };
+  static bool shuffleSupported();
+
+  bool buildStride2();
+  bool usingStride2() const {
+    return this->m_width && this->m_useStride2;
+  };
+
+private:
+  bool findAccel(stateNum s, DFAAccel *accel) const;
+  bool findChain(stateNum s, const unsigned int *classByte, DFAChain *chain);
+  void packShuffle(const size_t *accelIdx);
+};
+
+/********************************/
+
+/*
+ * Visit counts for the states and transitions of one DFA, gathered
+ * by scanning sample input. A profile only applies to DFAs with the
+ * same fingerprint, which is what the same rules built the same way
+ * produce.
+ */
+class DFAProfile {
+private:
+  typedef vector<size_t, Alloc<size_t> > SizeVec;
+
+  MemoryControl *m_mc;
+  size_t m_fingerprint;
+  size_t m_numClasses;
+  SizeVec m_stateCount;
+  SizeVec m_transCount;
+
+public:
+  DFAProfile(MemoryControl *, const DFA *);
+
+  size_t longestMatch(const DFA *, const uchar *buf, size_t len,
+		      size_t *tokId);
+
+  size_t getStateCount(stateNum s) const {
+    return this->m_stateCount[s];
+  };
+  size_t getTransitionCount(stateNum s, size_t cls) const {
+    return this->m_transCount[s * this->m_numClasses + cls];
+  };
+  bool matches(const DFA *) const;
+
+  void save(ostream &) const;
+  bool load(istream &);
+
+  /* orders states most visited first, for sorting */
+  struct HotterState {
+    const DFAProfile *m_prof;
+
+    bool operator()(stateNum a, stateNum b) const {
+      return this->m_prof->getStateCount(a) > this->m_prof->getStateCount(b);
+    };
+  };
+};
+
+/********************************/
+
+/*
+ * Read only DFA with compressed rows, for state counts where dense
+ * rows no longer fit in memory. Every row holds the accept token
+ * and one of three encodings:
+ *
+ *   ROW_RANGE  - classes lo..hi go to one state, the rest to another
+ *   ROW_SPARSE - a short list of (class, state) pairs plus a default
+ *   ROW_COMB   - entries in shared next/check arrays at an offset,
+ *                anything missing is looked up in a default state
+ */
+class CompressedDFA {
+public:
+  enum RowEncoding {
+    ROW_RANGE,
+    ROW_SPARSE,
+    ROW_COMB,
+    NUM_ROW_ENCODINGS
+  };
+
+private:
+  struct Row {
+    RowEncoding m_enc;
+    stateNum m_default;  /* comb: NO_STATE - missing entries are dead */
+    size_t m_a;          /* range: lo, sparse: first entry, comb: base */
+    size_t m_b;          /* range: hi, sparse: number of entries */
+    stateNum m_target;   /* range: state for lo..hi */
+    size_t m_acceptTok;
+  };
+
+  MemoryControl *m_mc;
+  stateNum m_start;
+  size_t m_numClasses;
+  uchar m_byteClass[256];
+  vector<Row, Alloc<Row> > m_rows;
+  vector<uchar, Alloc<uchar> > m_sparseCls;
+  StateVec m_sparseTo;
+  StateVec m_next;
+  StateVec m_check;        /* owner of each comb slot, NO_STATE - free */
+  size_t m_combFree;
+
+  size_t m_numRows[NUM_ROW_ENCODINGS];
+  size_t m_probes[NUM_ROW_ENCODINGS];
+
+public:
+  CompressedDFA(MemoryControl *);
+
+  static void *operator new(size_t sz);
+  static void *operator new(size_t sz, MemoryControl *mc);
+  static void operator delete(void *ptr, size_t sz, MemoryControl *mc);
+
+  void compress(const DFA *);
+
+  stateNum getNumStates() const {
+    return this->m_rows.size();
+  };
+  stateNum getStartState() const {
+    return this->m_start;
+  };
+  size_t getAcceptToken(stateNum s) const {
+    return this->m_rows[s].m_acceptTok;
+  };
+  stateNum getNextState(stateNum s, uchar ch) const {
+    return this->getClassNextState(s, this->m_byteClass[ch]);
+  };
+  stateNum getClassNextState(stateNum s, size_t cls) const;
+
+  size_t longestMatch(const uchar *buf, size_t len, size_t *tokId) const;
+
+  size_t getNumRows(RowEncoding enc) const {
+    return this->m_numRows[enc];
+  };
+  size_t getMemoryBytes() const;
+  double getAvgProbes(RowEncoding enc) const;
+
+private:
+  void placeComb(stateNum s, const StateVec &row, stateNum def,
+		 const DFA *dfa);
+  size_t countProbes(stateNum s, size_t cls) const;
+};
+
+/********************************/
+
+/*
+ * DFA kept in two tiers. The hot states are renumbered 0..H-1 and
+ * keep dense rows; the rest are stored as a CompressedDFA and each
+ * row is decoded into a small direct mapped cache when the scan
+ * reaches it. Hot states are the ones a profile saw most, or
+ * without one the ones closest to the start state.
+ *
+ * Scanning fills the cache, so a TieredDFA must not be shared
+ * between threads.
+ */
+class TieredDFA {
+private:
+  MemoryControl *m_mc;
+  stateNum m_start;
+  stateNum m_numStates;
+  stateNum m_numHot;
+  size_t m_numClasses;
+  uchar m_byteClass[256];
+  StateVec m_hot;
+  vector<size_t, Alloc<size_t> > m_hotAccept;
+
+  /* cold rows, state s is row s - m_numHot */
+  CompressedDFA *m_cold;
+
+  /* m_cacheTag[i] is the state decoded into slot i, or NO_STATE */
+  size_t m_cacheMask;
+  StateVec m_cacheTag;
+  StateVec m_cache;
+  vector<size_t, Alloc<size_t> > m_cacheAccept;
+  size_t m_cacheMisses;
+
+public:
+  TieredDFA(MemoryControl *);
+  ~TieredDFA();
+
+  static void *operator new(size_t sz);
+  static void *operator new(size_t sz, MemoryControl *mc);
+  static void operator delete(void *ptr, size_t sz, MemoryControl *mc);
+
+  void build(const DFA *, const DFAProfile *, size_t numHot,
+	     size_t cacheRows);
+
+  stateNum getNumStates() const {
+    return this->m_numStates;
+  };
+  stateNum getNumHotStates() const {
+    return this->m_numHot;
+  };
+  stateNum getStartState() const {
+    return this->m_start;
+  };
+  size_t getCacheMisses() const {
+    return this->m_cacheMisses;
+  };
+  size_t getMemoryBytes() const;
+
+  size_t longestMatch(const uchar *buf, size_t len, size_t *tokId);
+
+private:
+  size_t decodeCold(stateNum s);
+};
+
+/********************************/
+
+/*
+ * The rules split into groups, each with its own DFA. A scan walks
+ * all the DFAs over the input together in one pass, dropping each
+ * as it dies, and keeps the longest match over all groups, the
+ * lowest token id on a tie.
+ *
+ * The walk keeps its states in the object, so a PartitionedDFA
+ * must not be shared between threads.
+ */
+class PartitionedDFA {
+private:
+  MemoryControl *m_mc;
+  vector<DFA *, Alloc<DFA *> > m_groups;
+  vector<size_t, Alloc<size_t> > m_ruleGroup;
+  StateVec m_cur;
+  vector<size_t, Alloc<size_t> > m_live;
+  MatchSemantics m_semantics;
 
 public:
-  NFA() {;};
+  PartitionedDFA(MemoryControl *);
+  ~PartitionedDFA();
 
   static void *operator new(size_t sz);
   static void *operator new(size_t sz, MemoryControl *mc);
   static void operator delete(void *ptr, size_t sz, MemoryControl *mc);
 
+  void addGroup(DFA *);
+  void setGroup(size_t g, DFA *);
+  void setRuleGroups(const vector<size_t, Alloc<size_t> > &ruleGroup);
+  /* how the matches of the groups are combined */
+  void setSemantics(MatchSemantics sem) {
+    this->m_semantics = sem;
+  };
+
+  size_t getNumGroups() const {
+    return this->m_groups.size();
+  };
+  const DFA *getGroup(size_t g) const {
+    return this->m_groups[g];
+  };
+  size_t getRuleGroup(size_t tokId) const {
+    return this->m_ruleGroup[tokId];
+  };
   stateNum getNumStates() const;
+
+  size_t longestMatch(const uchar *buf, size_t len, size_t *tokId);
+};
+
+/********************************/
+
+/*
+ * Hopcroft's partition refinement. The initial partition puts
+ * states with different accept tokens into different blocks, so
+ * states that match different rules are never merged.
+ */
+class DFAMinimizer {
+private:
+  typedef vector<size_t, Alloc<size_t> > SizeVec;
+
+  MemoryControl *m_mc;
+
+  /* predecessors, grouped by (target state, byte class) */
+  SizeVec m_predStart;
+  StateVec m_preds;
+
+  /* the partition - elements of a block are contiguous in m_elems */
+  StateVec m_elems;
+  SizeVec m_loc;
+  SizeVec m_blockOf;
+  SizeVec m_first;
+  SizeVec m_end;
+  SizeVec m_marked;
+  SizeVec m_touched;
+
+  SizeVec m_work;
+  vector<bool, Alloc<bool> > m_inWork;
+
+  const BuilderLimits *m_lim;
+
+public:
+  DFAMinimizer(MemoryControl *);
+
+  void setLimits(const BuilderLimits *lim) {
+    this->m_lim = lim;
+  };
+  void minimize(DFA *);
+
+private:
+  void initPartition(const DFA *);
+  void buildPreds(const DFA *);
+  void mark(stateNum s);
+  void splitTouched();
+};
+
+/*
+ * Minimization by rounds of signature refinement, spread over
+ * threads. In each round the signature of a state is its block
+ * and the blocks of its successors; states with equal signatures
+ * share a block in the next round. The threads hash signatures over
+ * ranges of states, then each thread groups the states of one hash
+ * shard. Rounds stop when no block splits. Blocks are numbered by
+ * their lowest state, so the result is the same as DFAMinimizer's.
+ *
+ * A round is cheap and parallel but there can be as many rounds as
+ * the longest distinguishing string, so DFAMinimizer is still the
+ * better choice for one thread.
+ */
+class ParallelDFAMinimizer {
+private:
+  typedef vector<size_t, Alloc<size_t> > SizeVec;
+  typedef void (ParallelDFAMinimizer::*Task)(size_t);
+
+  struct TaskArg {
+    ParallelDFAMinimizer *m_owner;
+    Task m_task;
+    size_t m_index;
+  };
+
+  MemoryControl *m_mc;
+  size_t m_numThreads;
+  const DFA *m_dfa;
+  const BuilderLimits *m_lim;
+
+  SizeVec m_block;
+  SizeVec m_hash;
+  SizeVec m_rep;
+
+  /* states grouped by shard, in increasing order within a shard */
+  SizeVec m_shardStart;
+  StateVec m_order;
+
+  /* open addressing per shard, m_slotStart[t] is shard t's table */
+  SizeVec m_slotStart;
+  StateVec m_slots;
+
+  vector<TaskArg, Alloc<TaskArg> > m_args;
+  vector<pthread_t, Alloc<pthread_t> > m_threads;
+
+public:
+  ParallelDFAMinimizer(MemoryControl *, size_t numThreads);
+
+  size_t getNumThreads() const {
+    return this->m_numThreads;
+  };
+  void setLimits(const BuilderLimits *lim) {
+    this->m_lim = lim;
+  };
+
+  void minimize(DFA *);
+
+private:
+  static void *threadMain(void *);
+  void runTasks(Task);
+  void hashRange(size_t t);
+  void groupShard(size_t t);
+  bool sameSignature(stateNum a, stateNum b) const;
+  size_t refine();
+};
+
+/********************************/
+
+/*
+ * Interning table for sets of NFA states. Sets are stored sorted,
+ * back to back in one pool, and looked up by hash. The id of a set
+ * is the order in which it was first interned.
+ */
+class StateSetTable {
+private:
+  MemoryControl *m_mc;
+  StateVec m_pool;
+  vector<size_t, Alloc<size_t> > m_setStart;
+  vector<size_t, Alloc<size_t> > m_hash;
+  vector<size_t, Alloc<size_t> > m_chain;
+  vector<size_t, Alloc<size_t> > m_buckets;
+
+public:
+  StateSetTable(MemoryControl *);
+
+  size_t size() const {
+    return this->m_hash.size();
+  };
+  size_t intern(const StateVec &set, bool *isNew);
+  size_t lookup(const StateVec &set) const;
+  void clear();
+  size_t getMemoryBytes() const;
+  const stateNum *getSet(size_t id, size_t *len) const;
+
+  static size_t hashSet(const stateNum *, size_t);
+
+private:
+  size_t find(const StateVec &set, size_t h) const;
+  void rehash(size_t nBuckets);
+};
+
+/*
+ * Subset construction. Each DFA state is the epsilon closure of a
+ * set of NFA states, see NFAContext.
+ */
+class SubsetBuilder {
+private:
+  const NFA *m_nfa;
+  MemoryControl *m_mc;
+  const BuilderLimits *m_lim;
+  StateSetTable m_sets;
+  NFAContext m_ctx;
+  StateVec m_cur;
+  StateVec m_next;
+  size_t m_numClasses;
+  uchar m_byteClass[256];
+  uchar m_classRep[256];
+  StateSetTable *m_ruleSets;
+  StateVec m_rules;
+
+public:
+  SubsetBuilder(const NFA *, MemoryControl *tmpMC, const BuilderLimits *);
+
+  void build(DFA *);
+  void extend(DFA *);
+  void setLimits(const BuilderLimits *lim) {
+    this->m_lim = lim;
+  };
+  /*
+   * When set, the accept token of each DFA state is the id in the
+   * table of the sorted list of every rule the state accepts.
+   */
+  void setRuleSets(StateSetTable *ruleSets) {
+    this->m_ruleSets = ruleSets;
+  };
+
+private:
+  void computeClasses();
+  void explore(DFA *, size_t firstId);
+  stateNum addDFAState(DFA *, const StateVec &set);
+};
+
+/*
+ * Builds a DFA straight from the rules with Brzozowski derivatives,
+ * no NFA involved. Expressions are hash consed and kept in a normal
+ * form - | and & are flattened, sorted and free of duplicates,
+ * concatenation is nested to the right, and the usual identities
+ * for the empty language and the empty string are applied. Then
+ * equal derivatives get the same id and each rule has finitely many
+ * of them. A DFA state is the tuple of the derivatives of all the
+ * rules, its accept token is the first rule whose derivative
+ * matches the empty string.
+ *
+ * Expressions can also be intersected and complemented, which the
+ * NFA path cannot do.
+ */
+class DerivativeBuilder {
+public:
+  enum Kind {
+    RE_EMPTY,     /* matches nothing */
+    RE_EPS,       /* matches the empty string */
+    RE_SET,       /* one byte in m_charSets[m_a] */
+    RE_CAT,
+    RE_OR,
+    RE_AND,
+    RE_NOT,
+    RE_STAR
+  };
+
+  /* ids of the expressions every builder starts with */
+  static const size_t EXPR_EMPTY = 0;
+  static const size_t EXPR_EPS = 1;
+  static const size_t EXPR_ANY = 2;   /* ~EMPTY - every string */
+
+private:
+  struct Expr {
+    Kind m_kind;
+    size_t m_a;
+    size_t m_b;
+    bool m_nullable;
+  };
+
+  MemoryControl *m_mc;
+  const BuilderLimits *m_lim;
+
+  StateSetTable m_exprTbl;            /* key: kind, a, b */
+  vector<Expr, Alloc<Expr> > m_exprs;
+  vector<CharSet, Alloc<CharSet> > m_charSets;
+  StateVec m_key;
+  StateVec m_rules;
+
+  size_t m_numClasses;
+  uchar m_byteClass[256];
+  uchar m_classRep[256];
+  StateVec m_deriv;                   /* expr * classes + class */
+
+  StateSetTable m_states;
+  StateVec m_cur;
+  StateVec m_tuple;
+  MatchSemantics m_semantics;
+
+public:
+  DerivativeBuilder(MemoryControl *, const BuilderLimits *);
+
+  /* see NFAContext::prune() */
+  void setSemantics(MatchSemantics sem) {
+    this->m_semantics = sem;
+  };
+
+  size_t parse(const char *regex, size_t len);
+  void addRule(size_t expr);
+
+  size_t mkSet(const CharSet &);
+  size_t mkCat(size_t, size_t);
+  size_t mkOr(size_t, size_t);
+  size_t mkAnd(size_t, size_t);
+  size_t mkNot(size_t);
+  size_t mkStar(size_t);
+  size_t mkRepeat(size_t, size_t lo, size_t hi, bool unbounded);
+
+  size_t getNumExprs() const {
+    return this->m_exprs.size();
+  };
+  Kind getKind(size_t e) const {
+    return this->m_exprs[e].m_kind;
+  };
+  bool isNullable(size_t e) const {
+    return this->m_exprs[e].m_nullable;
+  };
+
+  void build(DFA *);
+
+private:
+  size_t intern(Kind, size_t a, size_t b);
+  size_t mkAssoc(Kind, size_t, size_t);
+  void flatten(Kind, size_t, StateVec *);
+  size_t fromPostfix(const TokenList2 *);
+  size_t deriv(size_t e, size_t cls);
+  stateNum addDFAState(DFA *, const StateVec &tuple);
+  void prune(StateVec *tuple) const;
+};
+
+/*
+ * What Builder::BuildDFAIncremental keeps between calls. The DFA is
+ * the unminimized one, its state ids are the set ids of the subset
+ * builder.
+ */
+class IncrementalBuild {
+public:
+  MemoryControl *m_mc;
+  NFA *m_nfa;
+  SubsetBuilder *m_sb;
+  DFA *m_dfa;
+  size_t m_numRules;
+
+  IncrementalBuild(MemoryControl *);
+  ~IncrementalBuild();
+
+  static void *operator new(size_t sz, MemoryControl *mc);
+  static void operator delete(void *ptr, MemoryControl *mc);
+};
+
+/*
+ * Passes calls on to another MemoryControl one at a time, so that
+ * threads can share a MemoryControl that was not written for it.
+ */
+class LockedMemoryControl : public MemoryControl {
+private:
+  MemoryControl *m_mc;
+  pthread_mutex_t m_lock;
+
+public:
+  LockedMemoryControl(MemoryControl *);
+  ~LockedMemoryControl();
+
+  virtual void *allocate(size_t);
+  virtual void deallocate(void *, size_t);
+};
+
+/*
+ * Subset construction spread over threads. States are expanded a
+ * breadth first level at a time: the threads take chunks of the
+ * level from a shared counter and compute the successor sets, then
+ * the calling thread interns them in state and class order. So the
+ * DFA comes out numbered exactly as SubsetBuilder numbers it, no
+ * matter how many threads there are or how the work was split.
+ */
+class ParallelSubsetBuilder {
+private:
+  struct Result {
+    size_t m_worker;
+    size_t m_start;
+    size_t m_len;
+  };
+
+  class Worker {
+  public:
+    ParallelSubsetBuilder *m_owner;
+    size_t m_id;
+    NFAContext m_ctx;
+    StateVec m_next;
+    StateVec m_pool;
+    bool m_failed;
+
+    Worker(ParallelSubsetBuilder *, size_t id, MemoryControl *);
+    void run();
+    static void *threadMain(void *);
+  };
+
+  const NFA *m_nfa;
+  MemoryControl *m_mc;
+  const BuilderLimits *m_lim;
+  LockedMemoryControl m_lockedMC;
+  StateSetTable m_sets;
+  StateVec m_next;
+  size_t m_numClasses;
+  uchar m_byteClass[256];
+  uchar m_classRep[256];
+
+  vector<Worker *, Alloc<Worker *> > m_workers;
+  vector<pthread_t, Alloc<pthread_t> > m_threads;
+  vector<Result, Alloc<Result> > m_results;
+  size_t m_levelStart;
+  size_t m_levelEnd;
+  size_t m_nextChunk;
+
+public:
+  ParallelSubsetBuilder(const NFA *, MemoryControl *tmpMC,
+			const BuilderLimits *, size_t numThreads);
+  ~ParallelSubsetBuilder();
+
+  size_t getNumThreads() const {
+    return this->m_workers.size();
+  };
+
+  void build(DFA *);
+
+  static size_t defaultNumThreads();
+
+private:
+  void expandLevel();
+  void freeWorkers();
+  stateNum addDFAState(DFA *, const StateVec &set);
+};
+
+/********************************/
+
+/*
+ * A DFA that reports every rule that matches instead of the best
+ * one. The accept token of a state is the id of its rule list in
+ * m_lists, so the minimizer only merges states that accept the
+ * same rules and each distinct list is stored once.
+ *
+ * matchAny keeps marks in the object, so a RuleSetDFA must not be
+ * shared between threads.
+ */
+class RuleSetDFA {
+private:
+  MemoryControl *m_mc;
+  DFA *m_dfa;
+  StateSetTable m_lists;
+  vector<size_t, Alloc<size_t> > m_mark;
+  size_t m_gen;
+  StateVec m_seen;
+
+public:
+  RuleSetDFA(MemoryControl *);
+  ~RuleSetDFA();
+
+  static void *operator new(size_t sz);
+  static void *operator new(size_t sz, MemoryControl *mc);
+  static void operator delete(void *ptr, size_t sz, MemoryControl *mc);
+
+  StateSetTable *getLists() {
+    return &this->m_lists;
+  };
+  void setDFA(DFA *);
+  const DFA *getDFA() const {
+    return this->m_dfa;
+  };
+  size_t getNumLists() const {
+    return this->m_lists.size();
+  };
+  const stateNum *getRules(stateNum s, size_t *len) const;
+
+  size_t matchWhole(const uchar *buf, size_t len, StateVec *rules) const;
+  size_t matchAny(const uchar *buf, size_t len, StateVec *rules);
+};
+
+/********************************/
+
+/*
+ * A DFA that is built while scanning. States are created the first
+ * time a scan reaches them and kept in a cache of bounded size; when
+ * the cache is full it is flushed and rebuilt from scratch. If the
+ * cache keeps getting flushed without much progress through the
+ * input the LazyDFA gives up on caching and simulates the NFA.
+ */
+class LazyDFA {
+private:
+  MemoryControl *m_mc;
+  NFA *m_nfa;
+  NFAContext m_ctx;
+  size_t m_maxStates;
+
+  size_t m_numClasses;
+  uchar m_byteClass[256];
+  uchar m_classRep[256];
+
+  StateSetTable m_sets;
+  StateVec m_transTbl;       /* NO_STATE - not computed yet */
+  vector<size_t, Alloc<size_t> > m_acceptTok;
+  stateNum m_start;
+  StateVec m_startSet;
+
+  StateVec m_cur;
+  StateVec m_next;
+
+  size_t m_numFlushes;
+  size_t m_badFlushes;
+  size_t m_bytesSinceFlush;
+  bool m_useNFA;
+
+public:
+  LazyDFA(MemoryControl *, NFA *, size_t maxStates);
+  ~LazyDFA();
+
+  static void *operator new(size_t sz);
+  static void *operator new(size_t sz, MemoryControl *mc);
+  static void operator delete(void *ptr, MemoryControl *mc);
+
+  size_t longestMatch(const uchar *buf, size_t len, size_t *tokId);
+
+  size_t getNumCachedStates() const {
+    return this->m_acceptTok.size();
+  };
+  size_t getNumFlushes() const {
+    return this->m_numFlushes;
+  };
+  bool usingNFA() const {
+    return this->m_useNFA;
+  };
+
+private:
+  void reset();
+  void flush();
+  stateNum addState(const StateVec &set);
+  stateNum computeNext(stateNum s, size_t cls);
+};
+
+/*
+ * What Builder::BuildScanner returns: a DFA if one could be built
+ * within the limits, else a LazyDFA. Builder::BuildHybridScanner
+ * may give it both, each for part of the rules; a scan then runs
+ * both and picks one of the two matches the way the match
+ * semantics would have picked among all the rules.
+ */
+class Scanner {
+private:
+  MemoryControl *m_mc;
+  DFA *m_dfa;
+  LazyDFA *m_lazy;
+  MatchSemantics m_semantics;
+
+public:
+  Scanner(MemoryControl *, DFA *, LazyDFA *);
+  ~Scanner();
+
+  static void *operator new(size_t sz, MemoryControl *mc);
+  static void operator delete(void *ptr, MemoryControl *mc);
+
+  const DFA *getDFA() const {
+    return this->m_dfa;
+  };
+  LazyDFA *getLazyDFA() {
+    return this->m_lazy;
+  };
+  bool isDegraded() const {
+    return this->m_dfa == NULL;
+  };
+  bool isHybrid() const {
+    return this->m_dfa != NULL && this->m_lazy != NULL;
+  };
+  /* how a hybrid scan combines the matches of its two engines */
+  void setSemantics(MatchSemantics sem) {
+    this->m_semantics = sem;
+  };
+
+  size_t longestMatch(const uchar *buf, size_t len, size_t *tokId);
+};
+
+/*
+ * Lazy DFA with one state cache for all threads. Published states
+ * never change; a transition goes from NO_STATE to its final value
+ * exactly once. Readers use no locks, new states are claimed with
+ * an atomic counter and published into the set table with
+ * compare-and-swap. The lock only serializes MemoryControl calls.
+ */
+class SharedLazyDFA {
+private:
+  struct StateInfo {
+    const stateNum *m_set;
+    size_t m_len;
+    size_t m_hash;
+    size_t m_acceptTok;
+  };
+
+  MemoryControl *m_mc;
+  NFA *m_nfa;
+  size_t m_maxStates;
+
+  size_t m_numClasses;
+  uchar m_byteClass[256];
+  uchar m_classRep[256];
+
+  vector<StateInfo, Alloc<StateInfo> > m_info;
+  StateVec m_transTbl;       /* NO_STATE - not computed yet */
+  StateVec m_slots;          /* open addressing, NO_STATE - empty */
+  size_t m_numStates;
+  stateNum m_start;
+  pthread_mutex_t m_lock;
+
+public:
+  SharedLazyDFA(MemoryControl *, NFA *, size_t maxStates);
+  ~SharedLazyDFA();
+
+  static void *operator new(size_t sz);
+  static void *operator new(size_t sz, MemoryControl *mc);
+  static void operator delete(void *ptr, MemoryControl *mc);
+
+  const NFA *getNFA() const {
+    return this->m_nfa;
+  };
+  size_t getNumStates() const {
+    return __atomic_load_n(&this->m_numStates, __ATOMIC_RELAXED);
+  };
+  size_t getMaxStates() const {
+    return this->m_maxStates;
+  };
+  stateNum getStartState() const {
+    return this->m_start;
+  };
+  size_t getByteClass(uchar ch) const {
+    return this->m_byteClass[ch];
+  };
+  uchar getClassRep(size_t cls) const {
+    return this->m_classRep[cls];
+  };
+  stateNum getTransition(stateNum s, size_t cls) const {
+    return __atomic_load_n(&this->m_transTbl[s * this->m_numClasses + cls],
+			   __ATOMIC_ACQUIRE);
+  };
+  size_t getAcceptToken(stateNum s) const {
+    return this->m_info[s].m_acceptTok;
+  };
+  const stateNum *getSet(stateNum s, size_t *len) const {
+    *len = this->m_info[s].m_len;
+    return this->m_info[s].m_set;
+  };
+
+  stateNum addTransition(stateNum s, size_t cls, const StateVec &set,
+			 const NFAContext &ctx);
+
+private:
+  SharedLazyDFA(const SharedLazyDFA &);
+  SharedLazyDFA &operator=(const SharedLazyDFA &);
+
+  stateNum intern(const StateVec &set, const NFAContext &ctx);
+  bool sameSet(stateNum id, const StateVec &set, size_t h) const;
+  void freeSet(stateNum id);
 };
 
+/*
+ * Per thread scratch space for scanning with a SharedLazyDFA.
+ */
+class SharedLazyScanner {
+private:
+  SharedLazyDFA *m_dfa;
+  NFAContext m_ctx;
+  StateVec m_cur;
+  StateVec m_next;
+
+public:
+  SharedLazyScanner(SharedLazyDFA *, MemoryControl *);
+
+  size_t longestMatch(const uchar *buf, size_t len, size_t *tokId);
+};
 
 }
 
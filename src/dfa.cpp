@@ -0,0 +1,1369 @@
+// Copyright (c) 2010, Ram Bhamidipaty
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// 
+//     * Redistributions of source code must retain the above
+//       copyright notice, this list of conditions and the
+//       following disclaimer.
+// 
+//     * Redistributions in binary form must reproduce the above
+//       copyright notice, this list of conditions and the following
+//       disclaimer in the documentation and/or other materials
+//       provided with the distribution.
+// 
+//     * Neither the name of Ram Bhamidipaty nor the names of its
+//       contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <cstring>
+
+#include <memory>
+#include <limits>
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include <algorithm>
+#include <iostream>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPPTOKEN_SHUFFLE 1
+#include <tmmintrin.h>
+#endif
+using namespace std;
+
+#include "cpptoken.h"
+#include "cpptoken_private.h"
+using namespace cpptoken;
+
+/********************************/
+static void *
+DFA::operator new(size_t sz)
+{
+  void *ptr = ::operator new(sz);
+  return ptr;
+}
+
+static void *
+DFA::operator new(size_t sz, MemoryControl *mc)
+{
+  void *ptr = mc->allocate(sz);
+  return ptr;
+}
+
+static void
+DFA::operator delete(void *ptr, size_t sz, MemoryControl *mc)
+{
+  mc->deallocate(ptr, sz);
+}
+
+/********************************/
+
+DFA *
+Builder::BuildDFA(MemoryControl *dfaMC, BuilderLimits *lim)
+{
+  NFA *nfa = this->BuildNFA(this->m_mc, lim);
+  return this->buildDFAFromNFA(dfaMC, lim, nfa, 1);
+}
+
+DFA *
+Builder::BuildDFA(MemoryControl *dfaMC, BuilderLimits *lim, size_t numThreads)
+{
+  NFA *nfa = this->BuildNFA(this->m_mc, lim);
+  return this->buildDFAFromNFA(dfaMC, lim, nfa, numThreads);
+}
+
+DFA *
+Builder::BuildReverseDFA(MemoryControl *dfaMC, BuilderLimits *lim)
+{
+  NFA *nfa = this->BuildNFA(this->m_mc, lim, true);
+  return this->buildDFAFromNFA(dfaMC, lim, nfa, 1);
+}
+
+DFA *
+Builder::BuildSearchDFA(MemoryControl *dfaMC, BuilderLimits *lim)
+{
+  NFA *nfa = this->BuildNFA(this->m_mc, lim);
+  try {
+    nfa->makeUnanchored();
+  }
+  catch (...) {
+    nfa->~NFA();
+    this->m_mc->deallocate(nfa, sizeof(*nfa));
+    throw;
+  }
+  return this->buildDFAFromNFA(dfaMC, lim, nfa, 1);
+}
+
+/* takes ownership of the NFA, which comes from the builder's memory */
+DFA *
+Builder::buildDFAFromNFA(MemoryControl *dfaMC, BuilderLimits *lim, NFA *nfa,
+			 size_t numThreads)
+{
+  DFA *res = NULL;
+
+  try {
+    res = new (dfaMC) DFA(dfaMC);
+    if (numThreads == 1) {
+      SubsetBuilder sb(nfa, this->m_mc, lim);
+      sb.build(res);
+    }
+    else {
+      ParallelSubsetBuilder psb(nfa, this->m_mc, lim, numThreads);
+      psb.build(res);
+    }
+  }
+  catch (...) {
+    if (res) {
+      res->~DFA();
+      dfaMC->deallocate(res, sizeof(*res));
+    }
+    nfa->~NFA();
+    this->m_mc->deallocate(nfa, sizeof(*nfa));
+    throw;
+  }
+
+  nfa->~NFA();
+  this->m_mc->deallocate(nfa, sizeof(*nfa));
+
+  try {
+    if (numThreads == 1) {
+      DFAMinimizer dm(this->m_mc);
+      dm.setLimits(lim);
+      dm.minimize(res);
+    }
+    else {
+      ParallelDFAMinimizer pdm(this->m_mc, numThreads);
+      pdm.setLimits(lim);
+      pdm.minimize(res);
+    }
+    res->pack();
+  }
+  catch (...) {
+    res->~DFA();
+    dfaMC->deallocate(res, sizeof(*res));
+    throw;
+  }
+
+  return res;
+}
+
+/********************************/
+
+DFA::DFA(MemoryControl *mc)
+  : m_mc(mc),
+    m_start(DFA_DEAD_STATE),
+    m_numClasses(256),
+    m_transTbl(makeAlloc<stateNum>(mc)),
+    m_acceptTok(makeAlloc<size_t>(mc)),
+    m_packed(makeAlloc<uchar>(mc)),
+    m_width(0),
+    m_packedStart(0),
+    m_packedSpecial(0),
+    m_accel(makeAlloc<DFAAccel>(mc)),
+    m_chains(makeAlloc<DFAChain>(mc)),
+    m_chainAcc(makeAlloc<size_t>(mc)),
+    m_chainBase(NO_TOKEN),
+    m_shuffle(makeAlloc<uchar>(mc)),
+    m_useShuffle(false),
+    m_shufAccept(0),
+    m_stride2(makeAlloc<DFAStride2Entry>(mc)),
+    m_useStride2(false)
+{
+  memset(this->m_shufAccel, 0, sizeof(this->m_shufAccel));
+  for (unsigned int ch = 0; ch < 256; ch++)
+    this->m_byteClass[ch] = (uchar)ch;
+}
+
+/* must be called before any states are added */
+void
+DFA::setByteClasses(const uchar *byteClass, size_t numClasses)
+{
+  memcpy(this->m_byteClass, byteClass, 256);
+  this->m_numClasses = numClasses;
+  this->m_width = 0;
+}
+
+stateNum
+DFA::addState(size_t tokId)
+{
+  stateNum res = this->m_acceptTok.size();
+  this->m_width = 0;
+  this->m_transTbl.resize(this->m_transTbl.size() + this->m_numClasses,
+			  DFA_DEAD_STATE);
+  try {
+    this->m_acceptTok.push_back(tokId);
+  }
+  catch (const bad_alloc &e) {
+    this->m_transTbl.resize(res * this->m_numClasses);
+    throw;
+  }
+  return res;
+}
+
+void
+DFA::setStartState(stateNum s)
+{
+  this->m_start = s;
+  this->m_width = 0;
+}
+
+stateNum
+DFA::getNumStates() const
+{
+  return this->m_acceptTok.size();
+}
+
+stateNum
+DFA::getStartState() const
+{
+  return this->m_start;
+}
+
+/*
+ * Switch to a finer byte class map. Each new class must lie inside
+ * one old class, its row entries are copied from that class.
+ */
+void
+DFA::reclassify(const uchar *byteClass, size_t numClasses)
+{
+  size_t oldK = this->m_numClasses;
+  size_t n = this->getNumStates();
+  size_t oldOf[256];
+  for (unsigned int ch = 0; ch < 256; ch++)
+    oldOf[ byteClass[ch] ] = this->m_byteClass[ch];
+
+  StateVec tbl(makeAlloc<stateNum>(this->m_mc));
+  tbl.resize(n * numClasses);
+  for (stateNum s = 0; s < n; s++)
+    for (size_t c = 0; c < numClasses; c++)
+      tbl[s * numClasses + c] = this->m_transTbl[s * oldK + oldOf[c]];
+
+  this->m_transTbl.swap(tbl);
+  memcpy(this->m_byteClass, byteClass, 256);
+  this->m_numClasses = numClasses;
+  this->m_width = 0;
+}
+
+/* make this an unpacked copy of other */
+void
+DFA::copyFrom(const DFA *other)
+{
+  this->m_transTbl = other->m_transTbl;
+  this->m_acceptTok = other->m_acceptTok;
+  memcpy(this->m_byteClass, other->m_byteClass, 256);
+  this->m_numClasses = other->m_numClasses;
+  this->m_start = other->m_start;
+  this->m_width = 0;
+}
+
+/* drop the states that cannot be reached from the start state */
+void
+DFA::removeUnreachable()
+{
+  size_t n = this->getNumStates();
+  size_t k = this->m_numClasses;
+  StateVec newId(makeAlloc<stateNum>(this->m_mc));
+  StateVec stack(makeAlloc<stateNum>(this->m_mc));
+  newId.resize(n, NO_STATE);
+
+  newId[DFA_DEAD_STATE] = DFA_DEAD_STATE;
+  stateNum count = 1;
+  stack.push_back(this->m_start);
+  while (!stack.empty()) {
+    stateNum s = stack.back();
+    stack.pop_back();
+    if (newId[s] != NO_STATE)
+      continue;
+    newId[s] = count++;
+    for (size_t c = 0; c < k; c++)
+      if (newId[ this->m_transTbl[s * k + c] ] == NO_STATE)
+	stack.push_back(this->m_transTbl[s * k + c]);
+  }
+  if (count == n)
+    return;
+
+  /* unreachable states fold into the dead state, its row wins */
+  for (stateNum s = 0; s < n; s++)
+    if (newId[s] == NO_STATE)
+      newId[s] = DFA_DEAD_STATE;
+  this->renumber(newId, count);
+}
+
+/*
+ * Packed tables. Each row has one entry per byte class followed by
+ * the accept token plus one and the accelerator index plus one
+ * (0 for none). The first state of a chain has its chain's entry in
+ * the accept column instead, see DFAChain. State s is stored as row
+ * packId[s], and state numbers are stored premultiplied by the row
+ * length, so a step is a single add and load. The dead state is
+ * still 0.
+ */
+template <class T>
+static void
+packTable(T *out, const stateNum *tbl, const size_t *acc,
+	  const size_t *accelIdx, const size_t *chainIdx, size_t chainBase,
+	  const stateNum *packId, size_t numStates, size_t numClasses)
+{
+  size_t stride = numClasses + 2;
+  for (size_t s = 0; s < numStates; s++) {
+    T *row = out + packId[s] * stride;
+    for (size_t c = 0; c < numClasses; c++)
+      row[c] = (T)(packId[tbl[s * numClasses + c]] * stride);
+    if (chainIdx[s])
+      row[numClasses] = (T)(chainBase + chainIdx[s] - 1);
+    else
+      row[numClasses] = (T)(acc[s] == NO_TOKEN ? 0 : acc[s] + 1);
+    row[numClasses + 1] = (T)accelIdx[s];
+  }
+}
+
+/*
+ * States at or above special are plain: not dead, not accepting, no
+ * accelerator and no chain, so the only test per byte is one compare
+ * against special. From a plain state four bytes are stepped at once
+ * and only their lowest state is compared; if one of them is special
+ * the four are redone a byte at a time. Transitions out of special
+ * states are still in the table, so running past one is harmless.
+ *
+ * In the slow path the accelerator column is only read when a byte
+ * leaves the state unchanged. Chains hide behind the accept column.
+ * The start state never starts a chain.
+ */
+template <class T>
+static size_t
+scanPacked(const T *tbl, const uchar *cls, size_t stride, size_t s,
+	   size_t special, const DFAAccel *accel, const DFAChain *chains,
+	   size_t chainBase, const size_t *chainAcc, const uchar *buf,
+	   size_t len, size_t *tokId)
+{
+  size_t acc = tbl[s + stride - 2];
+  size_t bestTok = acc ? acc - 1 : NO_TOKEN;
+  size_t bestLen = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    if (s >= special) {
+      while (i + 4 <= len) {
+	size_t s1 = tbl[s + cls[buf[i]]];
+	size_t s2 = tbl[s1 + cls[buf[i + 1]]];
+	size_t s3 = tbl[s2 + cls[buf[i + 2]]];
+	size_t s4 = tbl[s3 + cls[buf[i + 3]]];
+	size_t lo = s1 < s2 ? s1 : s2;
+	size_t hi = s3 < s4 ? s3 : s4;
+	if ((lo < hi ? lo : hi) < special)
+	  break;
+	s = s4;
+	i += 4;
+      }
+      if (i == len)
+	break;
+    }
+
+    size_t prev = s;
+    s = tbl[s + cls[buf[i]]];
+    if (s >= special)
+      continue;
+    if (s == DFA_DEAD_STATE)
+      break;
+    if (s == prev && tbl[s + stride - 1])
+      i = accel[tbl[s + stride - 1] - 1].skip(buf, i + 1, len) - 1;
+    acc = tbl[s + stride - 2];
+    if (!acc)
+      continue;
+
+    while (acc >= chainBase) {
+      const DFAChain &ch = chains[acc - chainBase];
+      if (ch.m_headTok != NO_TOKEN) {
+	bestTok = ch.m_headTok;
+	bestLen = i + 1;
+      }
+      size_t m = ch.match(buf, i + 1, len);
+      if (m < ch.m_len) {
+	/* died inside the chain, or the buffer ended there */
+	if (ch.m_accStart != NO_STATE) {
+	  for (size_t j = m; j > 0; j--) {
+	    if (chainAcc[ch.m_accStart + j - 1] != NO_TOKEN) {
+	      bestTok = chainAcc[ch.m_accStart + j - 1];
+	      bestLen = i + 1 + j;
+	      break;
+	    }
+	  }
+	}
+	*tokId = bestTok;
+	return bestLen;
+      }
+      if (ch.m_accStart != NO_STATE) {
+	for (size_t j = m - 1; j > 0; j--) {
+	  if (chainAcc[ch.m_accStart + j - 1] != NO_TOKEN) {
+	    bestTok = chainAcc[ch.m_accStart + j - 1];
+	    bestLen = i + 1 + j;
+	    break;
+	  }
+	}
+      }
+      i += m;
+      s = ch.m_end;
+      acc = tbl[s + stride - 2];
+    }
+
+    if (acc) {
+      bestTok = acc - 1;
+      bestLen = i + 1;
+    }
+  }
+
+  *tokId = bestTok;
+  return bestLen;
+}
+
+/*
+ * Two bytes per dependent load. A match ending after the first byte
+ * of a pair comes from the entry's middle token; an odd last byte
+ * goes through the stride-1 table.
+ */
+static size_t
+scanStride2(const DFAStride2Entry *tbl, const unsigned short *clsK,
+	    const uchar *cls, size_t k, const stateNum *tbl1,
+	    const size_t *acc, stateNum start,
+	    const uchar *buf, size_t len, size_t *tokId)
+{
+  size_t kk = k * k;
+  size_t s = start * kk;
+  size_t bestTok = acc[start];
+  size_t bestLen = 0;
+  size_t i;
+
+  for (i = 0; i + 2 <= len; i += 2) {
+    const DFAStride2Entry &e = tbl[s + clsK[buf[i]] + cls[buf[i + 1]]];
+    if (e.m_midAcc) {
+      bestTok = e.m_midAcc - 1;
+      bestLen = i + 1;
+    }
+    s = e.m_next;
+    if (s == DFA_DEAD_STATE)
+      break;
+    if (e.m_endAcc) {
+      bestTok = e.m_endAcc - 1;
+      bestLen = i + 2;
+    }
+  }
+
+  if (i + 1 == len && s != DFA_DEAD_STATE) {
+    stateNum n = tbl1[(s / kk) * k + cls[buf[i]]];
+    if (n != DFA_DEAD_STATE && acc[n] != NO_TOKEN) {
+      bestTok = acc[n];
+      bestLen = len;
+    }
+  }
+
+  *tokId = bestTok;
+  return bestLen;
+}
+
+#ifdef CPPTOKEN_SHUFFLE
+/*
+ * The state lives in byte 0 of a vector and one pshufb with the
+ * vector for the byte's class moves it along. The other bytes stay
+ * at the dead state, which maps to itself. Reading the state back
+ * out for the accept test is off the dependency chain.
+ */
+__attribute__((target("ssse3")))
+static size_t
+scanShuffle(const uchar *tbl, const uchar *cls, stateNum start,
+	    unsigned int acceptMask, const size_t *acceptTok,
+	    const uchar *accelIdx, const DFAAccel *accel,
+	    const uchar *buf, size_t len, size_t *tokId)
+{
+  __m128i sv = _mm_cvtsi32_si128((int)start);
+  size_t s = start;
+  size_t bestTok = acceptTok[s];
+  size_t bestLen = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    __m128i t = _mm_loadu_si128((const __m128i *)(tbl + 16 * cls[buf[i]]));
+    sv = _mm_shuffle_epi8(t, sv);
+    size_t prev = s;
+    s = (size_t)_mm_cvtsi128_si32(sv) & 0xff;
+    if (s == DFA_DEAD_STATE)
+      break;
+    if (s == prev && accelIdx[s])
+      i = accel[accelIdx[s] - 1].skip(buf, i + 1, len) - 1;
+    if (acceptMask & (1u << s)) {
+      bestTok = acceptTok[s];
+      bestLen = i + 1;
+    }
+  }
+
+  *tokId = bestTok;
+  return bestLen;
+}
+#endif
+
+/*
+ * Run the DFA from the start of buf, return the length of the
+ * longest match and set tokId to the rule that matched. If nothing
+ * matches tokId is set to NO_TOKEN.
+ */
+size_t
+DFA::longestMatch(const uchar *buf, size_t len, size_t *tokId) const
+{
+  size_t pstride = this->m_numClasses + 2;
+  const uchar *packed = this->m_width ? &this->m_packed[0] : NULL;
+  const DFAAccel *accel = this->m_accel.empty() ? NULL : &this->m_accel[0];
+  const DFAChain *chains = this->m_chains.empty() ? NULL : &this->m_chains[0];
+  const size_t *chainAcc =
+    this->m_chainAcc.empty() ? NULL : &this->m_chainAcc[0];
+  size_t chainBase = this->m_chainBase;
+  if (this->usingStride2())
+    return scanStride2(&this->m_stride2[0], this->m_clsTimesK,
+		       this->m_byteClass, this->m_numClasses,
+		       &this->m_transTbl[0], &this->m_acceptTok[0],
+		       this->m_start, buf, len, tokId);
+#ifdef CPPTOKEN_SHUFFLE
+  if (this->usingShuffle())
+    return scanShuffle(&this->m_shuffle[0], this->m_byteClass, this->m_start,
+		       this->m_shufAccept, &this->m_acceptTok[0],
+		       this->m_shufAccel, accel, buf, len, tokId);
+#endif
+  switch (this->m_width) {
+  case 1:
+    return scanPacked<uchar>(packed, this->m_byteClass, pstride,
+			     this->m_packedStart, this->m_packedSpecial,
+			     accel, chains, chainBase, chainAcc, buf, len,
+			     tokId);
+  case 2:
+    return scanPacked<unsigned short>((const unsigned short *)packed,
+				      this->m_byteClass, pstride,
+				      this->m_packedStart,
+				      this->m_packedSpecial, accel, chains,
+				      chainBase, chainAcc, buf, len, tokId);
+  case 4:
+    return scanPacked<unsigned int>((const unsigned int *)packed,
+				    this->m_byteClass, pstride,
+				    this->m_packedStart,
+				    this->m_packedSpecial, accel, chains,
+				    chainBase, chainAcc, buf, len, tokId);
+  }
+
+  const stateNum *tbl = &this->m_transTbl[0];
+  const size_t *acc = &this->m_acceptTok[0];
+  const uchar *cls = this->m_byteClass;
+  size_t stride = this->m_numClasses;
+  stateNum s = this->m_start;
+  size_t bestLen = 0;
+  size_t bestTok = acc[s];
+
+  for (size_t i = 0; i < len; i++) {
+    s = tbl[s * stride + cls[buf[i]]];
+    if (s == DFA_DEAD_STATE)
+      break;
+    if (acc[s] != NO_TOKEN) {
+      bestTok = acc[s];
+      bestLen = i + 1;
+    }
+  }
+
+  *tokId = bestTok;
+  return bestLen;
+}
+
+/*
+ * For a DFA from Builder::BuildReverseDFA. Runs backwards from
+ * buf[end - 1] and returns the length of the longest match ending at
+ * end, so the match starts at end minus the result.
+ */
+size_t
+DFA::longestMatchReverse(const uchar *buf, size_t end, size_t *tokId) const
+{
+  const stateNum *tbl = &this->m_transTbl[0];
+  const size_t *acc = &this->m_acceptTok[0];
+  const uchar *cls = this->m_byteClass;
+  size_t stride = this->m_numClasses;
+  stateNum s = this->m_start;
+  size_t bestLen = 0;
+  size_t bestTok = acc[s];
+
+  for (size_t i = end; i > 0; i--) {
+    s = tbl[s * stride + cls[buf[i - 1]]];
+    if (s == DFA_DEAD_STATE)
+      break;
+    if (acc[s] != NO_TOKEN) {
+      bestTok = acc[s];
+      bestLen = end - i + 1;
+    }
+  }
+
+  *tokId = bestTok;
+  return bestLen;
+}
+
+/*
+ * Stop at the first accepting state, without trying to extend the
+ * match: the length of the shortest match, tokId set to the rule
+ * it accepts or NO_TOKEN. Works on any DFA; on one built with
+ * SHORTEST_MATCH it agrees with longestMatch.
+ */
+size_t
+DFA::shortestMatch(const uchar *buf, size_t len, size_t *tokId) const
+{
+  const stateNum *tbl = &this->m_transTbl[0];
+  const size_t *acc = &this->m_acceptTok[0];
+  const uchar *cls = this->m_byteClass;
+  size_t stride = this->m_numClasses;
+  stateNum s = this->m_start;
+
+  *tokId = acc[s];
+  if (acc[s] != NO_TOKEN)
+    return 0;
+  for (size_t i = 0; i < len; i++) {
+    s = tbl[s * stride + cls[buf[i]]];
+    if (s == DFA_DEAD_STATE)
+      break;
+    if (acc[s] != NO_TOKEN) {
+      *tokId = acc[s];
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * For a DFA from Builder::BuildSearchDFA. Returns true and sets
+ * end to the position just after the earliest ending match.
+ */
+bool
+DFA::firstMatchEnd(const uchar *buf, size_t len, size_t *end) const
+{
+  size_t tok;
+  *end = this->shortestMatch(buf, len, &tok);
+  return tok != NO_TOKEN;
+}
+
+/*
+ * Unanchored search: the search DFA finds where the first match
+ * ends, the reverse DFA then finds the leftmost start of a match
+ * ending there. No part of the buffer is scanned twice forwards.
+ */
+bool
+DFA::search(const DFA *fwd, const DFA *rev, const uchar *buf, size_t len,
+	    size_t *start, size_t *end, size_t *tokId)
+{
+  size_t e;
+  if (!fwd->firstMatchEnd(buf, len, &e))
+    return false;
+
+  size_t n = rev->longestMatchReverse(buf, e, tokId);
+  *start = e - n;
+  *end = e;
+  return true;
+}
+
+/*
+ * Collapse the DFA onto fewer states. newId maps every old state
+ * to its new number; states mapped to the same number must be
+ * equivalent, the first one seen supplies the row.
+ */
+void
+DFA::renumber(const StateVec &newId, stateNum newCount)
+{
+  StateVec tbl(makeAlloc<stateNum>(this->m_mc));
+  vector<size_t, Alloc<size_t> > acc(makeAlloc<size_t>(this->m_mc));
+  vector<bool, Alloc<bool> > done(makeAlloc<bool>(this->m_mc));
+
+  size_t stride = this->m_numClasses;
+  tbl.resize(newCount * stride, DFA_DEAD_STATE);
+  acc.resize(newCount, NO_TOKEN);
+  done.resize(newCount, false);
+
+  for (stateNum s = 0; s < this->getNumStates(); s++) {
+    stateNum n = newId[s];
+    if (done[n])
+      continue;
+    done[n] = true;
+    acc[n] = this->m_acceptTok[s];
+    for (size_t c = 0; c < stride; c++)
+      tbl[n * stride + c] = newId[ this->m_transTbl[s * stride + c] ];
+  }
+
+  this->m_start = newId[this->m_start];
+  this->m_transTbl.swap(tbl);
+  this->m_acceptTok.swap(acc);
+  this->m_width = 0;
+}
+
+/********************************/
+
+/*
+ * Build the scan table using the narrowest entries that hold every
+ * premultiplied state number, accept token and accelerator index.
+ * Any later change to the DFA drops back to the unpacked table until
+ * pack() is called again.
+ */
+void
+DFA::pack()
+{
+  size_t numStates = this->getNumStates();
+  size_t stride = this->m_numClasses + 2;
+
+  this->m_width = 0;
+  this->m_useStride2 = false;
+  this->m_accel.clear();
+  vector<size_t, Alloc<size_t> > accelIdx(makeAlloc<size_t>(this->m_mc));
+  accelIdx.resize(numStates, 0);
+  for (stateNum s = 0; s < numStates; s++) {
+    DFAAccel a;
+    if (this->findAccel(s, &a)) {
+      this->m_accel.push_back(a);
+      accelIdx[s] = this->m_accel.size();
+    }
+  }
+
+  /* classes of a single byte, 256 for the others */
+  unsigned int classByte[256];
+  size_t classSize[256];
+  memset(classSize, 0, sizeof(classSize));
+  for (unsigned int ch = 0; ch < 256; ch++) {
+    classSize[this->m_byteClass[ch]]++;
+    classByte[this->m_byteClass[ch]] = ch;
+  }
+  for (size_t c = 0; c < this->m_numClasses; c++)
+    if (classSize[c] != 1)
+      classByte[c] = 256;
+
+  size_t maxTok = 0;
+  for (stateNum s = 0; s < numStates; s++)
+    if (this->m_acceptTok[s] != NO_TOKEN && this->m_acceptTok[s] + 1 > maxTok)
+      maxTok = this->m_acceptTok[s] + 1;
+
+  this->m_chains.clear();
+  this->m_chainAcc.clear();
+  this->m_chainBase = maxTok + 1;
+  vector<size_t, Alloc<size_t> > chainIdx(makeAlloc<size_t>(this->m_mc));
+  chainIdx.resize(numStates, 0);
+  for (stateNum s = 0; s < numStates; s++) {
+    DFAChain ch;
+    if (!accelIdx[s] && this->findChain(s, classByte, &ch)) {
+      this->m_chains.push_back(ch);
+      chainIdx[s] = this->m_chains.size();
+    }
+  }
+  if (this->m_chains.empty())
+    this->m_chainBase = NO_TOKEN;
+
+  /* special states get the low rows, the dead state row 0 */
+  StateVec packId(makeAlloc<stateNum>(this->m_mc));
+  packId.resize(numStates);
+  size_t numSpecial = 0;
+  stateNum next = 0;
+  for (size_t pass = 0; pass < 2; pass++) {
+    for (stateNum s = 0; s < numStates; s++) {
+      bool special = s == DFA_DEAD_STATE
+	|| this->m_acceptTok[s] != NO_TOKEN || accelIdx[s] || chainIdx[s];
+      if (special == (pass == 0))
+	packId[s] = next++;
+    }
+    if (pass == 0)
+      numSpecial = next;
+  }
+  for (size_t i = 0; i < this->m_chains.size(); i++)
+    this->m_chains[i].m_end = packId[this->m_chains[i].m_end] * stride;
+
+  size_t maxVal = (numStates - 1) * stride;
+  if (this->m_accel.size() > maxVal)
+    maxVal = this->m_accel.size();
+  if (maxTok > maxVal)
+    maxVal = maxTok;
+  if (!this->m_chains.empty()
+      && this->m_chainBase + this->m_chains.size() - 1 > maxVal)
+    maxVal = this->m_chainBase + this->m_chains.size() - 1;
+
+  size_t width;
+  if (maxVal <= 0xff)
+    width = 1;
+  else if (maxVal <= 0xffff)
+    width = 2;
+  else if (maxVal <= 0xffffffff)
+    width = 4;
+  else
+    return;
+
+  this->m_packed.resize(numStates * stride * width);
+
+  uchar *out = &this->m_packed[0];
+  const stateNum *tbl = &this->m_transTbl[0];
+  const size_t *acc = &this->m_acceptTok[0];
+  const size_t *ai = &accelIdx[0];
+  const size_t *ci = &chainIdx[0];
+  const stateNum *pi = &packId[0];
+  size_t cb = this->m_chainBase;
+  size_t k = this->m_numClasses;
+  if (width == 1)
+    packTable<uchar>(out, tbl, acc, ai, ci, cb, pi, numStates, k);
+  else if (width == 2)
+    packTable<unsigned short>((unsigned short *)out, tbl, acc, ai, ci, cb,
+			      pi, numStates, k);
+  else
+    packTable<unsigned int>((unsigned int *)out, tbl, acc, ai, ci, cb,
+			    pi, numStates, k);
+
+  this->m_packedStart = packId[this->m_start] * stride;
+  this->m_packedSpecial = numSpecial * stride;
+  this->m_width = width;
+  this->packShuffle(ai);
+}
+
+/*
+ * Pick the shuffle engine when the DFA is small enough and the CPU
+ * has SSSE3. Unused entries of each vector go to the dead state.
+ */
+void
+DFA::packShuffle(const size_t *accelIdx)
+{
+  size_t numStates = this->getNumStates();
+  this->m_useShuffle = false;
+  if (numStates > DFA_SHUFFLE_STATES || !DFA::shuffleSupported())
+    return;
+
+  this->m_shuffle.resize(this->m_numClasses * 16);
+  memset(&this->m_shuffle[0], DFA_DEAD_STATE, this->m_shuffle.size());
+  memset(this->m_shufAccel, 0, sizeof(this->m_shufAccel));
+  this->m_shufAccept = 0;
+  for (stateNum s = 0; s < numStates; s++) {
+    for (size_t c = 0; c < this->m_numClasses; c++)
+      this->m_shuffle[c * 16 + s] = (uchar)this->getClassNextState(s, c);
+    if (this->m_acceptTok[s] != NO_TOKEN)
+      this->m_shufAccept |= 1u << s;
+    this->m_shufAccel[s] = (uchar)accelIdx[s];
+  }
+  this->m_useShuffle = true;
+}
+
+/*
+ * Precompute every pair of classes. Only done when the table stays
+ * under DFA_STRIDE2_MAX_ENTRIES entries and every token fits the
+ * entry; returns false otherwise. Once built, longestMatch uses it
+ * in place of the other engines until the DFA is packed again.
+ */
+bool
+DFA::buildStride2()
+{
+  size_t numStates = this->getNumStates();
+  size_t k = this->m_numClasses;
+  size_t kk = k * k;
+
+  this->m_useStride2 = false;
+  if (this->m_width == 0 || numStates * kk > DFA_STRIDE2_MAX_ENTRIES)
+    return false;
+  for (stateNum s = 0; s < numStates; s++)
+    if (this->m_acceptTok[s] != NO_TOKEN && this->m_acceptTok[s] >= 0xffff)
+      return false;
+
+  this->m_stride2.resize(numStates * kk);
+  for (stateNum s = 0; s < numStates; s++) {
+    for (size_t c1 = 0; c1 < k; c1++) {
+      stateNum mid = this->getClassNextState(s, c1);
+      size_t midTok = this->m_acceptTok[mid];
+      for (size_t c2 = 0; c2 < k; c2++) {
+	stateNum end = this->getClassNextState(mid, c2);
+	size_t endTok = this->m_acceptTok[end];
+	DFAStride2Entry &e = this->m_stride2[s * kk + c1 * k + c2];
+	e.m_next = (unsigned int)(end * kk);
+	e.m_midAcc = (unsigned short)(midTok == NO_TOKEN ? 0 : midTok + 1);
+	e.m_endAcc = (unsigned short)(endTok == NO_TOKEN ? 0 : endTok + 1);
+      }
+    }
+  }
+  for (unsigned int ch = 0; ch < 256; ch++)
+    this->m_clsTimesK[ch] = (unsigned short)(this->m_byteClass[ch] * k);
+
+  this->m_useStride2 = true;
+  return true;
+}
+
+bool
+DFA::shuffleSupported()
+{
+#ifdef CPPTOKEN_SHUFFLE
+  return __builtin_cpu_supports("ssse3");
+#else
+  return false;
+#endif
+}
+
+/*
+ * A state is worth accelerating when it stays put on all but three
+ * bytes, or on one contiguous range of bytes. The dead state never
+ * is.
+ */
+bool
+DFA::findAccel(stateNum s, DFAAccel *accel) const
+{
+  if (s == DFA_DEAD_STATE)
+    return false;
+
+  size_t numLoop = 0;
+  size_t numEsc = 0;
+  int lo = -1, hi = -1;
+  bool oneRange = true;
+  for (unsigned int ch = 0; ch < 256; ch++) {
+    if (this->getNextState(s, (uchar)ch) != s) {
+      if (numEsc < 3)
+	accel->m_bytes[numEsc] = (uchar)ch;
+      numEsc++;
+      continue;
+    }
+    numLoop++;
+    if (lo < 0)
+      lo = ch;
+    else if (hi != (int)ch - 1)
+      oneRange = false;
+    hi = ch;
+  }
+  if (numLoop == 0)
+    return false;
+
+  if (numEsc <= 3) {
+    accel->m_kind = DFAAccel::ACCEL_BYTES;
+    accel->m_num = numEsc;
+    return true;
+  }
+  if (oneRange) {
+    accel->m_kind = DFAAccel::ACCEL_RANGE;
+    accel->m_num = 0;
+    accel->m_lo = (uchar)lo;
+    accel->m_hi = (uchar)hi;
+    return true;
+  }
+  return false;
+}
+
+/*
+ * Follow s while each state has a single way out on a single byte,
+ * up to DFA_CHAIN_MAX bytes and without coming back to a state of
+ * the chain. Worth it from DFA_CHAIN_MIN bytes on. The accept tokens
+ * of the inner states are appended to m_chainAcc if any accepts.
+ */
+bool
+DFA::findChain(stateNum s, const unsigned int *classByte, DFAChain *chain)
+{
+  if (s == DFA_DEAD_STATE || s == this->m_start)
+    return false;
+
+  size_t k = this->m_numClasses;
+  stateNum path[DFA_CHAIN_MAX + 1];
+  size_t n = 0;
+  path[0] = s;
+
+  while (n < DFA_CHAIN_MAX) {
+    stateNum cur = path[n];
+    size_t live = k;
+    size_t c;
+    for (c = 0; c < k; c++) {
+      if (this->getClassNextState(cur, c) == DFA_DEAD_STATE)
+	continue;
+      if (live != k)
+	break;
+      live = c;
+    }
+    if (c < k || live == k || classByte[live] == 256)
+      break;
+
+    stateNum next = this->getClassNextState(cur, live);
+    size_t j;
+    for (j = 0; j <= n; j++)
+      if (path[j] == next)
+	break;
+    if (j <= n)
+      break;
+
+    chain->m_lit[n] = (uchar)classByte[live];
+    path[++n] = next;
+  }
+  if (n < DFA_CHAIN_MIN)
+    return false;
+
+  chain->m_len = n;
+  chain->m_headTok = this->m_acceptTok[s];
+  chain->m_end = path[n];
+  chain->m_accStart = NO_STATE;
+  for (size_t j = 1; j < n; j++) {
+    if (this->m_acceptTok[path[j]] != NO_TOKEN) {
+      chain->m_accStart = this->m_chainAcc.size();
+      for (size_t i = 1; i < n; i++)
+	this->m_chainAcc.push_back(this->m_acceptTok[path[i]]);
+      break;
+    }
+  }
+  return true;
+}
+
+bool
+DFA::isAccelerated(stateNum s) const
+{
+  if (this->m_width == 0)
+    return false;
+  DFAAccel a;
+  return this->findAccel(s, &a);
+}
+
+/********************************/
+
+/*
+ * Number of bytes from buf[i] on that agree with the literal, at
+ * most the literal's length and never past len.
+ */
+size_t
+DFAChain::match(const uchar *buf, size_t i, size_t len) const
+{
+  size_t n = this->m_len;
+  if (n > len - i)
+    n = len - i;
+
+  size_t j = 0;
+#ifdef __SSE2__
+  for (; j + 16 <= n; j += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(buf + i + j));
+    __m128i b = _mm_loadu_si128((const __m128i *)(this->m_lit + j));
+    int bits = ~_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0xffff;
+    if (bits)
+      return j + __builtin_ctz(bits);
+  }
+#endif
+  for (; j < n; j++)
+    if (buf[i + j] != this->m_lit[j])
+      return j;
+  return n;
+}
+
+/*
+ * Index of the first byte at or after i that leaves the state, or
+ * len if the run goes to the end of the buffer. Sixteen bytes at a
+ * time with SSE2, otherwise memchr or a plain loop.
+ */
+size_t
+DFAAccel::skip(const uchar *buf, size_t i, size_t len) const
+{
+  if (this->m_kind == ACCEL_BYTES) {
+    if (this->m_num == 0)
+      return len;
+    if (this->m_num == 1) {
+      const void *p = memchr(buf + i, this->m_bytes[0], len - i);
+      return p ? (const uchar *)p - buf : len;
+    }
+#ifdef __SSE2__
+    __m128i b0 = _mm_set1_epi8((char)this->m_bytes[0]);
+    __m128i b1 = _mm_set1_epi8((char)this->m_bytes[1]);
+    __m128i b2 = _mm_set1_epi8((char)this->m_bytes[this->m_num - 1]);
+    for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+      __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, b0),
+					    _mm_cmpeq_epi8(v, b1)),
+			       _mm_cmpeq_epi8(v, b2));
+      int bits = _mm_movemask_epi8(m);
+      if (bits)
+	return i + __builtin_ctz(bits);
+    }
+#endif
+    for (; i < len; i++) {
+      uchar ch = buf[i];
+      if (ch == this->m_bytes[0] || ch == this->m_bytes[1]
+	  || ch == this->m_bytes[this->m_num - 1])
+	return i;
+    }
+    return len;
+  }
+
+  uchar width = this->m_hi - this->m_lo;
+#ifdef __SSE2__
+  __m128i lo = _mm_set1_epi8((char)this->m_lo);
+  __m128i w = _mm_set1_epi8((char)width);
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), lo);
+    /* in range exactly when max(v - lo, width) == width, unsigned */
+    __m128i in = _mm_cmpeq_epi8(_mm_max_epu8(v, w), w);
+    int bits = ~_mm_movemask_epi8(in) & 0xffff;
+    if (bits)
+      return i + __builtin_ctz(bits);
+  }
+#endif
+  for (; i < len; i++)
+    if ((uchar)(buf[i] - this->m_lo) > width)
+      return i;
+  return len;
+}
+
+/********************************/
+
+StateSetTable::StateSetTable(MemoryControl *mc)
+  : m_mc(mc),
+    m_pool(makeAlloc<stateNum>(mc)),
+    m_setStart(makeAlloc<size_t>(mc)),
+    m_hash(makeAlloc<size_t>(mc)),
+    m_chain(makeAlloc<size_t>(mc)),
+    m_buckets(makeAlloc<size_t>(mc))
+{
+  this->m_setStart.push_back(0);
+}
+
+size_t
+StateSetTable::hashSet(const stateNum *ptr, size_t n)
+{
+  /* FNV-1a over the state numbers */
+  size_t h = 2166136261u;
+  for (size_t i = 0; i < n; i++) {
+    h ^= ptr[i];
+    h *= 16777619u;
+  }
+  h ^= n;
+  return h;
+}
+
+const stateNum *
+StateSetTable::getSet(size_t id, size_t *len) const
+{
+  size_t b = this->m_setStart[id];
+  *len = this->m_setStart[id + 1] - b;
+  if (*len == 0)
+    return NULL;
+  return &this->m_pool[b];
+}
+
+size_t
+StateSetTable::find(const StateVec &set, size_t h) const
+{
+  if (this->m_buckets.empty())
+    return NO_STATE;
+
+  size_t id = this->m_buckets[h % this->m_buckets.size()];
+  while (id != NO_STATE) {
+    if (this->m_hash[id] == h) {
+      size_t len;
+      const stateNum *p = this->getSet(id, &len);
+      if (len == set.size()
+	  && (len == 0 || memcmp(p, &set[0], len * sizeof(stateNum)) == 0))
+	return id;
+    }
+    id = this->m_chain[id];
+  }
+
+  return NO_STATE;
+}
+
+/* id of the set, or NO_STATE if it has not been interned */
+size_t
+StateSetTable::lookup(const StateVec &set) const
+{
+  size_t h = StateSetTable::hashSet(set.empty() ? NULL : &set[0],
+				    set.size());
+  return this->find(set, h);
+}
+
+size_t
+StateSetTable::getMemoryBytes() const
+{
+  return this->m_pool.size() * sizeof(stateNum)
+    + (this->m_setStart.size() + this->m_hash.size()
+       + this->m_chain.size() + this->m_buckets.size()) * sizeof(size_t);
+}
+
+/* forget all sets, but keep the memory for reuse */
+void
+StateSetTable::clear()
+{
+  this->m_pool.clear();
+  this->m_setStart.clear();
+  this->m_setStart.push_back(0);
+  this->m_hash.clear();
+  this->m_chain.clear();
+  this->m_buckets.clear();
+}
+
+void
+StateSetTable::rehash(size_t nBuckets)
+{
+  this->m_buckets.assign(nBuckets, NO_STATE);
+  for (size_t id = 0; id < this->m_hash.size(); id++) {
+    size_t b = this->m_hash[id] % nBuckets;
+    this->m_chain[id] = this->m_buckets[b];
+    this->m_buckets[b] = id;
+  }
+}
+
+/*
+ * Make room for more elements, at least doubling the capacity - a
+ * plain reserve of the exact size copies everything on every call.
+ */
+template <class V>
+static void
+reserveMore(V *v, size_t more)
+{
+  if (v->size() + more > v->capacity())
+    v->reserve(max(v->size() + more, 2 * v->capacity()));
+}
+
+/*
+ * Return the id of the given set, adding it if it is not
+ * already present. The set must be sorted.
+ */
+size_t
+StateSetTable::intern(const StateVec &set, bool *isNew)
+{
+  size_t h = StateSetTable::hashSet(set.empty() ? NULL : &set[0],
+				    set.size());
+  size_t id = this->find(set, h);
+  if (id != NO_STATE) {
+    *isNew = false;
+    return id;
+  }
+
+  /* make room first so a failed allocation leaves the table intact */
+  id = this->m_hash.size();
+  if (id + 1 > this->m_buckets.size() / 2)
+    this->rehash(this->m_buckets.empty() ? 64 : this->m_buckets.size() * 2);
+  reserveMore(&this->m_pool, set.size());
+  reserveMore(&this->m_setStart, 1);
+  reserveMore(&this->m_hash, 1);
+  reserveMore(&this->m_chain, 1);
+
+  this->m_pool.insert(this->m_pool.end(), set.begin(), set.end());
+  this->m_setStart.push_back(this->m_pool.size());
+  this->m_hash.push_back(h);
+  size_t b = h % this->m_buckets.size();
+  this->m_chain.push_back(this->m_buckets[b]);
+  this->m_buckets[b] = id;
+
+  *isNew = true;
+  return id;
+}
+
+/********************************/
+
+SubsetBuilder::SubsetBuilder(const NFA *nfa, MemoryControl *mc,
+			     const BuilderLimits *lim)
+  : m_nfa(nfa),
+    m_mc(mc),
+    m_lim(lim),
+    m_sets(mc),
+    m_ctx(nfa, mc),
+    m_cur(makeAlloc<stateNum>(mc)),
+    m_next(makeAlloc<stateNum>(mc)),
+    m_ruleSets(NULL),
+    m_rules(makeAlloc<stateNum>(mc))
+{
+  this->computeClasses();
+}
+
+/* one representative byte per class is enough to compute moves */
+void
+SubsetBuilder::computeClasses()
+{
+  this->m_numClasses = this->m_nfa->computeByteClasses(this->m_byteClass);
+  for (unsigned int ch = 256; ch > 0; ch--)
+    this->m_classRep[ this->m_byteClass[ch - 1] ] = (uchar)(ch - 1);
+}
+
+stateNum
+SubsetBuilder::addDFAState(DFA *dfa, const StateVec &set)
+{
+  bool isNew;
+  size_t id = this->m_sets.intern(set, &isNew);
+  if (!isNew)
+    return id;
+
+  if (this->m_lim)
+    this->m_lim->check(this->m_sets.size(),
+		       this->m_nfa->getMemoryBytes()
+		       + this->m_sets.getMemoryBytes()
+		       + dfa->getNumStates() * dfa->getNumClasses()
+		       * sizeof(stateNum));
+
+  size_t len;
+  const stateNum *p = this->m_sets.getSet(id, &len);
+  if (this->m_ruleSets == NULL) {
+    dfa->addState(this->m_ctx.acceptToken(p, len));
+    return id;
+  }
+
+  this->m_ctx.acceptRules(p, len, &this->m_rules);
+  if (this->m_rules.empty())
+    dfa->addState(NO_TOKEN);
+  else
+    dfa->addState(this->m_ruleSets->intern(this->m_rules, &isNew));
+  return id;
+}
+
+/*
+ * DFA state ids are the same as the set ids in the interning table,
+ * states are processed in the order they are discovered.
+ */
+void
+SubsetBuilder::build(DFA *dfa)
+{
+  dfa->setByteClasses(this->m_byteClass, this->m_numClasses);
+
+  /* dead state first, so it gets id 0 */
+  this->m_cur.clear();
+  this->addDFAState(dfa, this->m_cur);
+
+  this->m_ctx.startSet(&this->m_cur);
+  dfa->setStartState(this->addDFAState(dfa, this->m_cur));
+
+  this->explore(dfa, 1);
+}
+
+/*
+ * The NFA has gained rules since build(). States of the old rules
+ * never reach states of the new ones, so every old set keeps its
+ * row; only the sets reachable from the new start set that have
+ * not been seen before are determinized. The old start state is
+ * left behind unreachable.
+ */
+void
+SubsetBuilder::extend(DFA *dfa)
+{
+  this->computeClasses();
+  dfa->reclassify(this->m_byteClass, this->m_numClasses);
+
+  size_t first = this->m_sets.size();
+  this->m_ctx.startSet(&this->m_cur);
+  dfa->setStartState(this->addDFAState(dfa, this->m_cur));
+
+  this->explore(dfa, first);
+}
+
+/* fill in the rows of states firstId and up, and all they lead to */
+void
+SubsetBuilder::explore(DFA *dfa, size_t firstId)
+{
+  for (size_t id = firstId; id < this->m_sets.size(); id++) {
+    size_t len;
+    const stateNum *p = this->m_sets.getSet(id, &len);
+    if (len == 0)
+      continue;
+    this->m_cur.assign(p, p + len);
+
+    for (size_t c = 0; c < this->m_numClasses; c++) {
+      this->m_ctx.step(&this->m_cur[0], this->m_cur.size(),
+		       this->m_classRep[c], &this->m_next);
+      if (this->m_next.empty())
+	continue;
+      dfa->setTransition(id, c, this->addDFAState(dfa, this->m_next));
+    }
+  }
+}
@@ -0,0 +1,374 @@
+// Copyright (c) 2010, Ram Bhamidipaty
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// 
+//     * Redistributions of source code must retain the above
+//       copyright notice, this list of conditions and the
+//       following disclaimer.
+// 
+//     * Redistributions in binary form must reproduce the above
+//       copyright notice, this list of conditions and the following
+//       disclaimer in the documentation and/or other materials
+//       provided with the distribution.
+// 
+//     * Neither the name of Ram Bhamidipaty nor the names of its
+//       contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <cstring>
+#include <memory>
+#include <limits>
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include <algorithm>
+#include <iostream>
+using namespace std;
+
+#include "cpptoken.h"
+#include "cpptoken_private.h"
+using namespace cpptoken;
+
+/* rows with at most this many exceptions are stored sparse */
+static const size_t COMB_SPARSE_MAX = 4;
+
+/* how many earlier states are tried as the default of a comb row */
+static const size_t COMB_DEFAULT_WINDOW = 32;
+
+/* longest chain of comb defaults a lookup may have to follow */
+static const size_t COMB_MAX_CHAIN = 4;
+
+/********************************/
+
+CompressedDFA *
+Builder::BuildCompressedDFA(MemoryControl *mc, BuilderLimits *lim)
+{
+  DFA *dfa = this->BuildDFA(this->m_mc, lim);
+  CompressedDFA *res = NULL;
+
+  try {
+    res = new (mc) CompressedDFA(mc);
+    res->compress(dfa);
+  }
+  catch (...) {
+    if (res) {
+      res->~CompressedDFA();
+      mc->deallocate(res, sizeof(*res));
+    }
+    dfa->~DFA();
+    this->m_mc->deallocate(dfa, sizeof(*dfa));
+    throw;
+  }
+
+  dfa->~DFA();
+  this->m_mc->deallocate(dfa, sizeof(*dfa));
+  return res;
+}
+
+/********************************/
+static void *
+CompressedDFA::operator new(size_t sz)
+{
+  void *ptr = ::operator new(sz);
+  return ptr;
+}
+
+static void *
+CompressedDFA::operator new(size_t sz, MemoryControl *mc)
+{
+  void *ptr = mc->allocate(sz);
+  return ptr;
+}
+
+static void
+CompressedDFA::operator delete(void *ptr, size_t sz, MemoryControl *mc)
+{
+  mc->deallocate(ptr, sz);
+}
+
+/********************************/
+
+CompressedDFA::CompressedDFA(MemoryControl *mc)
+  : m_mc(mc),
+    m_start(DFA_DEAD_STATE),
+    m_numClasses(0),
+    m_rows(makeAlloc<Row>(mc)),
+    m_sparseCls(makeAlloc<uchar>(mc)),
+    m_sparseTo(makeAlloc<stateNum>(mc)),
+    m_next(makeAlloc<stateNum>(mc)),
+    m_check(makeAlloc<stateNum>(mc)),
+    m_combFree(0)
+{
+  memset(this->m_byteClass, 0, sizeof(this->m_byteClass));
+  for (size_t e = 0; e < NUM_ROW_ENCODINGS; e++) {
+    this->m_numRows[e] = 0;
+    this->m_probes[e] = 0;
+  }
+}
+
+/* can only be called once */
+void
+CompressedDFA::compress(const DFA *dfa)
+{
+  size_t n = dfa->getNumStates();
+  size_t k = dfa->getNumClasses();
+
+  this->m_start = dfa->getStartState();
+  this->m_numClasses = k;
+  memcpy(this->m_byteClass, dfa->getByteClassMap(), 256);
+
+  Row empty = { ROW_SPARSE, DFA_DEAD_STATE, 0, 0, DFA_DEAD_STATE, NO_TOKEN };
+  this->m_rows.resize(n, empty);
+
+  vector<size_t, Alloc<size_t> > depth(makeAlloc<size_t>(this->m_mc));
+  StateVec row(makeAlloc<stateNum>(this->m_mc));
+  StateVec sorted(makeAlloc<stateNum>(this->m_mc));
+  depth.resize(n, 0);
+  row.resize(k);
+
+  for (stateNum s = 0; s < n; s++) {
+    for (size_t c = 0; c < k; c++)
+      row[c] = dfa->getClassNextState(s, c);
+
+    /* the most common target is the default */
+    sorted = row;
+    sort(sorted.begin(), sorted.end());
+    stateNum common = sorted[0];
+    size_t best = 0;
+    for (size_t i = 0, j; i < k; i = j) {
+      for (j = i; j < k && sorted[j] == sorted[i]; j++)
+	;
+      if (j - i > best) {
+	best = j - i;
+	common = sorted[i];
+      }
+    }
+
+    size_t numExc = k - best;
+    size_t lo = k, hi = 0;
+    bool oneTarget = true;
+    for (size_t c = 0; c < k; c++) {
+      if (row[c] == common)
+	continue;
+      if (lo == k)
+	lo = c;
+      else if (row[c] != row[lo])
+	oneTarget = false;
+      hi = c;
+    }
+
+    Row &r = this->m_rows[s];
+    r.m_acceptTok = dfa->getAcceptToken(s);
+    r.m_default = common;
+
+    if (numExc > 0 && oneTarget && hi - lo + 1 == numExc) {
+      r.m_enc = ROW_RANGE;
+      r.m_a = lo;
+      r.m_b = hi;
+      r.m_target = row[lo];
+    }
+    else if (numExc <= COMB_SPARSE_MAX) {
+      r.m_enc = ROW_SPARSE;
+      r.m_a = this->m_sparseCls.size();
+      r.m_b = numExc;
+      for (size_t c = 0; c < k; c++) {
+	if (row[c] == common)
+	  continue;
+	this->m_sparseCls.push_back((uchar)c);
+	this->m_sparseTo.push_back(row[c]);
+      }
+    }
+    else {
+      /* pick the earlier state whose row is closest */
+      stateNum def = NO_STATE;
+      size_t bestCost = 0;
+      for (size_t c = 0; c < k; c++)
+	if (row[c] != DFA_DEAD_STATE)
+	  bestCost++;
+      for (size_t i = 1; i <= COMB_DEFAULT_WINDOW && i <= s; i++) {
+	stateNum cand = s - i;
+	if (depth[cand] >= COMB_MAX_CHAIN)
+	  continue;
+	size_t cost = 0;
+	for (size_t c = 0; c < k && cost < bestCost; c++)
+	  if (row[c] != dfa->getClassNextState(cand, c))
+	    cost++;
+	if (cost < bestCost) {
+	  bestCost = cost;
+	  def = cand;
+	}
+      }
+      r.m_enc = ROW_COMB;
+      r.m_default = def;
+      if (def != NO_STATE)
+	depth[s] = depth[def] + 1;
+      this->placeComb(s, row, def, dfa);
+    }
+    this->m_numRows[r.m_enc]++;
+  }
+
+  for (stateNum s = 0; s < n; s++)
+    for (size_t c = 0; c < k; c++)
+      this->m_probes[this->m_rows[s].m_enc] += this->countProbes(s, c);
+}
+
+/*
+ * First fit: the lowest base where every entry of the row lands on
+ * a free slot. Rows may share a base, check tells them apart.
+ */
+void
+CompressedDFA::placeComb(stateNum s, const StateVec &row, stateNum def,
+			 const DFA *dfa)
+{
+  vector<uchar, Alloc<uchar> > ents(makeAlloc<uchar>(this->m_mc));
+  for (size_t c = 0; c < row.size(); c++) {
+    stateNum d = (def == NO_STATE) ? DFA_DEAD_STATE
+      : dfa->getClassNextState(def, c);
+    if (row[c] != d)
+      ents.push_back((uchar)c);
+  }
+
+  Row &r = this->m_rows[s];
+  r.m_a = 0;
+  if (ents.empty())
+    return;
+
+  size_t first = ents[0];
+  size_t last = ents[ents.size() - 1];
+  size_t base = this->m_combFree > first ? this->m_combFree - first : 0;
+  for (;; base++) {
+    if (this->m_check.size() < base + last + 1) {
+      this->m_check.resize(base + last + 1, NO_STATE);
+      this->m_next.resize(base + last + 1, DFA_DEAD_STATE);
+    }
+    size_t i;
+    for (i = 0; i < ents.size(); i++)
+      if (this->m_check[base + ents[i]] != NO_STATE)
+	break;
+    if (i == ents.size())
+      break;
+  }
+
+  r.m_a = base;
+  for (size_t i = 0; i < ents.size(); i++) {
+    this->m_check[base + ents[i]] = s;
+    this->m_next[base + ents[i]] = row[ents[i]];
+  }
+  while (this->m_combFree < this->m_check.size()
+	 && this->m_check[this->m_combFree] != NO_STATE)
+    this->m_combFree++;
+}
+
+stateNum
+CompressedDFA::getClassNextState(stateNum s, size_t cls) const
+{
+  for (;;) {
+    const Row &r = this->m_rows[s];
+    switch (r.m_enc) {
+    case ROW_RANGE:
+      return (cls >= r.m_a && cls <= r.m_b) ? r.m_target : r.m_default;
+
+    case ROW_SPARSE:
+      for (size_t i = r.m_a; i < r.m_a + r.m_b; i++)
+	if (this->m_sparseCls[i] == cls)
+	  return this->m_sparseTo[i];
+      return r.m_default;
+
+    default: {
+      size_t i = r.m_a + cls;
+      if (i < this->m_check.size() && this->m_check[i] == s)
+	return this->m_next[i];
+      if (r.m_default == NO_STATE)
+	return DFA_DEAD_STATE;
+      s = r.m_default;
+      break;
+    }
+    }
+  }
+}
+
+/* memory reads getClassNextState makes for one lookup */
+size_t
+CompressedDFA::countProbes(stateNum s, size_t cls) const
+{
+  size_t res = 0;
+  for (;;) {
+    const Row &r = this->m_rows[s];
+    res++;
+    if (r.m_enc == ROW_RANGE)
+      return res;
+    if (r.m_enc == ROW_SPARSE) {
+      for (size_t i = r.m_a; i < r.m_a + r.m_b; i++) {
+	res++;
+	if (this->m_sparseCls[i] == cls)
+	  break;
+      }
+      return res;
+    }
+    size_t i = r.m_a + cls;
+    if (i < this->m_check.size()) {
+      res++;
+      if (this->m_check[i] == s)
+	return res + 1;
+    }
+    if (r.m_default == NO_STATE)
+      return res;
+    s = r.m_default;
+  }
+}
+
+size_t
+CompressedDFA::getMemoryBytes() const
+{
+  return sizeof(*this)
+    + this->m_rows.size() * sizeof(Row)
+    + this->m_sparseCls.size() * (sizeof(uchar) + sizeof(stateNum))
+    + this->m_check.size() * 2 * sizeof(stateNum);
+}
+
+/* average reads per transition, over all rows using the encoding */
+double
+CompressedDFA::getAvgProbes(RowEncoding enc) const
+{
+  size_t lookups = this->m_numRows[enc] * this->m_numClasses;
+  if (lookups == 0)
+    return 0.0;
+  return (double)this->m_probes[enc] / (double)lookups;
+}
+
+/* same result as DFA::longestMatch */
+size_t
+CompressedDFA::longestMatch(const uchar *buf, size_t len, size_t *tokId) const
+{
+  stateNum s = this->m_start;
+  size_t bestLen = 0;
+  size_t bestTok = this->m_rows[s].m_acceptTok;
+
+  for (size_t i = 0; i < len; i++) {
+    s = this->getClassNextState(s, this->m_byteClass[buf[i]]);
+    if (s == DFA_DEAD_STATE)
+      break;
+    if (this->m_rows[s].m_acceptTok != NO_TOKEN) {
+      bestTok = this->m_rows[s].m_acceptTok;
+      bestLen = i + 1;
+    }
+  }
+
+  *tokId = bestTok;
+  return bestLen;
+}
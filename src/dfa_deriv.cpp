@@ -0,0 +1,526 @@
+// Copyright (c) 2010, Ram Bhamidipaty
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// 
+//     * Redistributions of source code must retain the above
+//       copyright notice, this list of conditions and the
+//       following disclaimer.
+// 
+//     * Redistributions in binary form must reproduce the above
+//       copyright notice, this list of conditions and the following
+//       disclaimer in the documentation and/or other materials
+//       provided with the distribution.
+// 
+//     * Neither the name of Ram Bhamidipaty nor the names of its
+//       contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <memory>
+#include <limits>
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include <algorithm>
+#include <iostream>
+using namespace std;
+
+#include "cpptoken.h"
+#include "cpptoken_private.h"
+using namespace cpptoken;
+
+/********************************/
+
+DFA *
+Builder::BuildDerivativeDFA(MemoryControl *dfaMC, BuilderLimits *lim)
+{
+  if (lim)
+    lim->startClock();
+
+  DFA *res = new (dfaMC) DFA(dfaMC);
+
+  try {
+    {
+      DerivativeBuilder db(this->m_mc, lim);
+      db.setSemantics(this->m_semantics);
+      if (this->m_pats) {
+	list<PatternAction *, Alloc<PatternAction *> >::iterator iter;
+	for (iter = this->m_pats->begin(); iter != this->m_pats->end(); iter++)
+	  db.addRule(db.parse((*iter)->regex, (*iter)->len));
+      }
+      db.build(res);
+    }
+
+    DFAMinimizer dm(this->m_mc);
+    dm.setLimits(lim);
+    dm.minimize(res);
+    res->pack();
+  }
+  catch (...) {
+    res->~DFA();
+    dfaMC->deallocate(res, sizeof(*res));
+    throw;
+  }
+
+  return res;
+}
+
+/********************************/
+
+const size_t DerivativeBuilder::EXPR_EMPTY;
+const size_t DerivativeBuilder::EXPR_EPS;
+const size_t DerivativeBuilder::EXPR_ANY;
+
+DerivativeBuilder::DerivativeBuilder(MemoryControl *mc,
+				     const BuilderLimits *lim)
+  : m_mc(mc),
+    m_lim(lim),
+    m_exprTbl(mc),
+    m_exprs(makeAlloc<Expr>(mc)),
+    m_charSets(makeAlloc<CharSet>(mc)),
+    m_key(makeAlloc<stateNum>(mc)),
+    m_rules(makeAlloc<stateNum>(mc)),
+    m_numClasses(1),
+    m_deriv(makeAlloc<stateNum>(mc)),
+    m_states(mc),
+    m_cur(makeAlloc<stateNum>(mc)),
+    m_tuple(makeAlloc<stateNum>(mc)),
+    m_semantics(LEFTMOST_LONGEST)
+{
+  this->intern(RE_EMPTY, 0, 0);
+  this->intern(RE_EPS, 0, 0);
+  this->intern(RE_NOT, EXPR_EMPTY, 0);
+}
+
+/* the expression with the given key, made if it is new */
+size_t
+DerivativeBuilder::intern(Kind kind, size_t a, size_t b)
+{
+  if (kind != RE_SET) {
+    this->m_key.clear();
+    this->m_key.push_back(kind);
+    this->m_key.push_back(a);
+    this->m_key.push_back(b);
+  }
+
+  /* make room first so a failed allocation leaves both tables alike */
+  this->m_exprs.reserve(this->m_exprs.size() + 1);
+  bool isNew;
+  size_t id = this->m_exprTbl.intern(this->m_key, &isNew);
+  if (!isNew)
+    return id;
+
+  Expr e;
+  e.m_kind = kind;
+  e.m_a = a;
+  e.m_b = b;
+  switch (kind) {
+  case RE_EMPTY:
+  case RE_SET:
+    e.m_nullable = false;
+    break;
+  case RE_EPS:
+  case RE_STAR:
+    e.m_nullable = true;
+    break;
+  case RE_CAT:
+  case RE_AND:
+    e.m_nullable = this->m_exprs[a].m_nullable && this->m_exprs[b].m_nullable;
+    break;
+  case RE_OR:
+    e.m_nullable = this->m_exprs[a].m_nullable || this->m_exprs[b].m_nullable;
+    break;
+  case RE_NOT:
+    e.m_nullable = !this->m_exprs[a].m_nullable;
+    break;
+  }
+  this->m_exprs.push_back(e);
+  return id;
+}
+
+/* sets are keyed by their bits, so equal sets are one expression */
+size_t
+DerivativeBuilder::mkSet(const CharSet &cs)
+{
+  const size_t wordBytes = sizeof(stateNum);
+  this->m_key.assign(1 + sizeof(cs.m_bits) / wordBytes, 0);
+  this->m_key[0] = RE_SET;
+  for (size_t i = 0; i < sizeof(cs.m_bits); i++)
+    this->m_key[1 + i / wordBytes] |=
+      (stateNum)cs.m_bits[i] << (8 * (i % wordBytes));
+
+  size_t old = this->m_exprs.size();
+  this->m_charSets.reserve(this->m_charSets.size() + 1);
+  size_t id = this->intern(RE_SET, this->m_charSets.size(), 0);
+  if (this->m_exprs.size() > old)
+    this->m_charSets.push_back(cs);
+  return id;
+}
+
+size_t
+DerivativeBuilder::mkCat(size_t a, size_t b)
+{
+  if (a == EXPR_EMPTY || b == EXPR_EMPTY)
+    return EXPR_EMPTY;
+  if (a == EXPR_EPS)
+    return b;
+  if (b == EXPR_EPS)
+    return a;
+
+  const Expr &ea = this->m_exprs[a];
+  if (ea.m_kind == RE_CAT) {
+    size_t first = ea.m_a;
+    return this->mkCat(first, this->mkCat(ea.m_b, b));
+  }
+  return this->intern(RE_CAT, a, b);
+}
+
+size_t
+DerivativeBuilder::mkOr(size_t a, size_t b)
+{
+  return this->mkAssoc(RE_OR, a, b);
+}
+
+size_t
+DerivativeBuilder::mkAnd(size_t a, size_t b)
+{
+  return this->mkAssoc(RE_AND, a, b);
+}
+
+size_t
+DerivativeBuilder::mkNot(size_t a)
+{
+  if (this->m_exprs[a].m_kind == RE_NOT)
+    return this->m_exprs[a].m_a;
+  return this->intern(RE_NOT, a, 0);
+}
+
+size_t
+DerivativeBuilder::mkStar(size_t a)
+{
+  if (a == EXPR_EMPTY || a == EXPR_EPS)
+    return EXPR_EPS;
+  if (this->m_exprs[a].m_kind == RE_STAR)
+    return a;
+  return this->intern(RE_STAR, a, 0);
+}
+
+/* a{lo,hi}, or a{lo,} when unbounded - built from the right */
+size_t
+DerivativeBuilder::mkRepeat(size_t a, size_t lo, size_t hi, bool unbounded)
+{
+  size_t res = unbounded ? this->mkStar(a) : (size_t)EXPR_EPS;
+  if (!unbounded) {
+    size_t opt = this->mkOr(a, EXPR_EPS);
+    for (size_t i = lo; i < hi; i++)
+      res = this->mkCat(opt, res);
+  }
+  for (size_t i = 0; i < lo; i++)
+    res = this->mkCat(a, res);
+  return res;
+}
+
+/* append the operands of a chain of kind */
+void
+DerivativeBuilder::flatten(Kind kind, size_t e, StateVec *out)
+{
+  while (this->m_exprs[e].m_kind == kind) {
+    out->push_back(this->m_exprs[e].m_a);
+    e = this->m_exprs[e].m_b;
+  }
+  out->push_back(e);
+}
+
+/*
+ * | and & chains are kept sorted by id and nested to the right.
+ * EMPTY is the identity of | and absorbs &, ANY the other way
+ * around.
+ */
+size_t
+DerivativeBuilder::mkAssoc(Kind kind, size_t a, size_t b)
+{
+  size_t ident = (kind == RE_OR) ? EXPR_EMPTY : EXPR_ANY;
+  size_t absorb = (kind == RE_OR) ? EXPR_ANY : EXPR_EMPTY;
+
+  if (a == absorb || b == absorb)
+    return absorb;
+  if (a == ident || a == b)
+    return b;
+  if (b == ident)
+    return a;
+
+  StateVec ops(makeAlloc<stateNum>(this->m_mc));
+  this->flatten(kind, a, &ops);
+  this->flatten(kind, b, &ops);
+  sort(ops.begin(), ops.end());
+  ops.erase(unique(ops.begin(), ops.end()), ops.end());
+
+  size_t res = ops.back();
+  for (size_t i = ops.size() - 1; i > 0; i--)
+    res = this->intern(kind, ops[i - 1], res);
+  return res;
+}
+
+/********************************/
+
+size_t
+DerivativeBuilder::parse(const char *regex, size_t len)
+{
+  Alloc<REToken *> alloc;
+  alloc.setMC(this->m_mc);
+
+  TokenList2 infix(this->m_mc, alloc);
+  infix.build(regex, 0, len);
+
+  TokenList2 postfix(this->m_mc, alloc);
+  TokenList2::tmpTokList tmpList;
+  postfix.buildPostfix(&infix, &tmpList);
+
+  return this->fromPostfix(&postfix);
+}
+
+/* same structure as NFA::addRule, same errors */
+size_t
+DerivativeBuilder::fromPostfix(const TokenList2 *postfix)
+{
+  StateVec stk(makeAlloc<stateNum>(this->m_mc));
+
+  TokenList2::TokList::const_iterator iter = postfix->m_toks.begin();
+  while (iter != postfix->m_toks.end()) {
+    const REToken *tok = *iter;
+    size_t e1, e2;
+
+    switch (tok->m_ttype) {
+    case TT_SELF_CHAR:
+    case TT_CHAR_CLASS:
+      {
+	CharSet cs;
+	cs.clear();
+	if (tok->m_ttype == TT_SELF_CHAR)
+	  cs.add(tok->u.m_ch);
+	else {
+	  REToken::UCharList::const_iterator ci = tok->u.m_charClass->begin();
+	  while (ci != tok->u.m_charClass->end()) {
+	    cs.add(*ci);
+	    ci++;
+	  }
+	}
+	stk.push_back(this->mkSet(cs));
+      }
+      break;
+
+    case TT_CCAT:
+    case TT_PIPE:
+      if (stk.size() < 2)
+	throw SyntaxError(0, "Missing operand");
+      e2 = stk.back();
+      stk.pop_back();
+      e1 = stk.back();
+      stk.pop_back();
+      if (tok->m_ttype == TT_CCAT)
+	stk.push_back(this->mkCat(e1, e2));
+      else
+	stk.push_back(this->mkOr(e1, e2));
+      break;
+
+    case TT_STAR:
+    case TT_QMARK:
+    case TT_QUANTIFIER:
+      if (stk.empty())
+	throw SyntaxError(0, "Missing operand");
+      e1 = stk.back();
+      stk.pop_back();
+      if (tok->m_ttype == TT_STAR)
+	stk.push_back(this->mkStar(e1));
+      else if (tok->m_ttype == TT_QMARK)
+	stk.push_back(this->mkOr(e1, EXPR_EPS));
+      else {
+	const RETokQuantifier &q = tok->u.m_quant;
+	size_t lo = q.m_v1Valid ? q.m_v1 : 0;
+	size_t hi = lo;
+	bool unbounded = false;
+	if (!q.m_exact && q.m_v2Valid) {
+	  hi = q.m_v2;
+	  if (hi < lo)
+	    throw SyntaxError(0, "Bad quantifier range");
+	}
+	else if (!q.m_exact)
+	  unbounded = true;
+	stk.push_back(this->mkRepeat(e1, lo, hi, unbounded));
+      }
+      break;
+
+    case TT_DOT:
+    case TT_LPAREN:
+    case TT_RPAREN:
+    case TT_num:
+      throw SyntaxError(0, "Unexpected token");
+    }
+
+    iter++;
+  }
+
+  if (stk.empty())
+    return EXPR_EPS;
+  if (stk.size() != 1)
+    throw SyntaxError(0, "Missing operator");
+  return stk.back();
+}
+
+void
+DerivativeBuilder::addRule(size_t expr)
+{
+  this->m_rules.push_back(expr);
+}
+
+/********************************/
+
+/*
+ * Derivatives by byte class. Every byte of a class has the same
+ * derivative, since no char set tells them apart. Results are
+ * cached, the cache grows with the expression table.
+ */
+size_t
+DerivativeBuilder::deriv(size_t e, size_t cls)
+{
+  size_t k = this->m_numClasses;
+  if (e * k + cls < this->m_deriv.size()
+      && this->m_deriv[e * k + cls] != NO_STATE)
+    return this->m_deriv[e * k + cls];
+
+  Expr ex = this->m_exprs[e];
+  size_t res = EXPR_EMPTY;
+  switch (ex.m_kind) {
+  case RE_EMPTY:
+  case RE_EPS:
+    res = EXPR_EMPTY;
+    break;
+  case RE_SET:
+    if (this->m_charSets[ex.m_a].contains(this->m_classRep[cls]))
+      res = EXPR_EPS;
+    break;
+  case RE_CAT:
+    res = this->mkCat(this->deriv(ex.m_a, cls), ex.m_b);
+    if (this->m_exprs[ex.m_a].m_nullable)
+      res = this->mkOr(res, this->deriv(ex.m_b, cls));
+    break;
+  case RE_OR:
+    res = this->mkOr(this->deriv(ex.m_a, cls), this->deriv(ex.m_b, cls));
+    break;
+  case RE_AND:
+    res = this->mkAnd(this->deriv(ex.m_a, cls), this->deriv(ex.m_b, cls));
+    break;
+  case RE_NOT:
+    res = this->mkNot(this->deriv(ex.m_a, cls));
+    break;
+  case RE_STAR:
+    res = this->mkCat(this->deriv(ex.m_a, cls), e);
+    break;
+  }
+
+  if (this->m_deriv.size() < this->m_exprs.size() * k)
+    this->m_deriv.resize(this->m_exprs.size() * k, NO_STATE);
+  this->m_deriv[e * k + cls] = res;
+  return res;
+}
+
+stateNum
+DerivativeBuilder::addDFAState(DFA *dfa, const StateVec &tuple)
+{
+  bool isNew;
+  size_t id = this->m_states.intern(tuple, &isNew);
+  if (!isNew)
+    return id;
+
+  if (this->m_lim)
+    this->m_lim->check(this->m_states.size(),
+		       this->m_exprTbl.getMemoryBytes()
+		       + this->m_exprs.size() * sizeof(Expr)
+		       + this->m_deriv.size() * sizeof(stateNum)
+		       + this->m_states.getMemoryBytes()
+		       + dfa->getNumStates() * dfa->getNumClasses()
+		       * sizeof(stateNum));
+
+  size_t tokId = NO_TOKEN;
+  for (size_t r = 0; r < tuple.size(); r++) {
+    if (this->m_exprs[tuple[r]].m_nullable) {
+      tokId = r;
+      break;
+    }
+  }
+  dfa->addState(tokId);
+  return id;
+}
+
+/*
+ * Leftmost first drops the rules after the first nullable one.
+ * Shortest match keeps only that rule, cut down to the empty
+ * string, so the state accepts it and has no way out.
+ */
+void
+DerivativeBuilder::prune(StateVec *tuple) const
+{
+  if (this->m_semantics == LEFTMOST_LONGEST)
+    return;
+  size_t r = 0;
+  while (r < tuple->size() && !this->m_exprs[(*tuple)[r]].m_nullable)
+    r++;
+  if (r == tuple->size())
+    return;
+
+  bool shortest = this->m_semantics == SHORTEST_MATCH;
+  for (size_t i = shortest ? 0 : r + 1; i < tuple->size(); i++)
+    (*tuple)[i] = (i == r) ? EXPR_EPS : EXPR_EMPTY;
+}
+
+/*
+ * Breadth first from the tuple of the rules, like SubsetBuilder.
+ * The tuple of all EMPTY is the dead state and gets id 0.
+ */
+void
+DerivativeBuilder::build(DFA *dfa)
+{
+  this->m_numClasses = CharSet::computeByteClasses(
+    this->m_charSets.empty() ? NULL : &this->m_charSets[0],
+    this->m_charSets.size(), this->m_byteClass);
+  for (unsigned int ch = 256; ch > 0; ch--)
+    this->m_classRep[ this->m_byteClass[ch - 1] ] = (uchar)(ch - 1);
+  this->m_deriv.clear();
+  dfa->setByteClasses(this->m_byteClass, this->m_numClasses);
+
+  this->m_tuple.assign(this->m_rules.size(), EXPR_EMPTY);
+  this->addDFAState(dfa, this->m_tuple);
+  this->m_tuple = this->m_rules;
+  this->prune(&this->m_tuple);
+  dfa->setStartState(this->addDFAState(dfa, this->m_tuple));
+
+  for (size_t id = 1; id < this->m_states.size(); id++) {
+    size_t len;
+    const stateNum *p = this->m_states.getSet(id, &len);
+    this->m_cur.assign(p, p + len);
+
+    for (size_t c = 0; c < this->m_numClasses; c++) {
+      for (size_t r = 0; r < len; r++)
+	this->m_tuple[r] = this->deriv(this->m_cur[r], c);
+      this->prune(&this->m_tuple);
+      stateNum s = this->addDFAState(dfa, this->m_tuple);
+      if (s != DFA_DEAD_STATE)
+	dfa->setTransition(id, c, s);
+    }
+  }
+}
@@ -0,0 +1,166 @@
+// Copyright (c) 2010, Ram Bhamidipaty
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// 
+//     * Redistributions of source code must retain the above
+//       copyright notice, this list of conditions and the
+//       following disclaimer.
+// 
+//     * Redistributions in binary form must reproduce the above
+//       copyright notice, this list of conditions and the following
+//       disclaimer in the documentation and/or other materials
+//       provided with the distribution.
+// 
+//     * Neither the name of Ram Bhamidipaty nor the names of its
+//       contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <new>
+#include <memory>
+#include <limits>
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include <iostream>
+using namespace std;
+
+#include "cpptoken.h"
+#include "cpptoken_private.h"
+using namespace cpptoken;
+
+/********************************/
+
+static void *
+IncrementalBuild::operator new(size_t sz, MemoryControl *mc)
+{
+  void *ptr = mc->allocate(sz);
+  return ptr;
+}
+
+static void
+IncrementalBuild::operator delete(void *ptr, MemoryControl *mc)
+{
+  mc->deallocate(ptr, sizeof(IncrementalBuild));
+}
+
+IncrementalBuild::IncrementalBuild(MemoryControl *mc)
+  : m_mc(mc),
+    m_nfa(NULL),
+    m_sb(NULL),
+    m_dfa(NULL),
+    m_numRules(0)
+{
+  ;
+}
+
+IncrementalBuild::~IncrementalBuild()
+{
+  if (this->m_dfa) {
+    this->m_dfa->~DFA();
+    this->m_mc->deallocate(this->m_dfa, sizeof(*this->m_dfa));
+  }
+  if (this->m_sb) {
+    this->m_sb->~SubsetBuilder();
+    this->m_mc->deallocate(this->m_sb, sizeof(*this->m_sb));
+  }
+  if (this->m_nfa) {
+    this->m_nfa->~NFA();
+    this->m_mc->deallocate(this->m_nfa, sizeof(*this->m_nfa));
+  }
+}
+
+/********************************/
+
+/*
+ * The first call builds everything and keeps it. Later calls add
+ * the new rules to the kept NFA and let the subset builder extend
+ * the kept DFA. Minimization is not incremental: a copy of the kept
+ * DFA is trimmed to its reachable states and minimized, which costs
+ * far less than the determinization it replaces. If anything fails
+ * the kept state is dropped and the next call starts over; after a
+ * change of match semantics the call itself starts over.
+ */
+DFA *
+Builder::BuildDFAIncremental(MemoryControl *dfaMC, BuilderLimits *lim)
+{
+  MemoryControl *mc = this->m_mc;
+  DFA *res = NULL;
+
+  if (lim)
+    lim->startClock();
+
+  /* the kept NFA prunes for the semantics it was built with */
+  if (this->m_inc
+      && this->m_inc->m_nfa->getSemantics() != this->m_semantics) {
+    this->m_inc->~IncrementalBuild();
+    mc->deallocate(this->m_inc, sizeof(*this->m_inc));
+    this->m_inc = NULL;
+  }
+
+  try {
+    if (this->m_inc == NULL) {
+      this->m_inc = new (mc) IncrementalBuild(mc);
+      IncrementalBuild *inc = this->m_inc;
+
+      inc->m_nfa = this->BuildNFA(mc, lim);
+      inc->m_numRules = inc->m_nfa->getNumRules();
+      void *p = mc->allocate(sizeof(SubsetBuilder));
+      try {
+	inc->m_sb = new (p) SubsetBuilder(inc->m_nfa, mc, lim);
+      }
+      catch (...) {
+	mc->deallocate(p, sizeof(SubsetBuilder));
+	throw;
+      }
+      inc->m_dfa = new (mc) DFA(mc);
+      inc->m_sb->build(inc->m_dfa);
+    }
+    else {
+      IncrementalBuild *inc = this->m_inc;
+      this->addRules(inc->m_nfa, inc->m_numRules, lim);
+      if (inc->m_nfa->getNumRules() != inc->m_numRules) {
+	inc->m_numRules = inc->m_nfa->getNumRules();
+	inc->m_sb->setLimits(lim);
+	inc->m_sb->extend(inc->m_dfa);
+      }
+    }
+    this->m_inc->m_sb->setLimits(NULL);
+
+    res = new (dfaMC) DFA(dfaMC);
+    res->copyFrom(this->m_inc->m_dfa);
+    res->removeUnreachable();
+    DFAMinimizer dm(mc);
+    dm.setLimits(lim);
+    dm.minimize(res);
+    res->pack();
+  }
+  catch (...) {
+    if (res) {
+      res->~DFA();
+      dfaMC->deallocate(res, sizeof(*res));
+    }
+    if (this->m_inc) {
+      this->m_inc->~IncrementalBuild();
+      mc->deallocate(this->m_inc, sizeof(*this->m_inc));
+      this->m_inc = NULL;
+    }
+    throw;
+  }
+
+  return res;
+}
@@ -0,0 +1,453 @@
+// Copyright (c) 2010, Ram Bhamidipaty
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// 
+//     * Redistributions of source code must retain the above
+//       copyright notice, this list of conditions and the
+//       following disclaimer.
+// 
+//     * Redistributions in binary form must reproduce the above
+//       copyright notice, this list of conditions and the following
+//       disclaimer in the documentation and/or other materials
+//       provided with the distribution.
+// 
+//     * Neither the name of Ram Bhamidipaty nor the names of its
+//       contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <memory>
+#include <limits>
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include <algorithm>
+#include <iostream>
+using namespace std;
+
+#include "cpptoken.h"
+#include "cpptoken_private.h"
+using namespace cpptoken;
+
+/********************************/
+
+namespace {
+
+/* orders states by accept token, used for the initial partition */
+struct AcceptTokenLess {
+  const DFA *m_dfa;
+
+  AcceptTokenLess(const DFA *dfa) : m_dfa(dfa) {;};
+  bool operator()(stateNum a, stateNum b) const {
+    return this->m_dfa->getAcceptToken(a) < this->m_dfa->getAcceptToken(b);
+  };
+};
+
+}
+
+/********************************/
+
+DFAMinimizer::DFAMinimizer(MemoryControl *mc)
+  : m_mc(mc),
+    m_predStart(makeAlloc<size_t>(mc)),
+    m_preds(makeAlloc<stateNum>(mc)),
+    m_elems(makeAlloc<stateNum>(mc)),
+    m_loc(makeAlloc<size_t>(mc)),
+    m_blockOf(makeAlloc<size_t>(mc)),
+    m_first(makeAlloc<size_t>(mc)),
+    m_end(makeAlloc<size_t>(mc)),
+    m_marked(makeAlloc<size_t>(mc)),
+    m_touched(makeAlloc<size_t>(mc)),
+    m_work(makeAlloc<size_t>(mc)),
+    m_inWork(makeAlloc<bool>(mc)),
+    m_lim(NULL)
+{
+}
+
+void
+DFAMinimizer::buildPreds(const DFA *dfa)
+{
+  stateNum n = dfa->getNumStates();
+  size_t k = dfa->getNumClasses();
+
+  this->m_predStart.assign(n * k + 1, 0);
+  for (stateNum s = 0; s < n; s++)
+    for (size_t c = 0; c < k; c++)
+      this->m_predStart[dfa->getClassNextState(s, c) * k + c]++;
+  for (size_t i = 1; i < this->m_predStart.size(); i++)
+    this->m_predStart[i] += this->m_predStart[i - 1];
+
+  /* m_predStart[key] is now the end of the key's range - filling */
+  /* from the back moves it down to the start                      */
+  this->m_preds.resize(n * k);
+  for (stateNum s = n; s > 0; s--) {
+    for (size_t c = k; c > 0; c--) {
+      size_t key = dfa->getClassNextState(s - 1, c - 1) * k + c - 1;
+      this->m_preds[ --this->m_predStart[key] ] = s - 1;
+    }
+  }
+}
+
+void
+DFAMinimizer::initPartition(const DFA *dfa)
+{
+  stateNum n = dfa->getNumStates();
+
+  this->m_elems.resize(n);
+  for (stateNum s = 0; s < n; s++)
+    this->m_elems[s] = s;
+  stable_sort(this->m_elems.begin(), this->m_elems.end(), AcceptTokenLess(dfa));
+
+  this->m_loc.resize(n);
+  this->m_blockOf.resize(n);
+  this->m_first.clear();
+  this->m_end.clear();
+  for (size_t i = 0; i < n; i++) {
+    stateNum s = this->m_elems[i];
+    if (i == 0
+	|| dfa->getAcceptToken(s) != dfa->getAcceptToken(this->m_elems[i - 1])) {
+      if (i > 0)
+	this->m_end.push_back(i);
+      this->m_first.push_back(i);
+    }
+    this->m_loc[s] = i;
+    this->m_blockOf[s] = this->m_first.size() - 1;
+  }
+  this->m_end.push_back(n);
+
+  size_t nBlocks = this->m_first.size();
+  this->m_marked.assign(nBlocks, 0);
+  this->m_inWork.assign(nBlocks, false);
+
+  /* every block but the largest goes on the work list */
+  size_t largest = 0;
+  for (size_t b = 1; b < nBlocks; b++)
+    if (this->m_end[b] - this->m_first[b]
+	> this->m_end[largest] - this->m_first[largest])
+      largest = b;
+  for (size_t b = 0; b < nBlocks; b++) {
+    if (b == largest)
+      continue;
+    this->m_work.push_back(b);
+    this->m_inWork[b] = true;
+  }
+}
+
+/* move s to the marked part at the front of its block */
+void
+DFAMinimizer::mark(stateNum s)
+{
+  size_t b = this->m_blockOf[s];
+  size_t i = this->m_loc[s];
+  size_t j = this->m_first[b] + this->m_marked[b];
+  if (i < j)
+    return;
+
+  stateNum other = this->m_elems[j];
+  this->m_elems[j] = s;
+  this->m_loc[s] = j;
+  this->m_elems[i] = other;
+  this->m_loc[other] = i;
+
+  if (this->m_marked[b] == 0)
+    this->m_touched.push_back(b);
+  this->m_marked[b]++;
+}
+
+void
+DFAMinimizer::splitTouched()
+{
+  for (size_t i = 0; i < this->m_touched.size(); i++) {
+    size_t b = this->m_touched[i];
+    size_t m = this->m_marked[b];
+    this->m_marked[b] = 0;
+    if (m == this->m_end[b] - this->m_first[b])
+      continue;
+
+    /* the marked states become a new block */
+    size_t nb = this->m_first.size();
+    this->m_first.push_back(this->m_first[b]);
+    this->m_end.push_back(this->m_first[b] + m);
+    this->m_marked.push_back(0);
+    this->m_inWork.push_back(false);
+    this->m_first[b] += m;
+    for (size_t k = this->m_first[nb]; k < this->m_end[nb]; k++)
+      this->m_blockOf[ this->m_elems[k] ] = nb;
+
+    size_t add = nb;
+    if (!this->m_inWork[b]
+	&& this->m_end[b] - this->m_first[b] < m)
+      add = b;
+    this->m_work.push_back(add);
+    this->m_inWork[add] = true;
+  }
+  this->m_touched.clear();
+}
+
+void
+DFAMinimizer::minimize(DFA *dfa)
+{
+  stateNum n = dfa->getNumStates();
+  if (n < 2)
+    return;
+
+  size_t k = dfa->getNumClasses();
+  this->buildPreds(dfa);
+  this->initPartition(dfa);
+
+  StateVec splitter(makeAlloc<stateNum>(this->m_mc));
+  while (!this->m_work.empty()) {
+    size_t b = this->m_work.back();
+    this->m_work.pop_back();
+    this->m_inWork[b] = false;
+    if (this->m_lim)
+      this->m_lim->check(0, 0);
+
+    splitter.assign(this->m_elems.begin() + this->m_first[b],
+		    this->m_elems.begin() + this->m_end[b]);
+
+    for (size_t c = 0; c < k; c++) {
+      for (size_t i = 0; i < splitter.size(); i++) {
+	size_t key = splitter[i] * k + c;
+	for (size_t p = this->m_predStart[key];
+	     p < this->m_predStart[key + 1]; p++)
+	  this->mark(this->m_preds[p]);
+      }
+      this->splitTouched();
+    }
+  }
+
+  /* number the blocks in order of their lowest state, so the */
+  /* dead state stays at zero                                 */
+  StateVec blockId(makeAlloc<stateNum>(this->m_mc));
+  blockId.assign(this->m_first.size(), NO_STATE);
+  StateVec newId(makeAlloc<stateNum>(this->m_mc));
+  newId.resize(n);
+  stateNum nNew = 0;
+  for (stateNum s = 0; s < n; s++) {
+    size_t b = this->m_blockOf[s];
+    if (blockId[b] == NO_STATE)
+      blockId[b] = nNew++;
+    newId[s] = blockId[b];
+  }
+
+  if (nNew < n)
+    dfa->renumber(newId, nNew);
+}
+
+/********************************/
+
+ParallelDFAMinimizer::ParallelDFAMinimizer(MemoryControl *mc,
+					   size_t numThreads)
+  : m_mc(mc),
+    m_numThreads(numThreads),
+    m_dfa(NULL),
+    m_lim(NULL),
+    m_block(makeAlloc<size_t>(mc)),
+    m_hash(makeAlloc<size_t>(mc)),
+    m_rep(makeAlloc<size_t>(mc)),
+    m_shardStart(makeAlloc<size_t>(mc)),
+    m_order(makeAlloc<stateNum>(mc)),
+    m_slotStart(makeAlloc<size_t>(mc)),
+    m_slots(makeAlloc<stateNum>(mc)),
+    m_args(makeAlloc<TaskArg>(mc)),
+    m_threads(makeAlloc<pthread_t>(mc))
+{
+  if (this->m_numThreads == 0)
+    this->m_numThreads = ParallelSubsetBuilder::defaultNumThreads();
+
+  this->m_args.resize(this->m_numThreads);
+  this->m_threads.resize(this->m_numThreads);
+  this->m_shardStart.resize(this->m_numThreads + 1);
+  this->m_slotStart.resize(this->m_numThreads + 1);
+}
+
+void *
+ParallelDFAMinimizer::threadMain(void *arg)
+{
+  TaskArg *ta = (TaskArg *)arg;
+  (ta->m_owner->*ta->m_task)(ta->m_index);
+  return NULL;
+}
+
+/*
+ * Run task 0 .. m_numThreads-1, task 0 on the calling thread. Tasks
+ * whose thread could not be started are run here too. Tasks never
+ * allocate, so nothing can throw while threads are running.
+ */
+void
+ParallelDFAMinimizer::runTasks(Task task)
+{
+  size_t nt = this->m_numThreads;
+  for (size_t t = 0; t < nt; t++) {
+    this->m_args[t].m_owner = this;
+    this->m_args[t].m_task = task;
+    this->m_args[t].m_index = t;
+  }
+
+  size_t numStarted = 1;
+  while (numStarted < nt) {
+    if (pthread_create(&this->m_threads[numStarted], NULL,
+		       ParallelDFAMinimizer::threadMain,
+		       &this->m_args[numStarted]) != 0)
+      break;
+    numStarted++;
+  }
+
+  (this->*task)(0);
+  for (size_t t = numStarted; t < nt; t++)
+    (this->*task)(t);
+
+  for (size_t t = 1; t < numStarted; t++)
+    pthread_join(this->m_threads[t], NULL);
+}
+
+void
+ParallelDFAMinimizer::hashRange(size_t t)
+{
+  const DFA *dfa = this->m_dfa;
+  size_t n = dfa->getNumStates();
+  size_t k = dfa->getNumClasses();
+  size_t lo = n * t / this->m_numThreads;
+  size_t hi = n * (t + 1) / this->m_numThreads;
+
+  for (stateNum s = lo; s < hi; s++) {
+    size_t h = this->m_block[s] * 16777619;
+    for (size_t c = 0; c < k; c++)
+      h = (h ^ this->m_block[ dfa->getClassNextState(s, c) ]) * 16777619;
+    this->m_hash[s] = h ^ (h >> 15);
+  }
+}
+
+bool
+ParallelDFAMinimizer::sameSignature(stateNum a, stateNum b) const
+{
+  const DFA *dfa = this->m_dfa;
+  if (this->m_block[a] != this->m_block[b])
+    return false;
+  for (size_t c = 0; c < dfa->getNumClasses(); c++)
+    if (this->m_block[ dfa->getClassNextState(a, c) ]
+	!= this->m_block[ dfa->getClassNextState(b, c) ])
+      return false;
+  return true;
+}
+
+/* m_rep[s] becomes the lowest state with the same signature as s */
+void
+ParallelDFAMinimizer::groupShard(size_t t)
+{
+  size_t nt = this->m_numThreads;
+  stateNum *slots = &this->m_slots[0] + this->m_slotStart[t];
+  size_t mask = this->m_slotStart[t + 1] - this->m_slotStart[t] - 1;
+
+  for (size_t i = this->m_shardStart[t]; i < this->m_shardStart[t + 1]; i++) {
+    stateNum s = this->m_order[i];
+    size_t h = this->m_hash[s];
+    size_t j = (h / nt) & mask;
+    for (;;) {
+      stateNum r = slots[j];
+      if (r == NO_STATE) {
+	slots[j] = s;
+	this->m_rep[s] = s;
+	break;
+      }
+      if (this->m_hash[r] == h && this->sameSignature(r, s)) {
+	this->m_rep[s] = r;
+	break;
+      }
+      j = (j + 1) & mask;
+    }
+  }
+}
+
+/* one round, returns the number of blocks after it */
+size_t
+ParallelDFAMinimizer::refine()
+{
+  size_t n = this->m_dfa->getNumStates();
+  size_t nt = this->m_numThreads;
+
+  this->runTasks(&ParallelDFAMinimizer::hashRange);
+
+  /* bucket the states by shard, keeping them in order */
+  this->m_shardStart.assign(nt + 1, 0);
+  for (stateNum s = 0; s < n; s++)
+    this->m_shardStart[ this->m_hash[s] % nt + 1 ]++;
+  for (size_t t = 0; t < nt; t++)
+    this->m_shardStart[t + 1] += this->m_shardStart[t];
+  SizeVec pos(this->m_shardStart.begin(), this->m_shardStart.end() - 1,
+	      makeAlloc<size_t>(this->m_mc));
+  for (stateNum s = 0; s < n; s++)
+    this->m_order[ pos[ this->m_hash[s] % nt ]++ ] = s;
+
+  size_t total = 0;
+  for (size_t t = 0; t < nt; t++) {
+    size_t sz = 2;
+    while (sz < 2 * (this->m_shardStart[t + 1] - this->m_shardStart[t]))
+      sz *= 2;
+    this->m_slotStart[t] = total;
+    total += sz;
+  }
+  this->m_slotStart[nt] = total;
+  this->m_slots.assign(total, NO_STATE);
+
+  this->runTasks(&ParallelDFAMinimizer::groupShard);
+
+  /* the hashes are done with, they hold the new blocks */
+  size_t count = 0;
+  for (stateNum s = 0; s < n; s++) {
+    if (this->m_rep[s] == s)
+      this->m_hash[s] = count++;
+    else
+      this->m_hash[s] = this->m_hash[ this->m_rep[s] ];
+  }
+  this->m_block.swap(this->m_hash);
+  return count;
+}
+
+void
+ParallelDFAMinimizer::minimize(DFA *dfa)
+{
+  stateNum n = dfa->getNumStates();
+  if (n < 2)
+    return;
+
+  this->m_dfa = dfa;
+  this->m_block.resize(n);
+  for (stateNum s = 0; s < n; s++)
+    this->m_block[s] = dfa->getAcceptToken(s);
+  this->m_hash.resize(n);
+  this->m_rep.resize(n);
+  this->m_order.resize(n);
+
+  /* the accept tokens are labels, not a count - always refine once */
+  size_t count = 0;
+  size_t prev;
+  do {
+    if (this->m_lim)
+      this->m_lim->check(0, 0);
+    prev = count;
+    count = this->refine();
+  } while (count != prev);
+
+  this->m_dfa = NULL;
+  if (count < n) {
+    StateVec newId(this->m_block.begin(), this->m_block.end(),
+		   makeAlloc<stateNum>(this->m_mc));
+    dfa->renumber(newId, count);
+  }
+}
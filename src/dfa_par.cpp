@@ -0,0 +1,289 @@
+// Copyright (c) 2010, Ram Bhamidipaty
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// 
+//     * Redistributions of source code must retain the above
+//       copyright notice, this list of conditions and the
+//       following disclaimer.
+// 
+//     * Redistributions in binary form must reproduce the above
+//       copyright notice, this list of conditions and the following
+//       disclaimer in the documentation and/or other materials
+//       provided with the distribution.
+// 
+//     * Neither the name of Ram Bhamidipaty nor the names of its
+//       contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <new>
+#include <memory>
+#include <limits>
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+#include <iostream>
+using namespace std;
+
+#include "cpptoken.h"
+#include "cpptoken_private.h"
+using namespace cpptoken;
+
+/* states handed to a thread at a time */
+static const size_t PARALLEL_CHUNK = 16;
+
+/********************************/
+
+ParallelSubsetBuilder::Worker::Worker(ParallelSubsetBuilder *owner,
+				      size_t id, MemoryControl *mc)
+  : m_owner(owner),
+    m_id(id),
+    m_ctx(owner->m_nfa, mc),
+    m_next(makeAlloc<stateNum>(mc)),
+    m_pool(makeAlloc<stateNum>(mc)),
+    m_failed(false)
+{
+  ;
+}
+
+void *
+ParallelSubsetBuilder::Worker::threadMain(void *arg)
+{
+  ((Worker *)arg)->run();
+  return NULL;
+}
+
+/*
+ * Take chunks of the current level until there are none left. The
+ * successor sets go into this worker's pool, the result slot of
+ * each state and class says where. Only memory can run out here;
+ * that is recorded and the other workers are told to stop.
+ */
+void
+ParallelSubsetBuilder::Worker::run()
+{
+  ParallelSubsetBuilder *o = this->m_owner;
+  size_t k = o->m_numClasses;
+  size_t levelSize = o->m_levelEnd - o->m_levelStart;
+
+  try {
+    for (;;) {
+      size_t first = __atomic_fetch_add(&o->m_nextChunk, PARALLEL_CHUNK,
+					__ATOMIC_RELAXED);
+      if (first >= levelSize)
+	break;
+      size_t last = first + PARALLEL_CHUNK;
+      if (last > levelSize)
+	last = levelSize;
+
+      for (size_t i = first; i < last; i++) {
+	size_t len;
+	const stateNum *p = o->m_sets.getSet(o->m_levelStart + i, &len);
+	if (len == 0)
+	  continue;
+	for (size_t c = 0; c < k; c++) {
+	  this->m_ctx.step(p, len, o->m_classRep[c], &this->m_next);
+	  Result &r = o->m_results[i * k + c];
+	  r.m_worker = this->m_id;
+	  r.m_start = this->m_pool.size();
+	  r.m_len = this->m_next.size();
+	  this->m_pool.insert(this->m_pool.end(),
+			      this->m_next.begin(), this->m_next.end());
+	}
+      }
+    }
+  }
+  catch (...) {
+    this->m_failed = true;
+    __atomic_store_n(&o->m_nextChunk, levelSize, __ATOMIC_RELAXED);
+  }
+}
+
+/********************************/
+
+ParallelSubsetBuilder::ParallelSubsetBuilder(const NFA *nfa,
+					     MemoryControl *mc,
+					     const BuilderLimits *lim,
+					     size_t numThreads)
+  : m_nfa(nfa),
+    m_mc(mc),
+    m_lim(lim),
+    m_lockedMC(mc),
+    m_sets(mc),
+    m_next(makeAlloc<stateNum>(mc)),
+    m_workers(makeAlloc<Worker *>(mc)),
+    m_threads(makeAlloc<pthread_t>(mc)),
+    m_results(makeAlloc<Result>(mc)),
+    m_levelStart(0),
+    m_levelEnd(0),
+    m_nextChunk(0)
+{
+  this->m_numClasses = nfa->computeByteClasses(this->m_byteClass);
+  for (unsigned int ch = 256; ch > 0; ch--)
+    this->m_classRep[ this->m_byteClass[ch - 1] ] = (uchar)(ch - 1);
+
+  if (numThreads == 0)
+    numThreads = defaultNumThreads();
+
+  try {
+    this->m_workers.reserve(numThreads);
+    this->m_threads.resize(numThreads);
+    for (size_t w = 0; w < numThreads; w++) {
+      void *p = this->m_lockedMC.allocate(sizeof(Worker));
+      try {
+	this->m_workers.push_back(new (p) Worker(this, w, &this->m_lockedMC));
+      }
+      catch (...) {
+	this->m_lockedMC.deallocate(p, sizeof(Worker));
+	throw;
+      }
+    }
+  }
+  catch (...) {
+    this->freeWorkers();
+    throw;
+  }
+}
+
+ParallelSubsetBuilder::~ParallelSubsetBuilder()
+{
+  this->freeWorkers();
+}
+
+void
+ParallelSubsetBuilder::freeWorkers()
+{
+  for (size_t w = 0; w < this->m_workers.size(); w++) {
+    this->m_workers[w]->~Worker();
+    this->m_lockedMC.deallocate(this->m_workers[w], sizeof(Worker));
+  }
+  this->m_workers.clear();
+}
+
+size_t
+ParallelSubsetBuilder::defaultNumThreads()
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    return 1;
+  return (size_t)n;
+}
+
+/* same as SubsetBuilder::addDFAState */
+stateNum
+ParallelSubsetBuilder::addDFAState(DFA *dfa, const StateVec &set)
+{
+  bool isNew;
+  size_t id = this->m_sets.intern(set, &isNew);
+  if (!isNew)
+    return id;
+
+  if (this->m_lim)
+    this->m_lim->check(this->m_sets.size(),
+		       this->m_nfa->getMemoryBytes()
+		       + this->m_sets.getMemoryBytes()
+		       + dfa->getNumStates() * dfa->getNumClasses()
+		       * sizeof(stateNum));
+
+  size_t len;
+  const stateNum *p = this->m_sets.getSet(id, &len);
+  dfa->addState(this->m_workers[0]->m_ctx.acceptToken(p, len));
+  return id;
+}
+
+/*
+ * Compute the successors of every state of the current level. The
+ * calling thread is worker 0; small levels are not worth starting
+ * threads for. If a thread cannot be started its share of the work
+ * is picked up by the ones that did start.
+ */
+void
+ParallelSubsetBuilder::expandLevel()
+{
+  size_t levelSize = this->m_levelEnd - this->m_levelStart;
+  Result none = { 0, 0, 0 };
+  this->m_results.assign(levelSize * this->m_numClasses, none);
+
+  for (size_t w = 0; w < this->m_workers.size(); w++) {
+    this->m_workers[w]->m_pool.clear();
+    this->m_workers[w]->m_failed = false;
+  }
+  this->m_nextChunk = 0;
+
+  size_t want = this->m_workers.size();
+  if (levelSize <= PARALLEL_CHUNK)
+    want = 1;
+
+  size_t numStarted = 1;
+  while (numStarted < want) {
+    if (pthread_create(&this->m_threads[numStarted], NULL,
+		       Worker::threadMain, this->m_workers[numStarted]) != 0)
+      break;
+    numStarted++;
+  }
+
+  this->m_workers[0]->run();
+
+  for (size_t w = 1; w < numStarted; w++)
+    pthread_join(this->m_threads[w], NULL);
+
+  for (size_t w = 0; w < numStarted; w++)
+    if (this->m_workers[w]->m_failed)
+      throw bad_alloc();
+}
+
+/*
+ * Same numbering as SubsetBuilder::build - the dead state is 0 and
+ * the rest in order of discovery, where a level is interned state by
+ * state and class by class, just as the serial loop would.
+ */
+void
+ParallelSubsetBuilder::build(DFA *dfa)
+{
+  dfa->setByteClasses(this->m_byteClass, this->m_numClasses);
+
+  this->m_next.clear();
+  this->addDFAState(dfa, this->m_next);
+
+  this->m_workers[0]->m_ctx.startSet(&this->m_next);
+  dfa->setStartState(this->addDFAState(dfa, this->m_next));
+
+  size_t k = this->m_numClasses;
+  this->m_levelStart = 1;
+  this->m_levelEnd = this->m_sets.size();
+  while (this->m_levelStart < this->m_levelEnd) {
+    this->expandLevel();
+
+    size_t levelSize = this->m_levelEnd - this->m_levelStart;
+    for (size_t i = 0; i < levelSize; i++) {
+      for (size_t c = 0; c < k; c++) {
+	const Result &r = this->m_results[i * k + c];
+	if (r.m_len == 0)
+	  continue;
+	const stateNum *p = &this->m_workers[r.m_worker]->m_pool[r.m_start];
+	this->m_next.assign(p, p + r.m_len);
+	dfa->setTransition(this->m_levelStart + i, c,
+			   this->addDFAState(dfa, this->m_next));
+      }
+    }
+
+    this->m_levelStart = this->m_levelEnd;
+    this->m_levelEnd = this->m_sets.size();
+  }
+}
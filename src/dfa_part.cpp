@@ -0,0 +1,324 @@
+// Copyright (c) 2010, Ram Bhamidipaty
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// 
+//     * Redistributions of source code must retain the above
+//       copyright notice, this list of conditions and the
+//       following disclaimer.
+// 
+//     * Redistributions in binary form must reproduce the above
+//       copyright notice, this list of conditions and the following
+//       disclaimer in the documentation and/or other materials
+//       provided with the distribution.
+// 
+//     * Neither the name of Ram Bhamidipaty nor the names of its
+//       contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <memory>
+#include <limits>
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include <iostream>
+using namespace std;
+
+#include "cpptoken.h"
+#include "cpptoken_private.h"
+using namespace cpptoken;
+
+/********************************/
+
+/*
+ * Number of states of the product of a and b that can be reached
+ * from the pair of start states, dead pair included, or something
+ * above limit once there are more. The DFA of the rules of both
+ * together never needs more states than that.
+ */
+static size_t
+productStates(MemoryControl *mc, const DFA *a, const DFA *b, size_t limit)
+{
+  /* one byte per pair of classes is enough to compute moves */
+  size_t key[256];
+  uchar rep[256];
+  size_t numReps = 0;
+  for (unsigned int ch = 0; ch < 256; ch++) {
+    size_t k = a->getByteClass((uchar)ch) * b->getNumClasses()
+      + b->getByteClass((uchar)ch);
+    size_t i = 0;
+    while (i < numReps && key[i] != k)
+      i++;
+    if (i == numReps) {
+      key[numReps] = k;
+      rep[numReps++] = (uchar)ch;
+    }
+  }
+
+  StateSetTable seen(mc);
+  StateVec pair(makeAlloc<stateNum>(mc));
+  bool isNew;
+  pair.resize(2, DFA_DEAD_STATE);
+  seen.intern(pair, &isNew);
+  pair[0] = a->getStartState();
+  pair[1] = b->getStartState();
+  seen.intern(pair, &isNew);
+
+  for (size_t id = 1; id < seen.size() && seen.size() <= limit; id++) {
+    size_t len;
+    const stateNum *p = seen.getSet(id, &len);
+    stateNum sa = p[0];
+    stateNum sb = p[1];
+    for (size_t i = 0; i < numReps; i++) {
+      pair[0] = a->getNextState(sa, rep[i]);
+      pair[1] = b->getNextState(sb, rep[i]);
+      seen.intern(pair, &isNew);
+    }
+  }
+  return seen.size();
+}
+
+/*
+ * Rules are placed in order. Each goes to the group whose DFA grows
+ * the least when the rule joins it, as long as that stays within
+ * groupStates; the growth is how much the rule interferes with the
+ * rules already there. A rule that fits no group starts a new one.
+ *
+ * Each rule's DFA is built once. The growth is estimated from the
+ * product of that DFA with each group's DFA, walked only as far as
+ * could still beat the best group so far, and only the chosen
+ * group is rebuilt. A rule whose DFA alone is over groupStates is
+ * built within the caller's limits only and gets a group of its
+ * own, the one place a group can end up over groupStates.
+ */
+PartitionedDFA *
+Builder::BuildPartitionedDFA(MemoryControl *mc, BuilderLimits *lim,
+			     size_t groupStates)
+{
+  size_t n = this->m_pats ? this->m_pats->size() : 0;
+  vector<size_t, Alloc<size_t> > ruleGroup(makeAlloc<size_t>(this->m_mc));
+  vector<bool, Alloc<bool> > trial(makeAlloc<bool>(this->m_mc));
+  ruleGroup.resize(n, 0);
+  trial.resize(n, false);
+
+  if (lim)
+    lim->startClock();
+
+  PartitionedDFA *res = new (mc) PartitionedDFA(mc);
+  res->setSemantics(this->m_semantics);
+  try {
+    BuilderLimits groupLim(0, groupStates);
+    groupLim.setParent(lim);
+    for (size_t r = 0; r < n; r++) {
+      if (lim)
+	lim->check(0, 0);
+
+      for (size_t x = 0; x < r; x++)
+	trial[x] = false;
+      trial[r] = true;
+      NFA *nfa = this->buildRulesNFA(this->m_mc, lim, trial);
+      DFA *alone = this->buildDFAFromNFA(mc, lim, nfa, 1);
+
+      bool found = false;
+      size_t best = 0;
+      size_t bestGrowth = 0;
+      DFA *joined = NULL;
+      try {
+	for (size_t g = 0; g < res->getNumGroups(); g++) {
+	  size_t old = res->getGroup(g)->getNumStates();
+	  size_t cap = groupStates;
+	  if (found && old + bestGrowth - 1 < cap)
+	    cap = old + bestGrowth - 1;
+	  if (cap < old)
+	    continue;
+	  size_t now = productStates(this->m_mc, res->getGroup(g), alone, cap);
+	  if (now > cap)
+	    continue;
+	  found = true;
+	  best = g;
+	  bestGrowth = now > old ? now - old : 0;
+	  if (bestGrowth == 0)
+	    break;
+	}
+
+	if (found) {
+	  for (size_t x = 0; x < r; x++)
+	    trial[x] = ruleGroup[x] == best;
+	  joined = this->tryRulesDFA(mc, &groupLim, trial);
+	}
+      }
+      catch (...) {
+	alone->~DFA();
+	mc->deallocate(alone, sizeof(*alone));
+	throw;
+      }
+
+      if (joined) {
+	alone->~DFA();
+	mc->deallocate(alone, sizeof(*alone));
+	res->setGroup(best, joined);
+	ruleGroup[r] = best;
+	continue;
+      }
+
+      res->addGroup(alone);
+      ruleGroup[r] = res->getNumGroups() - 1;
+    }
+    res->setRuleGroups(ruleGroup);
+  }
+  catch (...) {
+    res->~PartitionedDFA();
+    mc->deallocate(res, sizeof(*res));
+    throw;
+  }
+
+  return res;
+}
+
+/********************************/
+static void *
+PartitionedDFA::operator new(size_t sz)
+{
+  void *ptr = ::operator new(sz);
+  return ptr;
+}
+
+static void *
+PartitionedDFA::operator new(size_t sz, MemoryControl *mc)
+{
+  void *ptr = mc->allocate(sz);
+  return ptr;
+}
+
+static void
+PartitionedDFA::operator delete(void *ptr, size_t sz, MemoryControl *mc)
+{
+  mc->deallocate(ptr, sz);
+}
+
+/********************************/
+
+PartitionedDFA::PartitionedDFA(MemoryControl *mc)
+  : m_mc(mc),
+    m_groups(makeAlloc<DFA *>(mc)),
+    m_ruleGroup(makeAlloc<size_t>(mc)),
+    m_cur(makeAlloc<stateNum>(mc)),
+    m_live(makeAlloc<size_t>(mc)),
+    m_semantics(LEFTMOST_LONGEST)
+{
+  ;
+}
+
+PartitionedDFA::~PartitionedDFA()
+{
+  for (size_t g = 0; g < this->m_groups.size(); g++) {
+    this->m_groups[g]->~DFA();
+    this->m_mc->deallocate(this->m_groups[g], sizeof(DFA));
+  }
+}
+
+/* takes ownership of the DFA, which must come from the same MemoryControl */
+void
+PartitionedDFA::addGroup(DFA *dfa)
+{
+  try {
+    this->m_cur.resize(this->m_groups.size() + 1);
+    this->m_live.reserve(this->m_groups.size() + 1);
+    this->m_groups.push_back(dfa);
+  }
+  catch (...) {
+    dfa->~DFA();
+    this->m_mc->deallocate(dfa, sizeof(*dfa));
+    throw;
+  }
+}
+
+/* replaces the DFA of group g */
+void
+PartitionedDFA::setGroup(size_t g, DFA *dfa)
+{
+  this->m_groups[g]->~DFA();
+  this->m_mc->deallocate(this->m_groups[g], sizeof(DFA));
+  this->m_groups[g] = dfa;
+}
+
+void
+PartitionedDFA::setRuleGroups(const vector<size_t, Alloc<size_t> > &ruleGroup)
+{
+  this->m_ruleGroup = ruleGroup;
+}
+
+stateNum
+PartitionedDFA::getNumStates() const
+{
+  stateNum res = 0;
+  for (size_t g = 0; g < this->m_groups.size(); g++)
+    res += this->m_groups[g]->getNumStates();
+  return res;
+}
+
+/*
+ * Same result as DFA::longestMatch on a DFA of all the rules. With
+ * leftmost first each group already drops its own lower priority
+ * rules; across groups the lowest token id wins, and only a longer
+ * match of that same rule replaces it. Shortest match stops after
+ * the first byte on which any group accepts.
+ */
+size_t
+PartitionedDFA::longestMatch(const uchar *buf, size_t len, size_t *tokId)
+{
+  size_t bestLen = 0;
+  size_t bestTok = NO_TOKEN;
+
+  this->m_live.clear();
+  for (size_t g = 0; g < this->m_groups.size(); g++) {
+    stateNum s = this->m_groups[g]->getStartState();
+    this->m_cur[g] = s;
+    if (this->m_groups[g]->getAcceptToken(s) < bestTok)
+      bestTok = this->m_groups[g]->getAcceptToken(s);
+    if (s != DFA_DEAD_STATE)
+      this->m_live.push_back(g);
+  }
+
+  bool shortest = this->m_semantics == SHORTEST_MATCH;
+  for (size_t i = 0; i < len && !this->m_live.empty(); i++) {
+    if (shortest && bestTok != NO_TOKEN)
+      break;
+    for (size_t j = 0; j < this->m_live.size(); ) {
+      size_t g = this->m_live[j];
+      const DFA *dfa = this->m_groups[g];
+      stateNum s = dfa->getNextState(this->m_cur[g], buf[i]);
+      if (s == DFA_DEAD_STATE) {
+	this->m_live[j] = this->m_live.back();
+	this->m_live.pop_back();
+	continue;
+      }
+      this->m_cur[g] = s;
+      size_t tok = dfa->getAcceptToken(s);
+      bool better = this->m_semantics == LEFTMOST_FIRST ? tok <= bestTok
+	: (bestLen < i + 1 || tok < bestTok);
+      if (tok != NO_TOKEN && better) {
+	bestTok = tok;
+	bestLen = i + 1;
+      }
+      j++;
+    }
+  }
+
+  *tokId = bestTok;
+  return bestLen;
+}
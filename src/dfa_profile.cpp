@@ -0,0 +1,217 @@
+// Copyright (c) 2010, Ram Bhamidipaty
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// 
+//     * Redistributions of source code must retain the above
+//       copyright notice, this list of conditions and the
+//       following disclaimer.
+// 
+//     * Redistributions in binary form must reproduce the above
+//       copyright notice, this list of conditions and the following
+//       disclaimer in the documentation and/or other materials
+//       provided with the distribution.
+// 
+//     * Neither the name of Ram Bhamidipaty nor the names of its
+//       contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <cstring>
+#include <memory>
+#include <limits>
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+using namespace std;
+
+#include "cpptoken.h"
+#include "cpptoken_private.h"
+using namespace cpptoken;
+
+/* first line of a saved profile */
+static const char *PROFILE_MAGIC = "cpptoken-profile";
+static const size_t PROFILE_VERSION = 1;
+
+/********************************/
+
+DFAProfile::DFAProfile(MemoryControl *mc, const DFA *dfa)
+  : m_mc(mc),
+    m_fingerprint(dfa->fingerprint()),
+    m_numClasses(dfa->getNumClasses()),
+    m_stateCount(makeAlloc<size_t>(mc)),
+    m_transCount(makeAlloc<size_t>(mc))
+{
+  this->m_stateCount.resize(dfa->getNumStates(), 0);
+  this->m_transCount.resize(dfa->getNumStates() * this->m_numClasses, 0);
+}
+
+bool
+DFAProfile::matches(const DFA *dfa) const
+{
+  return dfa->fingerprint() == this->m_fingerprint;
+}
+
+/*
+ * Same result as DFA::longestMatch, counting every state entered
+ * and every transition taken. Always uses the unpacked table.
+ */
+size_t
+DFAProfile::longestMatch(const DFA *dfa, const uchar *buf, size_t len,
+			 size_t *tokId)
+{
+  size_t k = this->m_numClasses;
+  stateNum s = dfa->getStartState();
+  size_t bestLen = 0;
+  size_t bestTok = dfa->getAcceptToken(s);
+
+  this->m_stateCount[s]++;
+  for (size_t i = 0; i < len; i++) {
+    size_t cls = dfa->getByteClass(buf[i]);
+    this->m_transCount[s * k + cls]++;
+    s = dfa->getClassNextState(s, cls);
+    this->m_stateCount[s]++;
+    if (s == DFA_DEAD_STATE)
+      break;
+    if (dfa->getAcceptToken(s) != NO_TOKEN) {
+      bestTok = dfa->getAcceptToken(s);
+      bestLen = i + 1;
+    }
+  }
+
+  *tokId = bestTok;
+  return bestLen;
+}
+
+/*
+ * Text format: a header line, the sizes and fingerprint, one line
+ * of state counts, then "s cls count" for each transition taken.
+ */
+void
+DFAProfile::save(ostream &os) const
+{
+  size_t numTrans = 0;
+  for (size_t i = 0; i < this->m_transCount.size(); i++)
+    if (this->m_transCount[i])
+      numTrans++;
+
+  os << PROFILE_MAGIC << ' ' << PROFILE_VERSION << '\n';
+  os << this->m_fingerprint << ' ' << this->m_stateCount.size() << ' '
+     << this->m_numClasses << ' ' << numTrans << '\n';
+  for (size_t s = 0; s < this->m_stateCount.size(); s++)
+    os << (s ? " " : "") << this->m_stateCount[s];
+  os << '\n';
+  for (size_t i = 0; i < this->m_transCount.size(); i++)
+    if (this->m_transCount[i])
+      os << i / this->m_numClasses << ' ' << i % this->m_numClasses << ' '
+	 << this->m_transCount[i] << '\n';
+}
+
+/*
+ * Returns false, leaving the counts alone, if the input is not a
+ * profile of the DFA this profile was made for.
+ */
+bool
+DFAProfile::load(istream &is)
+{
+  string magic;
+  size_t version, fp, numStates, numClasses, numTrans;
+
+  is >> magic >> version >> fp >> numStates >> numClasses >> numTrans;
+  if (!is || magic != PROFILE_MAGIC || version != PROFILE_VERSION
+      || fp != this->m_fingerprint
+      || numStates != this->m_stateCount.size()
+      || numClasses != this->m_numClasses)
+    return false;
+
+  SizeVec states(makeAlloc<size_t>(this->m_mc));
+  SizeVec trans(makeAlloc<size_t>(this->m_mc));
+  states.resize(numStates, 0);
+  trans.resize(numStates * numClasses, 0);
+
+  for (size_t s = 0; s < numStates; s++)
+    is >> states[s];
+  for (size_t i = 0; i < numTrans; i++) {
+    size_t s, c, n;
+    is >> s >> c >> n;
+    if (!is || s >= numStates || c >= numClasses)
+      return false;
+    trans[s * numClasses + c] = n;
+  }
+  if (!is)
+    return false;
+
+  this->m_stateCount.swap(states);
+  this->m_transCount.swap(trans);
+  return true;
+}
+
+/********************************/
+
+/*
+ * Renumber the states hottest first, so the rows scanned most share
+ * cache lines and pages and never visited rows end up at the back.
+ * The dead state stays 0 and ties keep their old order. The profile
+ * describes the old numbering and does not apply afterwards.
+ * Returns false, leaving the DFA alone, if the profile is not for
+ * this DFA.
+ */
+bool
+DFA::relayout(const DFAProfile &prof)
+{
+  if (!prof.matches(this))
+    return false;
+
+  size_t n = this->getNumStates();
+  StateVec order(makeAlloc<stateNum>(this->m_mc));
+  StateVec newId(makeAlloc<stateNum>(this->m_mc));
+
+  for (stateNum s = 1; s < n; s++)
+    order.push_back(s);
+  DFAProfile::HotterState cmp;
+  cmp.m_prof = &prof;
+  stable_sort(order.begin(), order.end(), cmp);
+
+  newId.resize(n, DFA_DEAD_STATE);
+  for (size_t i = 0; i < order.size(); i++)
+    newId[order[i]] = i + 1;
+
+  this->renumber(newId, n);
+  this->pack();
+  return true;
+}
+
+/* FNV-1a over everything that decides how the DFA scans */
+size_t
+DFA::fingerprint() const
+{
+  size_t h = 2166136261u;
+  size_t n = this->getNumStates();
+  size_t vals[3] = { n, this->m_numClasses, this->m_start };
+
+  for (size_t i = 0; i < 3; i++)
+    h = (h ^ vals[i]) * 16777619u;
+  for (unsigned int ch = 0; ch < 256; ch++)
+    h = (h ^ this->m_byteClass[ch]) * 16777619u;
+  for (size_t i = 0; i < this->m_transTbl.size(); i++)
+    h = (h ^ this->m_transTbl[i]) * 16777619u;
+  for (size_t i = 0; i < n; i++)
+    h = (h ^ this->m_acceptTok[i]) * 16777619u;
+  return h;
+}
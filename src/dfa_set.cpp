@@ -0,0 +1,223 @@
+// Copyright (c) 2010, Ram Bhamidipaty
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// 
+//     * Redistributions of source code must retain the above
+//       copyright notice, this list of conditions and the
+//       following disclaimer.
+// 
+//     * Redistributions in binary form must reproduce the above
+//       copyright notice, this list of conditions and the following
+//       disclaimer in the documentation and/or other materials
+//       provided with the distribution.
+// 
+//     * Neither the name of Ram Bhamidipaty nor the names of its
+//       contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <memory>
+#include <limits>
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include <algorithm>
+#include <iostream>
+using namespace std;
+
+#include "cpptoken.h"
+#include "cpptoken_private.h"
+using namespace cpptoken;
+
+/********************************/
+
+/*
+ * The NFA keeps every accept state in every set, so a DFA state
+ * knows all the rules it accepts. The rule lists become the accept
+ * tokens of the DFA, then it is minimized and packed as usual.
+ */
+RuleSetDFA *
+Builder::BuildRuleSetDFA(MemoryControl *mc, BuilderLimits *lim,
+			 bool anywhere)
+{
+  NFA *nfa = this->BuildNFA(this->m_mc, lim);
+  RuleSetDFA *res = NULL;
+  DFA *dfa = NULL;
+
+  try {
+    nfa->setSemantics(LEFTMOST_LONGEST);
+    if (anywhere)
+      nfa->makeUnanchored();
+    res = new (mc) RuleSetDFA(mc);
+    dfa = new (mc) DFA(mc);
+    SubsetBuilder sb(nfa, this->m_mc, lim);
+    sb.setRuleSets(res->getLists());
+    sb.build(dfa);
+  }
+  catch (...) {
+    if (dfa) {
+      dfa->~DFA();
+      mc->deallocate(dfa, sizeof(*dfa));
+    }
+    if (res) {
+      res->~RuleSetDFA();
+      mc->deallocate(res, sizeof(*res));
+    }
+    nfa->~NFA();
+    this->m_mc->deallocate(nfa, sizeof(*nfa));
+    throw;
+  }
+
+  nfa->~NFA();
+  this->m_mc->deallocate(nfa, sizeof(*nfa));
+
+  try {
+    DFAMinimizer dm(this->m_mc);
+    dm.setLimits(lim);
+    dm.minimize(dfa);
+    dfa->pack();
+    res->setDFA(dfa);
+  }
+  catch (...) {
+    dfa->~DFA();
+    mc->deallocate(dfa, sizeof(*dfa));
+    res->~RuleSetDFA();
+    mc->deallocate(res, sizeof(*res));
+    throw;
+  }
+
+  return res;
+}
+
+/********************************/
+static void *
+RuleSetDFA::operator new(size_t sz)
+{
+  void *ptr = ::operator new(sz);
+  return ptr;
+}
+
+static void *
+RuleSetDFA::operator new(size_t sz, MemoryControl *mc)
+{
+  void *ptr = mc->allocate(sz);
+  return ptr;
+}
+
+static void
+RuleSetDFA::operator delete(void *ptr, size_t sz, MemoryControl *mc)
+{
+  mc->deallocate(ptr, sz);
+}
+
+/********************************/
+
+RuleSetDFA::RuleSetDFA(MemoryControl *mc)
+  : m_mc(mc),
+    m_dfa(NULL),
+    m_lists(mc),
+    m_mark(makeAlloc<size_t>(mc)),
+    m_gen(0),
+    m_seen(makeAlloc<stateNum>(mc))
+{
+  ;
+}
+
+RuleSetDFA::~RuleSetDFA()
+{
+  if (this->m_dfa) {
+    this->m_dfa->~DFA();
+    this->m_mc->deallocate(this->m_dfa, sizeof(DFA));
+  }
+}
+
+/*
+ * Takes ownership of the DFA, which must come from the same
+ * MemoryControl and whose accept tokens are ids in m_lists.
+ */
+void
+RuleSetDFA::setDFA(DFA *dfa)
+{
+  this->m_mark.resize(this->m_lists.size(), 0);
+  this->m_seen.reserve(this->m_lists.size());
+  this->m_dfa = dfa;
+}
+
+/* the rules state s accepts, sorted; NULL and 0 for none */
+const stateNum *
+RuleSetDFA::getRules(stateNum s, size_t *len) const
+{
+  size_t id = this->m_dfa->getAcceptToken(s);
+  if (id == NO_TOKEN) {
+    *len = 0;
+    return NULL;
+  }
+  return this->m_lists.getSet(id, len);
+}
+
+/* the rules that match all of buf, sorted; returns how many */
+size_t
+RuleSetDFA::matchWhole(const uchar *buf, size_t len, StateVec *rules) const
+{
+  rules->clear();
+  stateNum s = this->m_dfa->getStartState();
+  for (size_t i = 0; i < len && s != DFA_DEAD_STATE; i++)
+    s = this->m_dfa->getNextState(s, buf[i]);
+
+  size_t n;
+  const stateNum *p = this->getRules(s, &n);
+  rules->assign(p, p + n);
+  return n;
+}
+
+/*
+ * The rules that match some prefix of buf, or some substring if
+ * the DFA was built with anywhere set. Each rule list is added
+ * once, however often the scan goes through it.
+ */
+size_t
+RuleSetDFA::matchAny(const uchar *buf, size_t len, StateVec *rules)
+{
+  rules->clear();
+  this->m_seen.clear();
+  this->m_gen++;
+
+  stateNum s = this->m_dfa->getStartState();
+  for (size_t i = 0; ; i++) {
+    size_t id = this->m_dfa->getAcceptToken(s);
+    if (id != NO_TOKEN && this->m_mark[id] != this->m_gen) {
+      this->m_mark[id] = this->m_gen;
+      this->m_seen.push_back(id);
+    }
+    if (i == len)
+      break;
+    s = this->m_dfa->getNextState(s, buf[i]);
+    if (s == DFA_DEAD_STATE)
+      break;
+  }
+
+  for (size_t j = 0; j < this->m_seen.size(); j++) {
+    size_t n;
+    const stateNum *p = this->m_lists.getSet(this->m_seen[j], &n);
+    rules->insert(rules->end(), p, p + n);
+  }
+  if (this->m_seen.size() > 1) {
+    sort(rules->begin(), rules->end());
+    rules->erase(unique(rules->begin(), rules->end()), rules->end());
+  }
+  return rules->size();
+}
@@ -0,0 +1,284 @@
+// Copyright (c) 2010, Ram Bhamidipaty
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// 
+//     * Redistributions of source code must retain the above
+//       copyright notice, this list of conditions and the
+//       following disclaimer.
+// 
+//     * Redistributions in binary form must reproduce the above
+//       copyright notice, this list of conditions and the following
+//       disclaimer in the documentation and/or other materials
+//       provided with the distribution.
+// 
+//     * Neither the name of Ram Bhamidipaty nor the names of its
+//       contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <cstring>
+#include <memory>
+#include <limits>
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include <algorithm>
+#include <iostream>
+using namespace std;
+
+#include "cpptoken.h"
+#include "cpptoken_private.h"
+using namespace cpptoken;
+
+/********************************/
+
+TieredDFA *
+Builder::BuildTieredDFA(MemoryControl *mc, BuilderLimits *lim,
+			const DFAProfile *prof, size_t hotStates,
+			size_t cacheRows)
+{
+  DFA *dfa = this->BuildDFA(this->m_mc, lim);
+  TieredDFA *res = NULL;
+
+  try {
+    res = new (mc) TieredDFA(mc);
+    res->build(dfa, prof, hotStates, cacheRows);
+  }
+  catch (...) {
+    if (res) {
+      res->~TieredDFA();
+      mc->deallocate(res, sizeof(*res));
+    }
+    dfa->~DFA();
+    this->m_mc->deallocate(dfa, sizeof(*dfa));
+    throw;
+  }
+
+  dfa->~DFA();
+  this->m_mc->deallocate(dfa, sizeof(*dfa));
+  return res;
+}
+
+/********************************/
+static void *
+TieredDFA::operator new(size_t sz)
+{
+  void *ptr = ::operator new(sz);
+  return ptr;
+}
+
+static void *
+TieredDFA::operator new(size_t sz, MemoryControl *mc)
+{
+  void *ptr = mc->allocate(sz);
+  return ptr;
+}
+
+static void
+TieredDFA::operator delete(void *ptr, size_t sz, MemoryControl *mc)
+{
+  mc->deallocate(ptr, sz);
+}
+
+/********************************/
+
+TieredDFA::TieredDFA(MemoryControl *mc)
+  : m_mc(mc),
+    m_start(DFA_DEAD_STATE),
+    m_numStates(0),
+    m_numHot(0),
+    m_numClasses(0),
+    m_hot(makeAlloc<stateNum>(mc)),
+    m_hotAccept(makeAlloc<size_t>(mc)),
+    m_cold(NULL),
+    m_cacheMask(0),
+    m_cacheTag(makeAlloc<stateNum>(mc)),
+    m_cache(makeAlloc<stateNum>(mc)),
+    m_cacheAccept(makeAlloc<size_t>(mc)),
+    m_cacheMisses(0)
+{
+  memset(this->m_byteClass, 0, sizeof(this->m_byteClass));
+}
+
+TieredDFA::~TieredDFA()
+{
+  if (this->m_cold) {
+    this->m_cold->~CompressedDFA();
+    this->m_mc->deallocate(this->m_cold, sizeof(*this->m_cold));
+  }
+}
+
+/*
+ * Can only be called once. States are put in breadth first order
+ * from the start state, then, if the profile is for this DFA,
+ * stably sorted by visit count. The dead state always comes first
+ * and is hot, so a dead transition never touches the cache.
+ */
+void
+TieredDFA::build(const DFA *dfa, const DFAProfile *prof, size_t numHot,
+		 size_t cacheRows)
+{
+  size_t n = dfa->getNumStates();
+  size_t k = dfa->getNumClasses();
+  StateVec order(makeAlloc<stateNum>(this->m_mc));
+  StateVec newId(makeAlloc<stateNum>(this->m_mc));
+
+  newId.resize(n, NO_STATE);
+  order.push_back(DFA_DEAD_STATE);
+  newId[DFA_DEAD_STATE] = 0;
+  if (newId[dfa->getStartState()] == NO_STATE) {
+    newId[dfa->getStartState()] = order.size();
+    order.push_back(dfa->getStartState());
+  }
+  for (size_t i = 1; i < order.size(); i++)
+    for (size_t c = 0; c < k; c++) {
+      stateNum t = dfa->getClassNextState(order[i], c);
+      if (newId[t] == NO_STATE) {
+	newId[t] = order.size();
+	order.push_back(t);
+      }
+    }
+  for (stateNum s = 0; s < n; s++)
+    if (newId[s] == NO_STATE) {
+      newId[s] = order.size();
+      order.push_back(s);
+    }
+
+  if (prof && prof->matches(dfa)) {
+    DFAProfile::HotterState cmp;
+    cmp.m_prof = prof;
+    stable_sort(order.begin() + 1, order.end(), cmp);
+    for (size_t i = 0; i < n; i++)
+      newId[order[i]] = i;
+  }
+
+  stateNum h = numHot < 1 ? 1 : numHot;
+  if (h > n)
+    h = n;
+
+  this->m_start = newId[dfa->getStartState()];
+  this->m_numStates = n;
+  this->m_numHot = h;
+  this->m_numClasses = k;
+  memcpy(this->m_byteClass, dfa->getByteClassMap(), 256);
+
+  this->m_hot.resize(h * k);
+  this->m_hotAccept.resize(h);
+  for (stateNum s = 0; s < h; s++) {
+    this->m_hotAccept[s] = dfa->getAcceptToken(order[s]);
+    for (size_t c = 0; c < k; c++)
+      this->m_hot[s * k + c] = newId[dfa->getClassNextState(order[s], c)];
+  }
+
+  /*
+   * The cold rows go through a DFA of their own to be compressed.
+   * Targets keep their tiered numbers, so they may point past the
+   * rows of that DFA; the compressor only copies them.
+   */
+  DFA cold(this->m_mc);
+  cold.setByteClasses(this->m_byteClass, k);
+  for (stateNum s = h; s < n; s++) {
+    stateNum r = cold.addState(dfa->getAcceptToken(order[s]));
+    for (size_t c = 0; c < k; c++)
+      cold.setTransition(r, c, newId[dfa->getClassNextState(order[s], c)]);
+  }
+  this->m_cold = new (this->m_mc) CompressedDFA(this->m_mc);
+  this->m_cold->compress(&cold);
+
+  size_t rows = 1;
+  while (rows < cacheRows)
+    rows *= 2;
+  this->m_cacheMask = rows - 1;
+  this->m_cacheTag.resize(rows, NO_STATE);
+  this->m_cache.resize(rows * k);
+  this->m_cacheAccept.resize(rows);
+}
+
+/* the cache slot holding cold state s, decoding its row if needed */
+size_t
+TieredDFA::decodeCold(stateNum s)
+{
+  size_t slot = (s - this->m_numHot) & this->m_cacheMask;
+
+  if (this->m_cacheTag[slot] != s) {
+    size_t k = this->m_numClasses;
+    stateNum r = s - this->m_numHot;
+    for (size_t c = 0; c < k; c++)
+      this->m_cache[slot * k + c] = this->m_cold->getClassNextState(r, c);
+    this->m_cacheAccept[slot] = this->m_cold->getAcceptToken(r);
+    this->m_cacheTag[slot] = s;
+    this->m_cacheMisses++;
+  }
+  return slot;
+}
+
+size_t
+TieredDFA::getMemoryBytes() const
+{
+  return sizeof(*this)
+    + this->m_hot.size() * sizeof(stateNum)
+    + this->m_hotAccept.size() * sizeof(size_t)
+    + (this->m_cold ? this->m_cold->getMemoryBytes() : 0)
+    + this->m_cacheTag.size() * sizeof(stateNum)
+    + this->m_cache.size() * sizeof(stateNum)
+    + this->m_cacheAccept.size() * sizeof(size_t);
+}
+
+/* same result as DFA::longestMatch */
+size_t
+TieredDFA::longestMatch(const uchar *buf, size_t len, size_t *tokId)
+{
+  size_t k = this->m_numClasses;
+  stateNum h = this->m_numHot;
+  stateNum s = this->m_start;
+  const stateNum *row;
+  size_t acc;
+
+  if (s < h) {
+    row = &this->m_hot[s * k];
+    acc = this->m_hotAccept[s];
+  }
+  else {
+    size_t slot = this->decodeCold(s);
+    row = &this->m_cache[slot * k];
+    acc = this->m_cacheAccept[slot];
+  }
+
+  size_t bestLen = 0;
+  size_t bestTok = acc;
+  for (size_t i = 0; i < len; i++) {
+    s = row[this->m_byteClass[buf[i]]];
+    if (s == DFA_DEAD_STATE)
+      break;
+    if (s < h) {
+      row = &this->m_hot[s * k];
+      acc = this->m_hotAccept[s];
+    }
+    else {
+      size_t slot = this->decodeCold(s);
+      row = &this->m_cache[slot * k];
+      acc = this->m_cacheAccept[slot];
+    }
+    if (acc != NO_TOKEN) {
+      bestTok = acc;
+      bestLen = i + 1;
+    }
+  }
+
+  *tokId = bestTok;
+  return bestLen;
+}
@@ -32,6 +32,7 @@
 
 #include <list>
 #include <vector>
+#include <pthread.h>
 #include <limits>
 #include <iostream>
 using namespace std;
@@ -45,3 +46,9 @@ SyntaxError::getErrorIndex() const throw()
 {
   return this->m_errIdx;
 }
+
+const char *
+LimitExceeded::what() const throw()
+{
+  return this->m_reason;
+}
@@ -0,0 +1,241 @@
+// Copyright (c) 2010, Ram Bhamidipaty
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// 
+//     * Redistributions of source code must retain the above
+//       copyright notice, this list of conditions and the
+//       following disclaimer.
+// 
+//     * Redistributions in binary form must reproduce the above
+//       copyright notice, this list of conditions and the following
+//       disclaimer in the documentation and/or other materials
+//       provided with the distribution.
+// 
+//     * Neither the name of Ram Bhamidipaty nor the names of its
+//       contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <memory>
+#include <limits>
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include <iostream>
+using namespace std;
+
+#include "cpptoken.h"
+#include "cpptoken_private.h"
+using namespace cpptoken;
+
+/* a flush after fewer than this many bytes per cached state is bad */
+static const size_t LAZY_MIN_BYTES_PER_STATE = 10;
+
+/* this many bad flushes in a row and the NFA takes over */
+static const size_t LAZY_MAX_BAD_FLUSHES = 3;
+
+/********************************/
+
+LazyDFA *
+Builder::BuildLazyDFA(MemoryControl *mc, BuilderLimits *lim,
+		      size_t maxStates)
+{
+  NFA *nfa = this->BuildNFA(mc, lim);
+  LazyDFA *res;
+
+  try {
+    res = new (mc) LazyDFA(mc, nfa, maxStates);
+  }
+  catch (...) {
+    nfa->~NFA();
+    mc->deallocate(nfa, sizeof(*nfa));
+    throw;
+  }
+
+  return res;
+}
+
+/********************************/
+static void *
+LazyDFA::operator new(size_t sz)
+{
+  void *ptr = ::operator new(sz);
+  return ptr;
+}
+
+static void *
+LazyDFA::operator new(size_t sz, MemoryControl *mc)
+{
+  void *ptr = mc->allocate(sz);
+  return ptr;
+}
+
+static void
+LazyDFA::operator delete(void *ptr, MemoryControl *mc)
+{
+  mc->deallocate(ptr, sizeof(LazyDFA));
+}
+
+/********************************/
+
+/*
+ * Takes ownership of the NFA, which must have been allocated from
+ * the same MemoryControl object. The whole cache is allocated here
+ * so scanning never has to grow it.
+ */
+LazyDFA::LazyDFA(MemoryControl *mc, NFA *nfa, size_t maxStates)
+  : m_mc(mc),
+    m_nfa(nfa),
+    m_ctx(nfa, mc),
+    m_maxStates(maxStates < 4 ? 4 : maxStates),
+    m_sets(mc),
+    m_transTbl(makeAlloc<stateNum>(mc)),
+    m_acceptTok(makeAlloc<size_t>(mc)),
+    m_start(DFA_DEAD_STATE),
+    m_startSet(makeAlloc<stateNum>(mc)),
+    m_cur(makeAlloc<stateNum>(mc)),
+    m_next(makeAlloc<stateNum>(mc)),
+    m_numFlushes(0),
+    m_badFlushes(0),
+    m_bytesSinceFlush(0),
+    m_useNFA(false)
+{
+  this->m_numClasses = nfa->computeByteClasses(this->m_byteClass);
+  for (unsigned int ch = 256; ch > 0; ch--)
+    this->m_classRep[ this->m_byteClass[ch - 1] ] = (uchar)(ch - 1);
+
+  this->m_transTbl.reserve(this->m_maxStates * this->m_numClasses);
+  this->m_acceptTok.reserve(this->m_maxStates);
+  this->m_ctx.startSet(&this->m_startSet);
+  this->reset();
+}
+
+LazyDFA::~LazyDFA()
+{
+  this->m_nfa->~NFA();
+  this->m_mc->deallocate(this->m_nfa, sizeof(*this->m_nfa));
+  this->m_nfa = NULL;
+}
+
+/*
+ * Empty the cache, leaving only the dead and start states. Must not
+ * touch m_cur or m_next, computeNext() flushes between using them.
+ */
+void
+LazyDFA::reset()
+{
+  this->m_sets.clear();
+  this->m_transTbl.clear();
+  this->m_acceptTok.clear();
+
+  StateVec empty(makeAlloc<stateNum>(this->m_mc));
+  this->addState(empty);
+  this->m_start = this->addState(this->m_startSet);
+}
+
+void
+LazyDFA::flush()
+{
+  this->m_numFlushes++;
+  if (this->m_bytesSinceFlush < LAZY_MIN_BYTES_PER_STATE * this->m_maxStates)
+    this->m_badFlushes++;
+  else
+    this->m_badFlushes = 0;
+  if (this->m_badFlushes >= LAZY_MAX_BAD_FLUSHES)
+    this->m_useNFA = true;
+  this->m_bytesSinceFlush = 0;
+
+  this->reset();
+}
+
+stateNum
+LazyDFA::addState(const StateVec &set)
+{
+  bool isNew;
+  stateNum res = this->m_sets.intern(set, &isNew);
+  if (!isNew)
+    return res;
+
+  size_t len;
+  const stateNum *p = this->m_sets.getSet(res, &len);
+  this->m_transTbl.resize(this->m_transTbl.size() + this->m_numClasses,
+			  NO_STATE);
+  this->m_acceptTok.push_back(this->m_ctx.acceptToken(p, len));
+  return res;
+}
+
+/* fill in one missing transition, flushing the cache if it is full */
+stateNum
+LazyDFA::computeNext(stateNum s, size_t cls)
+{
+  size_t len;
+  const stateNum *p = this->m_sets.getSet(s, &len);
+  this->m_cur.assign(p, p + len);
+  this->m_ctx.step(p, len, this->m_classRep[cls], &this->m_next);
+
+  if (this->m_sets.size() >= this->m_maxStates
+      && this->m_sets.lookup(this->m_next) == NO_STATE) {
+    this->flush();
+    s = this->addState(this->m_cur);
+  }
+
+  stateNum n = this->addState(this->m_next);
+  this->m_transTbl[s * this->m_numClasses + cls] = n;
+  return n;
+}
+
+/*
+ * Same result as DFA::longestMatch. Not const - the scan fills in
+ * the cache as it goes, so a LazyDFA must not be shared between
+ * threads.
+ */
+size_t
+LazyDFA::longestMatch(const uchar *buf, size_t len, size_t *tokId)
+{
+  if (this->m_useNFA)
+    return this->m_ctx.longestMatch(buf, len, tokId);
+
+  size_t k = this->m_numClasses;
+  stateNum s = this->m_start;
+  size_t bestLen = 0;
+  size_t bestTok = this->m_acceptTok[s];
+  size_t mark = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    size_t cls = this->m_byteClass[buf[i]];
+    stateNum n = this->m_transTbl[s * k + cls];
+    if (n == NO_STATE) {
+      this->m_bytesSinceFlush += i - mark;
+      mark = i;
+      n = this->computeNext(s, cls);
+      if (this->m_useNFA)
+	return this->m_ctx.longestMatch(buf, len, tokId);
+    }
+    s = n;
+    if (s == DFA_DEAD_STATE)
+      break;
+    if (this->m_acceptTok[s] != NO_TOKEN) {
+      bestTok = this->m_acceptTok[s];
+      bestLen = i + 1;
+    }
+  }
+  this->m_bytesSinceFlush += i - mark;
+
+  *tokId = bestTok;
+  return bestLen;
+}
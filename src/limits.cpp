@@ -0,0 +1,341 @@
+// Copyright (c) 2010, Ram Bhamidipaty
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// 
+//     * Redistributions of source code must retain the above
+//       copyright notice, this list of conditions and the
+//       following disclaimer.
+// 
+//     * Redistributions in binary form must reproduce the above
+//       copyright notice, this list of conditions and the following
+//       disclaimer in the documentation and/or other materials
+//       provided with the distribution.
+// 
+//     * Neither the name of Ram Bhamidipaty nor the names of its
+//       contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <ctime>
+#include <memory>
+#include <limits>
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include <iostream>
+using namespace std;
+
+#include "cpptoken.h"
+#include "cpptoken_private.h"
+using namespace cpptoken;
+
+/********************************/
+
+/* called by every Build entry point, the time limit counts from here */
+void
+BuilderLimits::startClock()
+{
+  this->m_startTime = (size_t)time(NULL);
+}
+
+/*
+ * Throw LimitExceeded if the build has been cancelled or is over
+ * one of the limits, its own or its parent's. Callers pass zero for
+ * what they do not count.
+ */
+void
+BuilderLimits::check(size_t numStates, size_t numBytes) const
+{
+  if (this->m_parent)
+    this->m_parent->check(numStates, numBytes);
+
+  if (this->isCancelled())
+    throw LimitExceeded("build cancelled");
+
+  if (this->m_maxStates != 0 && numStates > this->m_maxStates)
+    throw LimitExceeded("DFA state limit exceeded");
+
+  if (this->m_maxBytes != 0 && numBytes > this->m_maxBytes)
+    throw LimitExceeded("build memory limit exceeded");
+
+  if (this->m_maxTimeInSeconds != 0
+      && this->m_startTime != 0
+      && (size_t)time(NULL) - this->m_startTime > this->m_maxTimeInSeconds)
+    throw LimitExceeded("build time limit exceeded");
+}
+
+/********************************/
+
+/*
+ * The lazy fallback only needs the NFA. It is built with the byte
+ * limit alone, the time or state limit that stopped the DFA would
+ * stop it right away.
+ */
+Scanner *
+Builder::BuildScanner(MemoryControl *mc, BuilderLimits *lim,
+		      size_t lazyStates)
+{
+  DFA *dfa = NULL;
+  LazyDFA *lazy = NULL;
+
+  try {
+    dfa = this->BuildDFA(mc, lim);
+  }
+  catch (const LimitExceeded &e) {
+    if (lim == NULL || lim->isCancelled())
+      throw;
+  }
+
+  if (dfa == NULL) {
+    BuilderLimits nfaLim(0, 0, lim->getMaxBytes());
+    lazy = this->BuildLazyDFA(mc, &nfaLim, lazyStates);
+  }
+
+  Scanner *res;
+  try {
+    res = new (mc) Scanner(mc, dfa, lazy);
+  }
+  catch (...) {
+    if (dfa) {
+      dfa->~DFA();
+      mc->deallocate(dfa, sizeof(*dfa));
+    }
+    if (lazy) {
+      lazy->~LazyDFA();
+      mc->deallocate(lazy, sizeof(*lazy));
+    }
+    throw;
+  }
+
+  return res;
+}
+
+/*
+ * The NFA for the rules set in use, without starting the clock of
+ * the limits.
+ */
+NFA *
+Builder::buildRulesNFA(MemoryControl *nfaMC, const BuilderLimits *lim,
+		       const vector<bool, Alloc<bool> > &use)
+{
+  NFA *res = new (nfaMC) NFA(nfaMC, false);
+  res->setSemantics(this->m_semantics);
+
+  try {
+    this->addRules(res, 0, lim, &use);
+  }
+  catch (...) {
+    res->~NFA();
+    nfaMC->deallocate(res, sizeof(*res));
+    throw;
+  }
+
+  return res;
+}
+
+/* NULL if the DFA for the rules set in use breaks the limits */
+DFA *
+Builder::tryRulesDFA(MemoryControl *dfaMC, BuilderLimits *lim,
+		     const vector<bool, Alloc<bool> > &use)
+{
+  try {
+    NFA *nfa = this->buildRulesNFA(this->m_mc, lim, use);
+    return this->buildDFAFromNFA(dfaMC, lim, nfa, 1);
+  }
+  catch (const LimitExceeded &e) {
+    if (lim == NULL || lim->isCancelled())
+      throw;
+  }
+  return NULL;
+}
+
+/*
+ * Each rule is first tried alone against ruleStates. The rules that
+ * pass are then tried together against unionStates, and if that
+ * fails added one at a time in rule order, so a rule only goes to
+ * the LazyDFA when the DFA of the rules kept before it cannot take
+ * it. Both tries also obey the caller's limits, but never depend on
+ * them: without limits a union that blows up is still cut off.
+ */
+Scanner *
+Builder::BuildHybridScanner(MemoryControl *mc, BuilderLimits *lim,
+			    size_t ruleStates, size_t unionStates,
+			    size_t lazyStates)
+{
+  size_t n = this->m_pats ? this->m_pats->size() : 0;
+  vector<bool, Alloc<bool> > inDFA(makeAlloc<bool>(this->m_mc));
+  vector<bool, Alloc<bool> > trial(makeAlloc<bool>(this->m_mc));
+  inDFA.resize(n, false);
+  trial.resize(n, false);
+
+  if (lim)
+    lim->startClock();
+
+  /* these also check every limit of lim */
+  BuilderLimits ruleLim(0, ruleStates);
+  BuilderLimits unionLim(0, unionStates);
+  ruleLim.setParent(lim);
+  unionLim.setParent(lim);
+  size_t numDFA = 0;
+  for (size_t r = 0; r < n; r++) {
+    if (lim)
+      lim->check(0, 0);
+    trial[r] = true;
+    DFA *dfa = this->tryRulesDFA(this->m_mc, &ruleLim, trial);
+    trial[r] = false;
+    if (dfa) {
+      dfa->~DFA();
+      this->m_mc->deallocate(dfa, sizeof(*dfa));
+      inDFA[r] = true;
+      numDFA++;
+    }
+  }
+
+  DFA *dfa = NULL;
+  LazyDFA *lazy = NULL;
+  try {
+    if (numDFA > 0 || n == 0)
+      dfa = this->tryRulesDFA(mc, &unionLim, inDFA);
+
+    if (dfa == NULL && numDFA > 0) {
+      /* the rules are fine alone but not together */
+      numDFA = 0;
+      for (size_t r = 0; r < n; r++) {
+	if (!inDFA[r])
+	  continue;
+	trial[r] = true;
+	DFA *d = this->tryRulesDFA(mc, &unionLim, trial);
+	if (d == NULL) {
+	  trial[r] = false;
+	  continue;
+	}
+	if (dfa) {
+	  dfa->~DFA();
+	  mc->deallocate(dfa, sizeof(*dfa));
+	}
+	dfa = d;
+	numDFA++;
+      }
+      inDFA.swap(trial);
+    }
+
+    if (numDFA < n) {
+      for (size_t r = 0; r < n; r++)
+	inDFA[r] = !inDFA[r];
+      BuilderLimits nfaLim(0, 0, lim ? lim->getMaxBytes() : 0);
+      NFA *nfa = this->buildRulesNFA(mc, &nfaLim, inDFA);
+      try {
+	lazy = new (mc) LazyDFA(mc, nfa, lazyStates);
+      }
+      catch (...) {
+	nfa->~NFA();
+	mc->deallocate(nfa, sizeof(*nfa));
+	throw;
+      }
+    }
+  }
+  catch (...) {
+    if (dfa) {
+      dfa->~DFA();
+      mc->deallocate(dfa, sizeof(*dfa));
+    }
+    throw;
+  }
+
+  Scanner *res;
+  try {
+    res = new (mc) Scanner(mc, dfa, lazy);
+    res->setSemantics(this->m_semantics);
+  }
+  catch (...) {
+    if (dfa) {
+      dfa->~DFA();
+      mc->deallocate(dfa, sizeof(*dfa));
+    }
+    if (lazy) {
+      lazy->~LazyDFA();
+      mc->deallocate(lazy, sizeof(*lazy));
+    }
+    throw;
+  }
+
+  return res;
+}
+
+/********************************/
+
+static void *
+Scanner::operator new(size_t sz, MemoryControl *mc)
+{
+  void *ptr = mc->allocate(sz);
+  return ptr;
+}
+
+static void
+Scanner::operator delete(void *ptr, MemoryControl *mc)
+{
+  mc->deallocate(ptr, sizeof(Scanner));
+}
+
+Scanner::Scanner(MemoryControl *mc, DFA *dfa, LazyDFA *lazy)
+  : m_mc(mc),
+    m_dfa(dfa),
+    m_lazy(lazy),
+    m_semantics(LEFTMOST_LONGEST)
+{
+  ;
+}
+
+Scanner::~Scanner()
+{
+  if (this->m_dfa) {
+    this->m_dfa->~DFA();
+    this->m_mc->deallocate(this->m_dfa, sizeof(*this->m_dfa));
+    this->m_dfa = NULL;
+  }
+  if (this->m_lazy) {
+    this->m_lazy->~LazyDFA();
+    this->m_mc->deallocate(this->m_lazy, sizeof(*this->m_lazy));
+    this->m_lazy = NULL;
+  }
+}
+
+size_t
+Scanner::longestMatch(const uchar *buf, size_t len, size_t *tokId)
+{
+  if (this->m_lazy == NULL)
+    return this->m_dfa->longestMatch(buf, len, tokId);
+  if (this->m_dfa == NULL)
+    return this->m_lazy->longestMatch(buf, len, tokId);
+
+  size_t t1, t2;
+  size_t l1 = this->m_dfa->longestMatch(buf, len, &t1);
+  size_t l2 = this->m_lazy->longestMatch(buf, len, &t2);
+  bool first;
+  if (t1 == NO_TOKEN || t2 == NO_TOKEN)
+    first = t2 == NO_TOKEN;
+  else if (this->m_semantics == LEFTMOST_FIRST)
+    first = t1 < t2;
+  else if (this->m_semantics == SHORTEST_MATCH)
+    first = l1 < l2 || (l1 == l2 && t1 < t2);
+  else
+    first = l1 > l2 || (l1 == l2 && t1 < t2);
+
+  *tokId = first ? t1 : t2;
+  return first ? l1 : l2;
+}
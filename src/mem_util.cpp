@@ -36,6 +36,7 @@
 #include <limits>
 #include <list>
 #include <vector>
+#include <pthread.h>
 #include <iostream>
 using namespace std;
 
@@ -55,3 +56,41 @@ MemoryControl::deallocate(void *ptr, size_t sz)
 {
   free(ptr);
 }
+
+/********************************/
+
+LockedMemoryControl::LockedMemoryControl(MemoryControl *mc)
+  : m_mc(mc)
+{
+  pthread_mutex_init(&this->m_lock, NULL);
+}
+
+LockedMemoryControl::~LockedMemoryControl()
+{
+  pthread_mutex_destroy(&this->m_lock);
+}
+
+void *
+LockedMemoryControl::allocate(size_t sz)
+{
+  void *ret;
+
+  pthread_mutex_lock(&this->m_lock);
+  try {
+    ret = this->m_mc->allocate(sz);
+  }
+  catch (...) {
+    pthread_mutex_unlock(&this->m_lock);
+    throw;
+  }
+  pthread_mutex_unlock(&this->m_lock);
+  return ret;
+}
+
+void
+LockedMemoryControl::deallocate(void *ptr, size_t sz)
+{
+  pthread_mutex_lock(&this->m_lock);
+  this->m_mc->deallocate(ptr, sz);
+  pthread_mutex_unlock(&this->m_lock);
+}
@@ -30,10 +30,14 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#include <cstring>
+
 #include <memory>
 #include <limits>
 #include <list>
 #include <vector>
+#include <pthread.h>
+#include <algorithm>
 #include <iostream>
 using namespace std;
 
@@ -41,6 +45,52 @@ using namespace std;
 #include "cpptoken_private.h"
 using namespace cpptoken;
 
+/********************************/
+void
+CharSet::clear()
+{
+  memset(this->m_bits, 0, sizeof(this->m_bits));
+}
+
+void
+CharSet::add(uchar c)
+{
+  this->m_bits[c >> 3] |= (uchar)(1 << (c & 7));
+}
+
+/*
+ * Partition the 256 byte values into classes of bytes that none
+ * of the char sets tells apart. Class numbers are assigned in order
+ * of the lowest byte in the class. Returns the number of classes.
+ */
+size_t
+CharSet::computeByteClasses(const CharSet *sets, size_t numSets,
+			    uchar *byteClass)
+{
+  size_t numClasses = 1;
+  size_t newId[512];
+
+  memset(byteClass, 0, 256);
+
+  for (size_t i = 0; i < numSets; i++) {
+    const CharSet &cs = sets[i];
+
+    /* split every class into the part in the set and the part out */
+    for (size_t k = 0; k < numClasses * 2; k++)
+      newId[k] = NO_STATE;
+    size_t n = 0;
+    for (unsigned int ch = 0; ch < 256; ch++) {
+      size_t key = byteClass[ch] * 2 + (cs.contains((uchar)ch) ? 1 : 0);
+      if (newId[key] == NO_STATE)
+	newId[key] = n++;
+      byteClass[ch] = (uchar)newId[key];
+    }
+    numClasses = n;
+  }
+
+  return numClasses;
+}
+
 /********************************/
 static void *
 NFA::operator new(size_t sz)
@@ -68,14 +118,28 @@ Builder::Builder(MemoryControl *mc)
 {
   this->m_mc = mc;
   this->m_pats = NULL;
+  this->m_inc = NULL;
+  this->m_semantics = LEFTMOST_LONGEST;
 }
 
 Builder::~Builder()
 {
-  this->m_mc = NULL;
   if (this->m_pats != NULL) {
+    list<PatternAction *, Alloc<PatternAction *> >::iterator iter;
+    iter = this->m_pats->begin();
+    while (iter != this->m_pats->end()) {
+      PatternAction *pa = *iter;
+      this->m_mc->deallocate((void *)pa->regex, pa->len + 1);
+      this->m_mc->deallocate(pa, sizeof(*pa));
+      iter++;
+    }
     delete this->m_pats;
   }
+  if (this->m_inc != NULL) {
+    this->m_inc->~IncrementalBuild();
+    this->m_mc->deallocate(this->m_inc, sizeof(*this->m_inc));
+  }
+  this->m_mc = NULL;
 }
 
 /********************************/
@@ -110,18 +174,642 @@ Builder::addRegEx(const char *ptr, action_func fp, void *arg)
     allocObj.setMC(this->m_mc);
     this->m_pats = new list<PatternAction *, Alloc<PatternAction *> >(allocObj);
   }
+
+  size_t len = strlen(ptr);
+  char *copy = (char *)this->m_mc->allocate(len + 1);
+  memcpy(copy, ptr, len + 1);
+
+  PatternAction *pa;
+  try {
+    pa = (PatternAction *)this->m_mc->allocate(sizeof(PatternAction));
+  }
+  catch (const bad_alloc &e) {
+    this->m_mc->deallocate(copy, len + 1);
+    throw;
+  }
+  pa->regex = copy;
+  pa->len = len;
+  pa->fp = fp;
+  pa->arg = arg;
+
+  try {
+    this->m_pats->push_back(pa);
+  }
+  catch (const bad_alloc &e) {
+    this->m_mc->deallocate(copy, len + 1);
+    this->m_mc->deallocate(pa, sizeof(*pa));
+    throw;
+  }
+}
+
+void
+Builder::addRegEx(const char *ptr, void *tok)
+{
+  this->addRegEx(ptr, NULL, tok);
+}
+
+void
+Builder::setMatchSemantics(MatchSemantics sem)
+{
+  this->m_semantics = sem;
 }
 
 NFA *
 Builder::BuildNFA(MemoryControl *nfaMC, BuilderLimits *NFALim)
 {
-  NFA *res = new (nfaMC) NFA();
+  return this->BuildNFA(nfaMC, NFALim, false);
+}
+
+/* with reverse set every rule matches its input read backwards */
+NFA *
+Builder::BuildNFA(MemoryControl *nfaMC, BuilderLimits *NFALim, bool reverse)
+{
+  if (NFALim)
+    NFALim->startClock();
+
+  NFA *res = new (nfaMC) NFA(nfaMC, reverse);
+  res->setSemantics(reverse ? LEFTMOST_LONGEST : this->m_semantics);
+
+  try {
+    this->addRules(res, 0, NFALim);
+  }
+  catch (...) {
+    res->~NFA();
+    nfaMC->deallocate(res, sizeof(*res));
+    throw;
+  }
+
   return res;
 }
 
+void
+Builder::addRules(NFA *nfa, size_t first, const BuilderLimits *lim)
+{
+  this->addRules(nfa, first, lim, NULL);
+}
+
+/*
+ * Add the rules from number first on to the NFA, only those set in
+ * use if it is not NULL. Rules keep their numbers either way. The
+ * limits are checked after each rule and while quantifiers are
+ * unrolled.
+ */
+void
+Builder::addRules(NFA *nfa, size_t first, const BuilderLimits *lim,
+		  const vector<bool, Alloc<bool> > *use)
+{
+  if (this->m_pats == NULL)
+    return;
+
+  Alloc<REToken *> alloc;
+  alloc.setMC(this->m_mc);
+
+  nfa->setLimits(lim);
+  try {
+    size_t tokId = 0;
+    list<PatternAction *, Alloc<PatternAction *> >::iterator iter;
+    iter = this->m_pats->begin();
+    while (iter != this->m_pats->end()) {
+      PatternAction *pa = *iter;
+
+      if (tokId >= first && (use == NULL || (*use)[tokId])) {
+	TokenList2 infix(this->m_mc, alloc);
+	infix.build(pa->regex, 0, pa->len);
+
+	TokenList2 postfix(this->m_mc, alloc);
+	TokenList2::tmpTokList tmpList;
+	postfix.buildPostfix(&infix, &tmpList);
+
+	nfa->addRule(&postfix, tokId);
+	if (lim)
+	  lim->check(0, nfa->getMemoryBytes());
+      }
+
+      tokId++;
+      iter++;
+    }
+  }
+  catch (...) {
+    nfa->setLimits(NULL);
+    throw;
+  }
+  nfa->setLimits(NULL);
+}
+
 /********************************/
+NFA::NFA(MemoryControl *mc, bool reverse)
+  : m_mc(mc),
+    m_states(makeAlloc<NFAState>(mc)),
+    m_charSets(makeAlloc<CharSet>(mc)),
+    m_ruleStarts(makeAlloc<stateNum>(mc)),
+    m_stateRule(makeAlloc<size_t>(mc)),
+    m_reverse(reverse),
+    m_semantics(LEFTMOST_LONGEST),
+    m_searchStart(NO_STATE),
+    m_lim(NULL)
+{
+}
+
 stateNum
 NFA::getNumStates() const
 {
-  return 0;
+  return this->m_states.size();
+}
+
+size_t
+NFA::getNumRules() const
+{
+  return this->m_ruleStarts.size();
+}
+
+stateNum
+NFA::getRuleStart(size_t tokId) const
+{
+  return this->m_ruleStarts[tokId];
+}
+
+/*
+ * Let every rule start at any position. The search start skips one
+ * byte of any value and then goes back to all the rule starts and
+ * to itself. Call after all rules have been added.
+ */
+void
+NFA::makeUnanchored()
+{
+  CharSet any;
+  any.clear();
+  for (unsigned int ch = 0; ch < 256; ch++)
+    any.add((uchar)ch);
+  this->m_charSets.push_back(any);
+
+  stateNum loop = this->addState(NS_CHAR, NO_STATE, NO_STATE,
+				 this->m_charSets.size() - 1);
+  stateNum next = loop;
+  for (size_t r = this->m_ruleStarts.size(); r > 0; r--)
+    next = this->addState(NS_SPLIT, this->m_ruleStarts[r - 1], next, 0);
+  this->patch(loop, next);
+  this->m_searchStart = loop;
+}
+
+size_t
+NFA::getMemoryBytes() const
+{
+  return this->m_states.size() * sizeof(NFAState)
+    + this->m_charSets.size() * sizeof(CharSet)
+    + this->m_ruleStarts.size() * sizeof(stateNum)
+    + this->m_stateRule.size() * sizeof(size_t);
+}
+
+size_t
+NFA::computeByteClasses(uchar *byteClass) const
+{
+  return CharSet::computeByteClasses(this->m_charSets.empty()
+				     ? NULL : &this->m_charSets[0],
+				     this->m_charSets.size(), byteClass);
+}
+
+stateNum
+NFA::addState(NFAStateType tp, stateNum out1, stateNum out2, size_t arg)
+{
+  NFAState st;
+  st.m_type = tp;
+  st.m_out1 = out1;
+  st.m_out2 = out2;
+  st.m_arg = arg;
+  this->m_states.push_back(st);
+  return this->m_states.size() - 1;
+}
+
+void
+NFA::patch(stateNum s, stateNum target)
+{
+  this->m_states[s].m_out1 = target;
+}
+
+/*
+ * Convert one rule, in postfix form, to NFA states. Every fragment
+ * on the stack owns a contiguous range of states; the fragment on
+ * top of the stack owns everything from m_lo to the end of m_states.
+ * That is what allows quantifiers to be unrolled by copying ranges.
+ */
+void
+NFA::addRule(TokenList2 *postfix, size_t tokId)
+{
+  Alloc<Frag> alloc;
+  alloc.setMC(this->m_mc);
+  FragStack stk(alloc);
+
+  stateNum firstState = this->m_states.size();
+  size_t firstSet = this->m_charSets.size();
+
+  try {
+    TokenList2::TokList::const_iterator iter = postfix->m_toks.begin();
+    while (iter != postfix->m_toks.end()) {
+      const REToken *tok = *iter;
+      Frag f1, f2;
+
+      switch (tok->m_ttype) {
+      case TT_SELF_CHAR:
+      case TT_CHAR_CLASS:
+	stk.push_back(this->charFrag(tok));
+	break;
+
+      case TT_CCAT:
+      case TT_PIPE:
+	if (stk.size() < 2)
+	  throw SyntaxError(0, "Missing operand");
+	f2 = stk.back();
+	stk.pop_back();
+	f1 = stk.back();
+	stk.pop_back();
+	if (tok->m_ttype == TT_CCAT && this->m_reverse)
+	  stk.push_back(this->reverseConcatFrag(f1, f2));
+	else if (tok->m_ttype == TT_CCAT)
+	  stk.push_back(this->concatFrag(f1, f2));
+	else
+	  stk.push_back(this->altFrag(f1, f2));
+	break;
+
+      case TT_STAR:
+      case TT_QMARK:
+      case TT_QUANTIFIER:
+	if (stk.empty())
+	  throw SyntaxError(0, "Missing operand");
+	f1 = stk.back();
+	stk.pop_back();
+	if (tok->m_ttype == TT_STAR)
+	  stk.push_back(this->starFrag(f1));
+	else if (tok->m_ttype == TT_QMARK)
+	  stk.push_back(this->qmarkFrag(f1));
+	else
+	  stk.push_back(this->quantifierFrag(f1, tok->u.m_quant));
+	break;
+
+      case TT_DOT:
+      case TT_LPAREN:
+      case TT_RPAREN:
+      case TT_num:
+	throw SyntaxError(0, "Unexpected token");
+      }
+
+      iter++;
+    }
+
+    if (stk.empty())
+      stk.push_back(this->epsilonFrag());
+    if (stk.size() != 1)
+      throw SyntaxError(0, "Missing operator");
+
+    Frag f = stk.back();
+    stateNum acc = this->addState(NS_ACCEPT, NO_STATE, NO_STATE, tokId);
+    this->patch(f.m_end, acc);
+    this->m_stateRule.resize(this->m_states.size(), tokId);
+    this->m_ruleStarts.push_back(f.m_start);
+  }
+  catch (...) {
+    /* leave the NFA as it was before this rule */
+    this->m_states.resize(firstState);
+    this->m_charSets.resize(firstSet);
+    if (this->m_stateRule.size() > firstState)
+      this->m_stateRule.resize(firstState);
+    throw;
+  }
+}
+
+NFA::Frag
+NFA::charFrag(const REToken *tok)
+{
+  CharSet cs;
+  cs.clear();
+  if (tok->m_ttype == TT_SELF_CHAR)
+    cs.add(tok->u.m_ch);
+  else {
+    REToken::UCharList::const_iterator iter = tok->u.m_charClass->begin();
+    while (iter != tok->u.m_charClass->end()) {
+      cs.add(*iter);
+      iter++;
+    }
+  }
+  this->m_charSets.push_back(cs);
+
+  Frag f;
+  f.m_lo = this->addState(NS_CHAR, NO_STATE, NO_STATE,
+			  this->m_charSets.size() - 1);
+  f.m_start = f.m_lo;
+  f.m_end = f.m_lo;
+  return f;
+}
+
+NFA::Frag
+NFA::epsilonFrag()
+{
+  Frag f;
+  f.m_lo = this->addState(NS_EPSILON, NO_STATE, NO_STATE, 0);
+  f.m_start = f.m_lo;
+  f.m_end = f.m_lo;
+  return f;
+}
+
+NFA::Frag
+NFA::concatFrag(Frag f1, Frag f2)
+{
+  this->patch(f1.m_end, f2.m_start);
+  f1.m_end = f2.m_end;
+  return f1;
+}
+
+/* f2 then f1, the combined fragment still starts at f1's states */
+NFA::Frag
+NFA::reverseConcatFrag(Frag f1, Frag f2)
+{
+  this->patch(f2.m_end, f1.m_start);
+  f1.m_start = f2.m_start;
+  return f1;
+}
+
+NFA::Frag
+NFA::altFrag(Frag f1, Frag f2)
+{
+  stateNum s = this->addState(NS_SPLIT, f1.m_start, f2.m_start, 0);
+  stateNum e = this->addState(NS_EPSILON, NO_STATE, NO_STATE, 0);
+  this->patch(f1.m_end, e);
+  this->patch(f2.m_end, e);
+  f1.m_start = s;
+  f1.m_end = e;
+  return f1;
+}
+
+NFA::Frag
+NFA::starFrag(Frag f)
+{
+  stateNum s = this->addState(NS_SPLIT, f.m_start, NO_STATE, 0);
+  stateNum e = this->addState(NS_EPSILON, NO_STATE, NO_STATE, 0);
+  this->m_states[s].m_out2 = e;
+  this->patch(f.m_end, s);
+  f.m_start = s;
+  f.m_end = e;
+  return f;
+}
+
+NFA::Frag
+NFA::qmarkFrag(Frag f)
+{
+  stateNum e = this->addState(NS_EPSILON, NO_STATE, NO_STATE, 0);
+  stateNum s = this->addState(NS_SPLIT, f.m_start, e, 0);
+  this->patch(f.m_end, e);
+  f.m_start = s;
+  f.m_end = e;
+  return f;
+}
+
+/*
+ * Duplicate the states of a fragment, which runs from f.m_lo up
+ * to hi. The copy is appended to the end of the state vector.
+ */
+NFA::Frag
+NFA::copyFrag(Frag f, stateNum hi)
+{
+  stateNum offset = this->m_states.size() - f.m_lo;
+
+  for (stateNum s = f.m_lo; s < hi; s++) {
+    NFAState st = this->m_states[s];
+    if (st.m_out1 != NO_STATE)
+      st.m_out1 += offset;
+    if (st.m_out2 != NO_STATE)
+      st.m_out2 += offset;
+    this->m_states.push_back(st);
+  }
+
+  Frag res;
+  res.m_lo = f.m_lo + offset;
+  res.m_start = f.m_start + offset;
+  res.m_end = f.m_end + offset;
+  return res;
+}
+
+/*
+ * Quantifiers are fully unrolled: x{2,4} becomes x x x? x? and
+ * x{2,} becomes x x x*.
+ */
+NFA::Frag
+NFA::quantifierFrag(Frag f, const RETokQuantifier &q)
+{
+  size_t lo, hi;
+  bool unbounded;
+
+  lo = q.m_v1Valid ? q.m_v1 : 0;
+  if (q.m_exact) {
+    hi = lo;
+    unbounded = false;
+  }
+  else if (q.m_v2Valid) {
+    hi = q.m_v2;
+    unbounded = false;
+    if (hi < lo)
+      throw SyntaxError(0, "Bad quantifier range");
+  }
+  else {
+    hi = lo;
+    unbounded = true;
+  }
+
+  size_t nCopies = unbounded ? lo + 1 : hi;
+  if (nCopies == 0) {
+    /* x{0} - drop x entirely */
+    this->m_states.resize(f.m_lo);
+    return this->epsilonFrag();
+  }
+
+  /* make all the copies while the original is still unpatched */
+  Alloc<Frag> alloc;
+  alloc.setMC(this->m_mc);
+  FragStack copies(alloc);
+
+  /* refuse before copying anything if the copies cannot fit */
+  stateNum end = this->m_states.size();
+  if (this->m_lim) {
+    size_t fragBytes = (end - f.m_lo) * sizeof(NFAState);
+    size_t room = ~((size_t)0) - this->getMemoryBytes();
+    size_t need = (fragBytes != 0 && nCopies - 1 > room / fragBytes) ? room
+      : (nCopies - 1) * fragBytes;
+    this->m_lim->check(0, this->getMemoryBytes() + need);
+  }
+
+  copies.push_back(f);
+  for (size_t i = 1; i < nCopies; i++) {
+    copies.push_back(this->copyFrag(f, end));
+    if (this->m_lim)
+      this->m_lim->check(0, this->getMemoryBytes());
+  }
+
+  Frag res;
+  for (size_t i = 0; i < nCopies; i++) {
+    Frag cur = copies[i];
+    if (i >= lo)
+      cur = unbounded ? this->starFrag(cur) : this->qmarkFrag(cur);
+    res = (i == 0) ? cur : this->concatFrag(res, cur);
+  }
+
+  return res;
+}
+
+/********************************/
+
+NFAContext::NFAContext(const NFA *nfa, MemoryControl *mc)
+  : m_nfa(nfa),
+    m_stack(makeAlloc<stateNum>(mc)),
+    m_cur(makeAlloc<stateNum>(mc)),
+    m_next(makeAlloc<stateNum>(mc)),
+    m_mark(makeAlloc<size_t>(mc)),
+    m_gen(0)
+{
+  this->m_mark.resize(nfa->getNumStates(), 0);
+}
+
+/* closure of the start states of every rule */
+void
+NFAContext::startSet(StateVec *set)
+{
+  set->clear();
+  for (size_t r = 0; r < this->m_nfa->getNumRules(); r++)
+    set->push_back(this->m_nfa->getRuleStart(r));
+  if (this->m_nfa->getSearchStart() != NO_STATE)
+    set->push_back(this->m_nfa->getSearchStart());
+  this->closure(set);
+}
+
+/*
+ * Replace the set with its epsilon closure, keeping only the
+ * char and accept states, sorted.
+ */
+void
+NFAContext::closure(StateVec *set)
+{
+  /* the NFA may have gained rules since the context was made */
+  if (this->m_mark.size() < this->m_nfa->getNumStates())
+    this->m_mark.resize(this->m_nfa->getNumStates(), 0);
+
+  this->m_gen++;
+  this->m_stack.assign(set->begin(), set->end());
+  set->clear();
+
+  while (!this->m_stack.empty()) {
+    stateNum s = this->m_stack.back();
+    this->m_stack.pop_back();
+    if (this->m_mark[s] == this->m_gen)
+      continue;
+    this->m_mark[s] = this->m_gen;
+
+    const NFAState &st = this->m_nfa->getState(s);
+    switch (st.m_type) {
+    case NS_CHAR:
+    case NS_ACCEPT:
+      set->push_back(s);
+      break;
+    case NS_SPLIT:
+      this->m_stack.push_back(st.m_out2);
+      this->m_stack.push_back(st.m_out1);
+      break;
+    case NS_EPSILON:
+      this->m_stack.push_back(st.m_out1);
+      break;
+    }
+  }
+
+  sort(set->begin(), set->end());
+  if (this->m_nfa->getSemantics() != LEFTMOST_LONGEST)
+    this->prune(set);
+}
+
+/*
+ * Once the set accepts a rule, leftmost first drops the states of
+ * every lower priority rule, they can no longer win. The states of
+ * the accepted rule stay, it may still match more input. Shortest
+ * match keeps only the accept state, so the match ends here.
+ */
+void
+NFAContext::prune(StateVec *set) const
+{
+  size_t tok = this->acceptToken(set->empty() ? NULL : &(*set)[0],
+				 set->size());
+  if (tok == NO_TOKEN)
+    return;
+
+  bool shortest = this->m_nfa->getSemantics() == SHORTEST_MATCH;
+  size_t n = 0;
+  for (size_t i = 0; i < set->size(); i++) {
+    stateNum s = (*set)[i];
+    if (shortest ? (this->m_nfa->getState(s).m_type == NS_ACCEPT
+		    && this->m_nfa->getState(s).m_arg == tok)
+	: this->m_nfa->getStateRule(s) <= tok)
+      (*set)[n++] = s;
+  }
+  set->resize(n);
+}
+
+/* move on ch from every state in the set, then take the closure */
+void
+NFAContext::step(const stateNum *set, size_t len, uchar ch, StateVec *next)
+{
+  next->clear();
+  for (size_t i = 0; i < len; i++) {
+    const NFAState &st = this->m_nfa->getState(set[i]);
+    if (st.m_type == NS_CHAR
+	&& this->m_nfa->getCharSet(st.m_arg).contains(ch))
+      next->push_back(st.m_out1);
+  }
+  if (!next->empty())
+    this->closure(next);
+}
+
+/* lowest numbered rule accepted by the set - it has priority */
+size_t
+NFAContext::acceptToken(const stateNum *set, size_t len) const
+{
+  size_t res = NO_TOKEN;
+  for (size_t i = 0; i < len; i++) {
+    const NFAState &st = this->m_nfa->getState(set[i]);
+    if (st.m_type == NS_ACCEPT && st.m_arg < res)
+      res = st.m_arg;
+  }
+  return res;
+}
+
+/* every rule accepted by the set, sorted and without duplicates */
+void
+NFAContext::acceptRules(const stateNum *set, size_t len, StateVec *rules) const
+{
+  rules->clear();
+  for (size_t i = 0; i < len; i++) {
+    const NFAState &st = this->m_nfa->getState(set[i]);
+    if (st.m_type == NS_ACCEPT)
+      rules->push_back(st.m_arg);
+  }
+  sort(rules->begin(), rules->end());
+  rules->erase(unique(rules->begin(), rules->end()), rules->end());
+}
+
+/* same result as DFA::longestMatch, without building any DFA states */
+size_t
+NFAContext::longestMatch(const uchar *buf, size_t len, size_t *tokId)
+{
+  this->startSet(&this->m_cur);
+  size_t bestLen = 0;
+  size_t bestTok = this->m_cur.empty() ? NO_TOKEN
+    : this->acceptToken(&this->m_cur[0], this->m_cur.size());
+
+  for (size_t i = 0; i < len && !this->m_cur.empty(); i++) {
+    this->step(&this->m_cur[0], this->m_cur.size(), buf[i], &this->m_next);
+    this->m_cur.swap(this->m_next);
+    if (this->m_cur.empty())
+      break;
+    size_t tok = this->acceptToken(&this->m_cur[0], this->m_cur.size());
+    if (tok != NO_TOKEN) {
+      bestTok = tok;
+      bestLen = i + 1;
+    }
+  }
+
+  *tokId = bestTok;
+  return bestLen;
 }
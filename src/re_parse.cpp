@@ -36,6 +36,7 @@
 #include <limits>
 #include <list>
 #include <vector>
+#include <pthread.h>
 #include <iostream>
 using namespace std;
 
@@ -69,6 +70,7 @@ REToken::REToken(TokenList *tlist, TokType tt, uchar c)
   case TT_QUANTIFIER:
     this->u.m_quant.m_v1Valid = false;
     this->u.m_quant.m_v2Valid = false;
+    this->u.m_quant.m_exact = false;
     this->u.m_quant.m_v1 = 0;
     this->u.m_quant.m_v2 = 0;
     break;
@@ -105,6 +107,7 @@ REToken::REToken(TokenList2 *tlist, TokType tt, uchar c)
   case TT_QUANTIFIER:
     this->u.m_quant.m_v1Valid = false;
     this->u.m_quant.m_v2Valid = false;
+    this->u.m_quant.m_exact = false;
     this->u.m_quant.m_v1 = 0;
     this->u.m_quant.m_v2 = 0;
     break;
@@ -137,12 +140,25 @@ REToken::REToken(TokenList2 *tlist, const REToken *other)
 
   case TT_CHAR_CLASS:
     {
-      this->u.m_charClass = new UCharList(tlist->m_toks.get_allocator());
-      UCharList::const_iterator iter = other->u.m_charClass->begin();
+      this->u.m_charClass = NULL;
+      UCharList *tmp = new UCharList(tlist->m_toks.get_allocator());
+      try {
+	UCharList::const_iterator iter = other->u.m_charClass->begin();
+	while (iter != other->u.m_charClass->end()) {
+	  tmp->push_back(*iter);
+	  iter++;
+	}
+      }
+      catch (const bad_alloc &e) {
+	delete tmp;
+	throw;
+      }
+      this->u.m_charClass = tmp;
     }
     break;
 
   case TT_QUANTIFIER:
+    this->u.m_quant.m_exact = other->u.m_quant.m_exact;
     if (other->u.m_quant.m_v1Valid) {
       this->u.m_quant.m_v1Valid = true;
       this->u.m_quant.m_v1 = other->u.m_quant.m_v1;
@@ -352,6 +368,10 @@ TokenList::buildQuantifier(const uchar *start, const uchar *ptr,
       throw SyntaxError(idx, "Quantifier too large");
     }
     v1 = tmp + (ch - '0');
+    if (v1 > RE_MAX_REPEAT) {
+      size_t idx = ptr - start;
+      throw SyntaxError(idx, "Quantifier too large");
+    }
     ptr++;
   }
 
@@ -402,6 +422,10 @@ TokenList::buildQuantifier(const uchar *start, const uchar *ptr,
       throw SyntaxError(idx, "Quantifier too large");
     }
     v2 = tmp + (ch - '0');
+    if (v2 > RE_MAX_REPEAT) {
+      size_t idx = ptr - start;
+      throw SyntaxError(idx, "Quantifier too large");
+    }
     ptr++;
   }
 
@@ -862,6 +886,12 @@ TokenList2::build(const char *regex, size_t start, size_t len)
     case '*':
       this->simpleAddToken(TT_STAR);
       break;
+    case '?':
+      this->simpleAddToken(TT_QMARK);
+      break;
+    case '+':
+      this->addPlusQuantifier();
+      break;
     case '|':
       this->simpleAddToken(TT_PIPE);
       break;
@@ -871,12 +901,15 @@ TokenList2::build(const char *regex, size_t start, size_t len)
     case ')':
       this->addTokenAndMaybeCcat(TT_RPAREN, ch);
       break;
+
+    /* buildCharClass and buildQuantifier return a pointer to */
+    /* the first char after the construct - skip the ptr++    */
     case '[':
       ptr = this->buildCharClass((const uchar *)regex, ptr, last_valid);
-      break;
+      continue;
     case '{':
       ptr = this->buildQuantifier((const uchar *)regex, ptr, last_valid);
-      break;
+      continue;
     default:
       this->addTokenAndMaybeCcat(TT_SELF_CHAR, ch);
       break;
@@ -894,14 +927,16 @@ TokenList2::buildQuantifier(const uchar *start, const uchar *ptr,
 {
   size_t v1, v2, tmp;
   uchar ch;
-  bool v1_found, v2_found;
+  bool v1_found, v2_found, comma_found;
   REToken *tok;
 
+  comma_found = false;
   v1_found = false;
   v1 = 0;
   v2_found = false;
   v2 = 0;
 
+  ch = *ptr;
   ptr++;
 
   while (ptr <= last_valid) {
@@ -924,6 +959,10 @@ TokenList2::buildQuantifier(const uchar *start, const uchar *ptr,
       throw SyntaxError(idx, "Quantifier too large");
     }
     v1 = tmp + (ch - '0');
+    if (v1 > RE_MAX_REPEAT) {
+      size_t idx = ptr - start;
+      throw SyntaxError(idx, "Quantifier too large");
+    }
     ptr++;
   }
 
@@ -936,8 +975,10 @@ TokenList2::buildQuantifier(const uchar *start, const uchar *ptr,
     break;
   }
 
-  if (ch == ',')
+  if (ch == ',') {
+    comma_found = true;
     ptr++;
+  }
   else if (ch != '}') {
     size_t idx = ptr - start;
     throw SyntaxError(idx, "Bad quantifier");
@@ -958,6 +999,7 @@ TokenList2::buildQuantifier(const uchar *start, const uchar *ptr,
     tok->u.m_quant.m_v2 = 0;
     tok->u.m_quant.m_v1Valid = true;
     tok->u.m_quant.m_v2Valid = false;
+    tok->u.m_quant.m_exact = !comma_found;
     this->m_toks.push_back(tok);
     ptr++;
     return ptr;
@@ -974,6 +1016,10 @@ TokenList2::buildQuantifier(const uchar *start, const uchar *ptr,
       throw SyntaxError(idx, "Quantifier too large");
     }
     v2 = tmp + (ch - '0');
+    if (v2 > RE_MAX_REPEAT) {
+      size_t idx = ptr - start;
+      throw SyntaxError(idx, "Quantifier too large");
+    }
     ptr++;
   }
 
@@ -997,7 +1043,21 @@ TokenList2::buildQuantifier(const uchar *start, const uchar *ptr,
     return ptr;
   }
 
-  return ptr;
+  size_t idx = ptr - start;
+  throw SyntaxError(idx, "Unterminated quantifier");
+}
+
+void
+TokenList2::addPlusQuantifier()
+{
+  /* x+ is the same as x{1,} */
+  REToken *tok = new (this->m_mc) REToken(this, TT_QUANTIFIER);
+  tok->u.m_quant.m_v1 = 1;
+  tok->u.m_quant.m_v2 = 0;
+  tok->u.m_quant.m_v1Valid = true;
+  tok->u.m_quant.m_v2Valid = false;
+  this->m_toks.push_back(tok);
+  return;
 }
 
 const uchar *
@@ -1115,6 +1175,7 @@ TokenList2::addToCharClass(REToken::UCharList  *c_class, uchar v1, uchar v2)
 void
 TokenList2::addRange(bool invert)
 {
+  this->maybeAddCcat(TT_CHAR_CLASS);
   REToken *tok = new (this->m_mc) REToken(this, TT_CHAR_CLASS);
 
   if (invert) {
@@ -1193,6 +1254,10 @@ TokenList2::maybeAddCcat(TokType cur_tp)
   switch (tok->m_ttype) {
   case TT_RPAREN:
   case TT_SELF_CHAR:
+  case TT_CHAR_CLASS:
+  case TT_STAR:
+  case TT_QMARK:
+  case TT_QUANTIFIER:
     tok = new (this->m_mc) REToken(this, TT_CCAT);
     this->m_toks.push_back(tok);
     break;
@@ -1286,6 +1351,16 @@ TokenList2::buildPostfix(TokenList2 *infix, tmpTokList *tmpOpList)
 
     switch (cur->m_ttype) {
     case TT_SELF_CHAR:
+    case TT_CHAR_CLASS:
+      cur2 = new (this->m_mc) REToken(this, cur);
+      this->m_toks.push_back(cur2);
+      break;
+
+    case TT_STAR:
+    case TT_QMARK:
+    case TT_QUANTIFIER:
+      // postfix unary operators bind tighter than anything
+      // else so they go straight to the output
       cur2 = new (this->m_mc) REToken(this, cur);
       this->m_toks.push_back(cur2);
       break;
@@ -1329,11 +1404,7 @@ TokenList2::buildPostfix(TokenList2 *infix, tmpTokList *tmpOpList)
       tmpOpList->push_back(cur2);
       break;
 
-    case TT_STAR:
-    case TT_QMARK:
     case TT_DOT:
-    case TT_CHAR_CLASS:
-    case TT_QUANTIFIER:
     case TT_num:
       break;
     }
@@ -1344,6 +1415,8 @@ TokenList2::buildPostfix(TokenList2 *infix, tmpTokList *tmpOpList)
   while (! tmpOpList->empty()) {
     other_op = tmpOpList->back();
     tmpOpList->pop_back();
+    if (other_op->m_ttype == TT_LPAREN)
+      throw SyntaxError(0, "Unbalanced parenthesis");
     this->m_toks.push_back(other_op);
   }
 
@@ -0,0 +1,316 @@
+// Copyright (c) 2010, Ram Bhamidipaty
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// 
+//     * Redistributions of source code must retain the above
+//       copyright notice, this list of conditions and the
+//       following disclaimer.
+// 
+//     * Redistributions in binary form must reproduce the above
+//       copyright notice, this list of conditions and the following
+//       disclaimer in the documentation and/or other materials
+//       provided with the distribution.
+// 
+//     * Neither the name of Ram Bhamidipaty nor the names of its
+//       contributors may be used to endorse or promote products
+//       derived from this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <memory>
+#include <limits>
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include <iostream>
+using namespace std;
+
+#include "cpptoken.h"
+#include "cpptoken_private.h"
+using namespace cpptoken;
+
+/********************************/
+
+SharedLazyDFA *
+Builder::BuildSharedLazyDFA(MemoryControl *mc, BuilderLimits *lim,
+			    size_t maxStates)
+{
+  NFA *nfa = this->BuildNFA(mc, lim);
+  SharedLazyDFA *res;
+
+  try {
+    res = new (mc) SharedLazyDFA(mc, nfa, maxStates);
+  }
+  catch (...) {
+    nfa->~NFA();
+    mc->deallocate(nfa, sizeof(*nfa));
+    throw;
+  }
+
+  return res;
+}
+
+/********************************/
+static void *
+SharedLazyDFA::operator new(size_t sz)
+{
+  void *ptr = ::operator new(sz);
+  return ptr;
+}
+
+static void *
+SharedLazyDFA::operator new(size_t sz, MemoryControl *mc)
+{
+  void *ptr = mc->allocate(sz);
+  return ptr;
+}
+
+static void
+SharedLazyDFA::operator delete(void *ptr, MemoryControl *mc)
+{
+  mc->deallocate(ptr, sizeof(SharedLazyDFA));
+}
+
+/********************************/
+
+/*
+ * Takes ownership of the NFA. All tables are sized for maxStates
+ * here and never move, so readers can index them without locking.
+ * Construction itself is single threaded.
+ */
+SharedLazyDFA::SharedLazyDFA(MemoryControl *mc, NFA *nfa, size_t maxStates)
+  : m_mc(mc),
+    m_nfa(nfa),
+    m_maxStates(maxStates < 2 ? 2 : maxStates),
+    m_info(makeAlloc<StateInfo>(mc)),
+    m_transTbl(makeAlloc<stateNum>(mc)),
+    m_slots(makeAlloc<stateNum>(mc)),
+    m_numStates(0),
+    m_start(DFA_DEAD_STATE)
+{
+  this->m_numClasses = nfa->computeByteClasses(this->m_byteClass);
+  for (unsigned int ch = 256; ch > 0; ch--)
+    this->m_classRep[ this->m_byteClass[ch - 1] ] = (uchar)(ch - 1);
+
+  size_t nSlots = 16;
+  while (nSlots < 2 * this->m_maxStates)
+    nSlots *= 2;
+
+  StateInfo empty = { NULL, 0, 0, NO_TOKEN };
+  this->m_info.resize(this->m_maxStates, empty);
+  this->m_transTbl.resize(this->m_maxStates * this->m_numClasses, NO_STATE);
+  this->m_slots.resize(nSlots, NO_STATE);
+
+  pthread_mutex_init(&this->m_lock, NULL);
+
+  try {
+    NFAContext ctx(nfa, mc);
+    StateVec set(makeAlloc<stateNum>(mc));
+    this->intern(set, ctx);
+    ctx.startSet(&set);
+    this->m_start = this->intern(set, ctx);
+  }
+  catch (...) {
+    for (stateNum s = 0; s < this->m_maxStates; s++)
+      this->freeSet(s);
+    pthread_mutex_destroy(&this->m_lock);
+    throw;
+  }
+}
+
+SharedLazyDFA::~SharedLazyDFA()
+{
+  for (stateNum s = 0; s < this->m_maxStates; s++)
+    this->freeSet(s);
+  pthread_mutex_destroy(&this->m_lock);
+
+  this->m_nfa->~NFA();
+  this->m_mc->deallocate(this->m_nfa, sizeof(*this->m_nfa));
+  this->m_nfa = NULL;
+}
+
+void
+SharedLazyDFA::freeSet(stateNum id)
+{
+  StateInfo &info = this->m_info[id];
+  if (info.m_set)
+    this->m_mc->deallocate((void *)info.m_set,
+			   info.m_len * sizeof(stateNum));
+  info.m_set = NULL;
+  info.m_len = 0;
+}
+
+bool
+SharedLazyDFA::sameSet(stateNum id, const StateVec &set, size_t h) const
+{
+  const StateInfo &info = this->m_info[id];
+  if (info.m_hash != h || info.m_len != set.size())
+    return false;
+  for (size_t i = 0; i < info.m_len; i++)
+    if (info.m_set[i] != set[i])
+      return false;
+  return true;
+}
+
+/*
+ * Find or add the state for a set. Returns NO_STATE when the set is
+ * new and the cache is full. Two threads adding the same set race
+ * on the compare-and-swap of its slot; the loser frees its copy
+ * and its state number is simply never used.
+ */
+stateNum
+SharedLazyDFA::intern(const StateVec &set, const NFAContext &ctx)
+{
+  size_t h = StateSetTable::hashSet(set.empty() ? NULL : &set[0],
+				    set.size());
+  size_t mask = this->m_slots.size() - 1;
+  size_t i = h & mask;
+  stateNum id;
+
+  while ((id = __atomic_load_n(&this->m_slots[i], __ATOMIC_ACQUIRE))
+	 != NO_STATE) {
+    if (this->sameSet(id, set, h))
+      return id;
+    i = (i + 1) & mask;
+  }
+
+  /* claim a state number */
+  stateNum mine = __atomic_load_n(&this->m_numStates, __ATOMIC_RELAXED);
+  do {
+    if (mine >= this->m_maxStates)
+      return NO_STATE;
+  } while (!__atomic_compare_exchange_n(&this->m_numStates, &mine, mine + 1,
+					false, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED));
+
+  stateNum *copy = NULL;
+  if (!set.empty()) {
+    pthread_mutex_lock(&this->m_lock);
+    try {
+      copy = (stateNum *)this->m_mc->allocate(set.size() * sizeof(stateNum));
+    }
+    catch (...) {
+      pthread_mutex_unlock(&this->m_lock);
+      throw;
+    }
+    pthread_mutex_unlock(&this->m_lock);
+    for (size_t j = 0; j < set.size(); j++)
+      copy[j] = set[j];
+  }
+
+  StateInfo &info = this->m_info[mine];
+  info.m_set = copy;
+  info.m_len = set.size();
+  info.m_hash = h;
+  info.m_acceptTok = ctx.acceptToken(copy, set.size());
+
+  /* publish, picking up where the search stopped */
+  for (;;) {
+    id = NO_STATE;
+    if (__atomic_compare_exchange_n(&this->m_slots[i], &id, mine,
+				    false, __ATOMIC_RELEASE,
+				    __ATOMIC_ACQUIRE))
+      return mine;
+    if (this->sameSet(id, set, h)) {
+      pthread_mutex_lock(&this->m_lock);
+      this->freeSet(mine);
+      pthread_mutex_unlock(&this->m_lock);
+      return id;
+    }
+    i = (i + 1) & mask;
+  }
+}
+
+/*
+ * Record that state s goes to the state for set on class cls.
+ * Any thread racing on the same transition computes the same set,
+ * so a plain atomic store is enough.
+ */
+stateNum
+SharedLazyDFA::addTransition(stateNum s, size_t cls, const StateVec &set,
+			     const NFAContext &ctx)
+{
+  stateNum n = this->intern(set, ctx);
+  if (n != NO_STATE)
+    __atomic_store_n(&this->m_transTbl[s * this->m_numClasses + cls], n,
+		     __ATOMIC_RELEASE);
+  return n;
+}
+
+/********************************/
+
+SharedLazyScanner::SharedLazyScanner(SharedLazyDFA *dfa, MemoryControl *mc)
+  : m_dfa(dfa),
+    m_ctx(dfa->getNFA(), mc),
+    m_cur(makeAlloc<stateNum>(mc)),
+    m_next(makeAlloc<stateNum>(mc))
+{
+  ;
+}
+
+/*
+ * Same result as DFA::longestMatch. When the shared cache is full
+ * the rest of the scan steps NFA state sets privately.
+ */
+size_t
+SharedLazyScanner::longestMatch(const uchar *buf, size_t len, size_t *tokId)
+{
+  SharedLazyDFA *dfa = this->m_dfa;
+  stateNum s = dfa->getStartState();
+  size_t bestLen = 0;
+  size_t bestTok = dfa->getAcceptToken(s);
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    size_t cls = dfa->getByteClass(buf[i]);
+    stateNum n = dfa->getTransition(s, cls);
+    if (n == NO_STATE) {
+      size_t setLen;
+      const stateNum *set = dfa->getSet(s, &setLen);
+      this->m_ctx.step(set, setLen, dfa->getClassRep(cls), &this->m_next);
+      n = dfa->addTransition(s, cls, this->m_next, this->m_ctx);
+      if (n == NO_STATE)
+	break;
+    }
+    s = n;
+    if (s == DFA_DEAD_STATE)
+      break;
+    if (dfa->getAcceptToken(s) != NO_TOKEN) {
+      bestTok = dfa->getAcceptToken(s);
+      bestLen = i + 1;
+    }
+  }
+
+  if (i < len && s != DFA_DEAD_STATE) {
+    /* m_next is the set after buf[i] */
+    for (i++; !this->m_next.empty(); i++) {
+      size_t tok = this->m_ctx.acceptToken(&this->m_next[0],
+					   this->m_next.size());
+      if (tok != NO_TOKEN) {
+	bestTok = tok;
+	bestLen = i;
+      }
+      if (i == len)
+	break;
+      this->m_cur.swap(this->m_next);
+      this->m_ctx.step(&this->m_cur[0], this->m_cur.size(), buf[i],
+		       &this->m_next);
+    }
+  }
+
+  *tokId = bestTok;
+  return bestLen;
+}
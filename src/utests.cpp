@@ -35,6 +35,7 @@
 
 #include <list>
 #include <vector>
+#include <pthread.h>
 #include <limits>
 #include <sstream>
 #include <exception>
@@ -751,6 +752,14 @@ TC_Tokens07::run()
     ASSERT_TRUE(true);
   }
 
+  try {
+    TokenList tlist(&mc, alloc, "{2,1001}");
+    ASSERT_TRUE(false);
+  }
+  catch (const SyntaxError &e) {
+    ASSERT_TRUE(e.getErrorIndex() == 6);
+  }
+
   this->setStatus(true);
 }
 
@@ -1506,6 +1515,15 @@ TC_Tokens207::run()
     ASSERT_TRUE(true);
   }
 
+  try {
+    TokenList2 tlist(&mc, alloc);
+    tlist.build("{100000000000}");
+    ASSERT_TRUE(false);
+  }
+  catch (const SyntaxError &e) {
+    ASSERT_TRUE(e.getErrorIndex() == 5);
+  }
+
   this->setStatus(true);
 }
 
@@ -2168,60 +2186,2934 @@ TC_BuilderBasic03::run()
 }
 
 /****************************************************/
-/* top level                                        */
 /****************************************************/
-static TestSuite *
-make_suite_all_tests()
+/* NFA and DFA construction                         */
+/****************************************************/
+/****************************************************/
+
+static bool
+check_match(DFA *dfa, const char *str, size_t expLen, size_t expTok)
 {
-  TestSuite *s;
+  size_t tok;
+  size_t len = dfa->longestMatch((const uchar *)str, strlen(str), &tok);
+  if (tok != expTok)
+    return false;
+  if (expTok != NO_TOKEN && len != expLen)
+    return false;
+  return true;
+}
 
-  s = new TestSuite();
+/********************/
 
-  s->addTestCase(new TC_Basic01());
-  s->addTestCase(new TC_Basic02());
+struct TC_NFA01 : public TestCase {
+  TC_NFA01() : TestCase("TC_NFA01") {;};
+  void run();
+};
 
-  s->addTestCase(new TC_Tokens01());
-  s->addTestCase(new TC_Tokens02());
-  s->addTestCase(new TC_Tokens03());
-  s->addTestCase(new TC_Tokens04());
-  s->addTestCase(new TC_Tokens05());
-  s->addTestCase(new TC_Tokens06());
-  s->addTestCase(new TC_Tokens07());
-  s->addTestCase(new TC_Tokens08());
+void
+TC_NFA01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
 
-  s->addTestCase(new TC_Tokens201());
-  s->addTestCase(new TC_Tokens202());
-  s->addTestCase(new TC_Tokens203());
-  s->addTestCase(new TC_Tokens204());
-  s->addTestCase(new TC_Tokens205());
-  s->addTestCase(new TC_Tokens206());
-  s->addTestCase(new TC_Tokens207());
-  s->addTestCase(new TC_Tokens208());
-  s->addTestCase(new TC_Tokens209());
-  s->addTestCase(new TC_Tokens210());
+  {
+    Builder b(&mc);
+    b.addRegEx("ab", NULL);
+    b.addRegEx("a|b*", NULL);
+    b.addRegEx("[a-z]{2,4}", NULL);
+    NFA *nfa = b.BuildNFA(&mc, NULL);
+    ASSERT_TRUE(nfa->getNumRules() == 3);
+    ASSERT_TRUE(nfa->getNumStates() > 0);
+    for (size_t r = 0; r < 3; r++)
+      ASSERT_TRUE(nfa->getRuleStart(r) < nfa->getNumStates());
+    nfa->~NFA();
+    mc.deallocate(nfa, sizeof(*nfa));
+  }
 
-  s->addTestCase(new TC_MemFail01());
-  s->addTestCase(new TC_MemFail02());
-  s->addTestCase(new TC_MemFail03());
-  s->addTestCase(new TC_MemFail04());
-  s->addTestCase(new TC_MemFail05());
+  const char *bad[] = { "a|", "(a", "a)", "*", "a{3,2}", "a{2", NULL };
+  for (size_t i = 0; bad[i]; i++) {
+    Builder b(&mc);
+    b.addRegEx(bad[i], NULL);
+    try {
+      NFA *nfa = b.BuildNFA(&mc, NULL);
+      nfa->~NFA();
+      mc.deallocate(nfa, sizeof(*nfa));
+      ASSERT_TRUE(false);
+    }
+    catch (const SyntaxError &e) {
+      ASSERT_TRUE(true);
+    }
+  }
 
-  s->addTestCase(new TC_MemFail2_02());
-  s->addTestCase(new TC_MemFail2_03());
-  s->addTestCase(new TC_MemFail2_04());
-  s->addTestCase(new TC_MemFail2_05());
+  this->setStatus(true);
+}
 
-  s->addTestCase(new TC_Postfix01());
-  s->addTestCase(new TC_Postfix02());
-  s->addTestCase(new TC_Postfix03());
-  s->addTestCase(new TC_Postfix04());
-  s->addTestCase(new TC_Postfix05());
+/********************/
 
-  s->addTestCase(new TC_Postfix_MemFail_01());
+struct TC_DFA01 : public TestCase {
+  TC_DFA01() : TestCase("TC_DFA01") {;};
+  void run();
+};
 
-  s->addTestCase(new TC_BuilderBasic01());
-  s->addTestCase(new TC_BuilderBasic02());
-  s->addTestCase(new TC_BuilderBasic03());
+void
+TC_DFA01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  Builder b(&mc);
+  b.addRegEx("abc", NULL);
+  DFA *dfa = b.BuildDFA(&mc, NULL);
+
+  ASSERT_TRUE(dfa->getNumStates() == 5);
+  ASSERT_TRUE(check_match(dfa, "abc", 3, 0));
+  ASSERT_TRUE(check_match(dfa, "abcabc", 3, 0));
+  ASSERT_TRUE(check_match(dfa, "ab", 0, NO_TOKEN));
+  ASSERT_TRUE(check_match(dfa, "abd", 0, NO_TOKEN));
+  ASSERT_TRUE(check_match(dfa, "", 0, NO_TOKEN));
+
+  dfa->~DFA();
+  mc.deallocate(dfa, sizeof(*dfa));
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_DFA02 : public TestCase {
+  TC_DFA02() : TestCase("TC_DFA02") {;};
+  void checkOne(const char *re, const char *str, size_t expLen, size_t expTok);
+  void run();
+};
+
+void
+TC_DFA02::checkOne(const char *re, const char *str,
+		   size_t expLen, size_t expTok)
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  Builder b(&mc);
+  b.addRegEx(re, NULL);
+  DFA *dfa = b.BuildDFA(&mc, NULL);
+  ASSERT_TRUE(check_match(dfa, str, expLen, expTok));
+  dfa->~DFA();
+  mc.deallocate(dfa, sizeof(*dfa));
+}
+
+void
+TC_DFA02::run()
+{
+  this->checkOne("a*b", "aaab", 4, 0);
+  this->checkOne("a*b", "b", 1, 0);
+  this->checkOne("a*", "", 0, 0);
+  this->checkOne("a*", "bbb", 0, 0);
+  this->checkOne("a?b", "ab", 2, 0);
+  this->checkOne("a?b", "b", 1, 0);
+  this->checkOne("a+", "aaa", 3, 0);
+  this->checkOne("a+", "b", 0, NO_TOKEN);
+  this->checkOne("(ab|cd)*e", "abcdabe", 7, 0);
+  this->checkOne("[a-c]x", "bx", 2, 0);
+  this->checkOne("[a-c]x", "dx", 0, NO_TOKEN);
+  this->checkOne("x[^y]z", "xaz", 3, 0);
+  this->checkOne("x[^y]z", "xyz", 0, NO_TOKEN);
+  this->checkOne("a{2,3}", "aaaa", 3, 0);
+  this->checkOne("a{2,3}", "a", 0, NO_TOKEN);
+  this->checkOne("a{2}", "aaa", 2, 0);
+  this->checkOne("a{2,}", "aaaaa", 5, 0);
+  this->checkOne("a{,2}b", "aab", 3, 0);
+  this->checkOne("(ab){2}c", "ababc", 5, 0);
+  this->checkOne("[ab]{2}c", "bac", 3, 0);
+  this->checkOne("a\\*", "a*", 2, 0);
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_DFA03 : public TestCase {
+  TC_DFA03() : TestCase("TC_DFA03") {;};
+  void run();
+};
+
+void
+TC_DFA03::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  Builder b(&mc);
+  b.addRegEx("if", NULL);
+  b.addRegEx("[a-z]+", NULL);
+  b.addRegEx("[0-9]+", NULL);
+  b.addRegEx(" +", NULL);
+  DFA *dfa = b.BuildDFA(&mc, NULL);
+
+  ASSERT_TRUE(check_match(dfa, "if", 2, 0));
+  ASSERT_TRUE(check_match(dfa, "if x", 2, 0));
+  ASSERT_TRUE(check_match(dfa, "iff", 3, 1));
+  ASSERT_TRUE(check_match(dfa, "i", 1, 1));
+  ASSERT_TRUE(check_match(dfa, "123abc", 3, 2));
+  ASSERT_TRUE(check_match(dfa, "   x", 3, 3));
+  ASSERT_TRUE(check_match(dfa, "#", 0, NO_TOKEN));
+
+  dfa->~DFA();
+  mc.deallocate(dfa, sizeof(*dfa));
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_DFA04 : public TestCase {
+  TC_DFA04() : TestCase("TC_DFA04") {;};
+  void run();
+};
+
+void
+TC_DFA04::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  Builder b(&mc);
+  b.addRegEx("abcdef", NULL);
+
+  BuilderLimits lim1(0, 4);
+  try {
+    DFA *dfa = b.BuildDFA(&mc, &lim1);
+    dfa->~DFA();
+    mc.deallocate(dfa, sizeof(*dfa));
+    ASSERT_TRUE(false);
+  }
+  catch (const LimitExceeded &e) {
+    ASSERT_TRUE(true);
+  }
+
+  BuilderLimits lim2(0, 8);
+  DFA *dfa = b.BuildDFA(&mc, &lim2);
+  ASSERT_TRUE(dfa->getNumStates() == 8);
+  dfa->~DFA();
+  mc.deallocate(dfa, sizeof(*dfa));
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_DFA_MemFail01 : public TestCase {
+  TC_DFA_MemFail01() : TestCase("TC_DFA_MemFail01") {;};
+  void run();
+};
+
+void
+TC_DFA_MemFail01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  {
+    Builder b(&mc);
+    b.addRegEx("a(b|c)*d", NULL);
+    b.addRegEx("[0-9]{1,3}", NULL);
+    DFA *dfa = b.BuildDFA(&mc, NULL);
+    dfa->~DFA();
+    mc.deallocate(dfa, sizeof(*dfa));
+  }
+
+  size_t numAllocs = mc.m_numAllocs;
+  for (size_t lim = 0; lim < numAllocs; lim++) {
+    mc.resetCounters();
+    mc.setLimit(lim);
+
+    try {
+      Builder b(&mc);
+      b.addRegEx("a(b|c)*d", NULL);
+      b.addRegEx("[0-9]{1,3}", NULL);
+      DFA *dfa = b.BuildDFA(&mc, NULL);
+      dfa->~DFA();
+      mc.deallocate(dfa, sizeof(*dfa));
+      ASSERT_TRUE(false);
+    }
+    catch (const bad_alloc &e) {
+      ASSERT_TRUE(true);
+    }
+    ASSERT_TRUE(mc.m_numAllocs == mc.m_numDeallocs);
+  }
+
+  mc.disableLimit();
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_DFAMin01 : public TestCase {
+  TC_DFAMin01() : TestCase("TC_DFAMin01") {;};
+  size_t numStates(const char **rules);
+  void run();
+};
+
+size_t
+TC_DFAMin01::numStates(const char **rules)
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  Builder b(&mc);
+  for (size_t i = 0; rules[i]; i++)
+    b.addRegEx(rules[i], NULL);
+  DFA *dfa = b.BuildDFA(&mc, NULL);
+  size_t res = dfa->getNumStates();
+  dfa->~DFA();
+  mc.deallocate(dfa, sizeof(*dfa));
+  return res;
+}
+
+void
+TC_DFAMin01::run()
+{
+  const char *r1[] = { "(a|b)*abb", NULL };
+  ASSERT_TRUE(this->numStates(r1) == 5);
+
+  const char *r2[] = { "a*a*", NULL };
+  ASSERT_TRUE(this->numStates(r2) == 2);
+
+  const char *r3[] = { "xa|ya", NULL };
+  ASSERT_TRUE(this->numStates(r3) == 4);
+
+  /* same shape, different tokens - must not merge */
+  const char *r4[] = { "a", "b", NULL };
+  ASSERT_TRUE(this->numStates(r4) == 4);
+
+  const char *r5[] = { "xa", "ya", NULL };
+  ASSERT_TRUE(this->numStates(r5) == 6);
+
+  this->setStatus(true);
+}
+
+/********************/
+
+/* compare the minimized DFA against plain subset construction */
+struct TC_DFAMin02 : public TestCase {
+  TC_DFAMin02() : TestCase("TC_DFAMin02") {;};
+  void compare(const char **rules);
+  void run();
+};
+
+void
+TC_DFAMin02::compare(const char **rules)
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  Builder b(&mc);
+  for (size_t i = 0; rules[i]; i++)
+    b.addRegEx(rules[i], NULL);
+
+  DFA *minDFA = b.BuildDFA(&mc, NULL);
+
+  NFA *nfa = b.BuildNFA(&mc, NULL);
+  DFA *fullDFA = new (&mc) DFA(&mc);
+  {
+    SubsetBuilder sb(nfa, &mc, NULL);
+    sb.build(fullDFA);
+  }
+  ASSERT_TRUE(minDFA->getNumStates() <= fullDFA->getNumStates());
+
+  /* every string over {a,b,c} up to length 6 */
+  uchar buf[6];
+  for (size_t len = 0; len <= 6; len++) {
+    size_t total = 1;
+    for (size_t i = 0; i < len; i++)
+      total *= 3;
+    for (size_t v = 0; v < total; v++) {
+      size_t x = v;
+      for (size_t i = 0; i < len; i++) {
+	buf[i] = (uchar)('a' + x % 3);
+	x /= 3;
+      }
+      size_t t1, t2;
+      size_t l1 = minDFA->longestMatch(buf, len, &t1);
+      size_t l2 = fullDFA->longestMatch(buf, len, &t2);
+      ASSERT_TRUE(t1 == t2);
+      ASSERT_TRUE(t1 == NO_TOKEN || l1 == l2);
+    }
+  }
+
+  fullDFA->~DFA();
+  mc.deallocate(fullDFA, sizeof(*fullDFA));
+  nfa->~NFA();
+  mc.deallocate(nfa, sizeof(*nfa));
+  minDFA->~DFA();
+  mc.deallocate(minDFA, sizeof(*minDFA));
+}
+
+void
+TC_DFAMin02::run()
+{
+  const char *r1[] = { "(a|b)*abb", "c+", NULL };
+  this->compare(r1);
+
+  const char *r2[] = { "a(b|c)*", "ab*", "[a-c]{2,4}", NULL };
+  this->compare(r2);
+
+  const char *r3[] = { "(ab|ba)*c?", "(a|b|c)*cc", NULL };
+  this->compare(r3);
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_ByteClass01 : public TestCase {
+  TC_ByteClass01() : TestCase("TC_ByteClass01") {;};
+  void run();
+};
+
+void
+TC_ByteClass01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  {
+    Builder b(&mc);
+    b.addRegEx("[a-z]+", NULL);
+    b.addRegEx("[0-9]+", NULL);
+    DFA *dfa = b.BuildDFA(&mc, NULL);
+
+    ASSERT_TRUE(dfa->getNumClasses() == 3);
+    ASSERT_TRUE(dfa->getByteClass('\0') == 0);
+    ASSERT_TRUE(dfa->getByteClass('a') == dfa->getByteClass('z'));
+    ASSERT_TRUE(dfa->getByteClass('0') == dfa->getByteClass('9'));
+    ASSERT_TRUE(dfa->getByteClass('0') != dfa->getByteClass('a'));
+    ASSERT_TRUE(dfa->getByteClass('A') == dfa->getByteClass('\0'));
+    ASSERT_TRUE(dfa->getByteClass(255) == dfa->getByteClass('\0'));
+    ASSERT_TRUE(check_match(dfa, "abc1", 3, 0));
+    ASSERT_TRUE(check_match(dfa, "12a", 2, 1));
+
+    dfa->~DFA();
+    mc.deallocate(dfa, sizeof(*dfa));
+  }
+
+  {
+    /* overlapping sets split each other */
+    Builder b(&mc);
+    b.addRegEx("[a-m]", NULL);
+    b.addRegEx("[h-z]x", NULL);
+    DFA *dfa = b.BuildDFA(&mc, NULL);
+
+    /* a-g, h-m, n-w plus y-z, x, everything else */
+    ASSERT_TRUE(dfa->getNumClasses() == 5);
+    ASSERT_TRUE(dfa->getByteClass('n') == dfa->getByteClass('z'));
+    ASSERT_TRUE(dfa->getByteClass('w') != dfa->getByteClass('x'));
+    ASSERT_TRUE(dfa->getByteClass('g') != dfa->getByteClass('h'));
+    ASSERT_TRUE(check_match(dfa, "hx", 2, 1));
+    ASSERT_TRUE(check_match(dfa, "ax", 1, 0));
+
+    dfa->~DFA();
+    mc.deallocate(dfa, sizeof(*dfa));
+  }
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_DFAPack01 : public TestCase {
+  TC_DFAPack01() : TestCase("TC_DFAPack01") {;};
+  void run();
+};
+
+void
+TC_DFAPack01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  {
+    Builder b(&mc);
+    b.addRegEx("abc", NULL);
+    DFA *dfa = b.BuildDFA(&mc, NULL);
+
+    /* 5 states, 4 classes plus accept and accelerator, one byte each */
+    ASSERT_TRUE(dfa->getTableWidth() == 1);
+    ASSERT_TRUE(dfa->getTableBytes() == 30);
+    ASSERT_TRUE(check_match(dfa, "abcabc", 3, 0));
+    ASSERT_TRUE(check_match(dfa, "abd", 0, NO_TOKEN));
+
+    /* changes fall back to the unpacked table */
+    dfa->setStartState(dfa->getStartState());
+    ASSERT_TRUE(dfa->getTableWidth() == 0);
+    ASSERT_TRUE(check_match(dfa, "abcabc", 3, 0));
+    dfa->pack();
+    ASSERT_TRUE(dfa->getTableWidth() == 1);
+
+    dfa->~DFA();
+    mc.deallocate(dfa, sizeof(*dfa));
+  }
+
+  {
+    Builder b(&mc);
+    b.addRegEx("(a|b)*a(a|b){8}", NULL);
+    b.addRegEx("c", NULL);
+    NFA *nfa = b.BuildNFA(&mc, NULL);
+    DFA *dfa = b.BuildDFA(&mc, NULL);
+
+    ASSERT_TRUE(dfa->getNumStates() > 256);
+    ASSERT_TRUE(dfa->getTableWidth() == 2);
+
+    {
+      NFAContext ctx(nfa, &mc);
+      uchar buf[64];
+      unsigned int seed = 99;
+      for (size_t n = 0; n < 200; n++) {
+	size_t len = n % 64;
+	for (size_t i = 0; i < len; i++) {
+	  seed = seed * 1103515245 + 12345;
+	  buf[i] = (uchar)("aabc"[(seed >> 16) & 3]);
+	}
+	size_t t1, t2;
+	size_t l1 = ctx.longestMatch(buf, len, &t1);
+	size_t l2 = dfa->longestMatch(buf, len, &t2);
+	ASSERT_TRUE(t1 == t2);
+	ASSERT_TRUE(t1 == NO_TOKEN || l1 == l2);
+      }
+    }
+
+    dfa->~DFA();
+    mc.deallocate(dfa, sizeof(*dfa));
+    nfa->~NFA();
+    mc.deallocate(nfa, sizeof(*nfa));
+  }
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_DFAAccel01 : public TestCase {
+  TC_DFAAccel01() : TestCase("TC_DFAAccel01") {;};
+  void run();
+};
+
+void
+TC_DFAAccel01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  Builder b(&mc);
+  b.addRegEx("#[^\n]*", NULL);
+  b.addRegEx("\"[^\"\\\\]*\"", NULL);
+  b.addRegEx(" +", NULL);
+  b.addRegEx("[a-z]+", NULL);
+  NFA *nfa = b.BuildNFA(&mc, NULL);
+  DFA *dfa = b.BuildDFA(&mc, NULL);
+
+  /* comment body, string body, blanks and letters */
+  ASSERT_TRUE(dfa->getNumAccelStates() == 4);
+  ASSERT_TRUE(!dfa->isAccelerated(DFA_DEAD_STATE));
+
+  const size_t bufLen = 1000;
+  uchar *buf = (uchar *)mc.allocate(bufLen);
+
+  buf[0] = '#';
+  memset(buf + 1, 'x', bufLen - 1);
+  buf[900] = '\n';
+  ASSERT_TRUE(check_match(dfa, "#", 1, 0));
+  size_t tok;
+  ASSERT_TRUE(dfa->longestMatch(buf, bufLen, &tok) == 900 && tok == 0);
+  ASSERT_TRUE(dfa->longestMatch(buf + 1, bufLen - 1, &tok) == 899
+	      && tok == 3);
+
+  {
+    /* runs of every length, cut off at every position */
+    NFAContext ctx(nfa, &mc);
+    const char alphabet[] = "##  \"\"\\\nabcxyz!";
+    unsigned int seed = 7;
+    for (size_t n = 0; n < 300; n++) {
+      size_t len = 0;
+      while (len < bufLen - 40) {
+	seed = seed * 1103515245 + 12345;
+	uchar ch = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+	size_t run = (seed >> 8) % 40;
+	for (size_t i = 0; i < run && len < bufLen; i++)
+	  buf[len++] = ch;
+      }
+      size_t start = n % 7;
+      size_t t1, t2;
+      size_t l1 = ctx.longestMatch(buf + start, len - start - n % 5, &t1);
+      size_t l2 = dfa->longestMatch(buf + start, len - start - n % 5, &t2);
+      ASSERT_TRUE(t1 == t2);
+      ASSERT_TRUE(t1 == NO_TOKEN || l1 == l2);
+    }
+  }
+
+  mc.deallocate(buf, bufLen);
+  dfa->~DFA();
+  mc.deallocate(dfa, sizeof(*dfa));
+  nfa->~NFA();
+  mc.deallocate(nfa, sizeof(*nfa));
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_DFAShuffle01 : public TestCase {
+  TC_DFAShuffle01() : TestCase("TC_DFAShuffle01") {;};
+  void compare(const char **rules, const char *alphabet);
+  void run();
+};
+
+void
+TC_DFAShuffle01::compare(const char **rules, const char *alphabet)
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  Builder b(&mc);
+  for (size_t i = 0; rules[i]; i++)
+    b.addRegEx(rules[i], NULL);
+  NFA *nfa = b.BuildNFA(&mc, NULL);
+  DFA *dfa = b.BuildDFA(&mc, NULL);
+
+  ASSERT_TRUE(dfa->usingShuffle()
+	      == (DFA::shuffleSupported()
+		  && dfa->getNumStates() <= DFA_SHUFFLE_STATES));
+
+  {
+    NFAContext ctx(nfa, &mc);
+    size_t na = strlen(alphabet);
+    uchar buf[80];
+    unsigned int seed = 31;
+    for (size_t n = 0; n < 500; n++) {
+      size_t len = 0;
+      while (len < sizeof(buf)) {
+	seed = seed * 1103515245 + 12345;
+	uchar ch = alphabet[(seed >> 16) % na];
+	size_t run = 1 + (seed >> 8) % 20;
+	for (size_t i = 0; i < run && len < sizeof(buf); i++)
+	  buf[len++] = ch;
+      }
+      len = n % sizeof(buf);
+      size_t t1, t2;
+      size_t l1 = ctx.longestMatch(buf, len, &t1);
+      size_t l2 = dfa->longestMatch(buf, len, &t2);
+      ASSERT_TRUE(t1 == t2);
+      ASSERT_TRUE(t1 == NO_TOKEN || l1 == l2);
+    }
+  }
+
+  dfa->~DFA();
+  mc.deallocate(dfa, sizeof(*dfa));
+  nfa->~NFA();
+  mc.deallocate(nfa, sizeof(*nfa));
+}
+
+void
+TC_DFAShuffle01::run()
+{
+  const char *r1[] = { "[0-9]+", "[0-9]+\\.[0-9]*", " +", NULL };
+  this->compare(r1, "0912. a");
+
+  const char *r2[] = { "(ab)*c", "a+", "b?cd", NULL };
+  this->compare(r2, "abcd");
+
+  /* too many states for one vector */
+  const char *r3[] = { "(a|b)*a(a|b){5}", NULL };
+  this->compare(r3, "ab");
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_DFAStride01 : public TestCase {
+  TC_DFAStride01() : TestCase("TC_DFAStride01") {;};
+  void run();
+};
+
+void
+TC_DFAStride01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  {
+    Builder b(&mc);
+    b.addRegEx("abc", NULL);
+    b.addRegEx("[a-c]+", NULL);
+    b.addRegEx("a(bc)*", NULL);
+    b.addRegEx("[0-9]", NULL);
+    NFA *nfa = b.BuildNFA(&mc, NULL);
+    DFA *dfa = b.BuildDFA(&mc, NULL);
+
+    ASSERT_TRUE(dfa->buildStride2());
+    ASSERT_TRUE(dfa->usingStride2());
+
+    /* matches ending in the middle and at the end of a pair */
+    ASSERT_TRUE(check_match(dfa, "a", 1, 1));
+    ASSERT_TRUE(check_match(dfa, "abc", 3, 0));
+    ASSERT_TRUE(check_match(dfa, "abcx", 3, 0));
+    ASSERT_TRUE(check_match(dfa, "7x", 1, 3));
+    ASSERT_TRUE(check_match(dfa, "ab", 2, 1));
+    ASSERT_TRUE(check_match(dfa, "x", 0, NO_TOKEN));
+
+    {
+      NFAContext ctx(nfa, &mc);
+      uchar buf[8];
+      const char alphabet[] = "abc1x";
+      for (size_t len = 0; len <= 6; len++) {
+	size_t n = 1;
+	for (size_t i = 0; i < len; i++)
+	  n *= 5;
+	for (size_t v = 0; v < n; v++) {
+	  size_t x = v;
+	  for (size_t i = 0; i < len; i++) {
+	    buf[i] = (uchar)alphabet[x % 5];
+	    x /= 5;
+	  }
+	  size_t t1, t2;
+	  size_t l1 = ctx.longestMatch(buf, len, &t1);
+	  size_t l2 = dfa->longestMatch(buf, len, &t2);
+	  ASSERT_TRUE(t1 == t2);
+	  ASSERT_TRUE(t1 == NO_TOKEN || l1 == l2);
+	}
+      }
+    }
+
+    /* packing again goes back to stride 1 */
+    dfa->pack();
+    ASSERT_TRUE(!dfa->usingStride2());
+
+    dfa->~DFA();
+    mc.deallocate(dfa, sizeof(*dfa));
+    nfa->~NFA();
+    mc.deallocate(nfa, sizeof(*nfa));
+  }
+
+  {
+    /* 2^11 states times 6 squared classes is too big */
+    Builder b(&mc);
+    b.addRegEx("(a|b)*a(a|b){10}", NULL);
+    b.addRegEx("c", NULL);
+    b.addRegEx("d", NULL);
+    b.addRegEx("e", NULL);
+    DFA *dfa = b.BuildDFA(&mc, NULL);
+    ASSERT_TRUE(dfa->getNumClasses() == 6);
+    ASSERT_TRUE(!dfa->buildStride2());
+    ASSERT_TRUE(!dfa->usingStride2());
+    dfa->~DFA();
+    mc.deallocate(dfa, sizeof(*dfa));
+  }
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_ReverseDFA01 : public TestCase {
+  TC_ReverseDFA01() : TestCase("TC_ReverseDFA01") {;};
+  size_t fullMatch(NFAContext *ctx, const uchar *buf, size_t len);
+  void run();
+};
+
+/* token of the rule matching exactly buf[0..len), using the NFA */
+size_t
+TC_ReverseDFA01::fullMatch(NFAContext *ctx, const uchar *buf, size_t len)
+{
+  MemoryControl mc;
+  StateVec cur(makeAlloc<stateNum>(&mc));
+  StateVec next(makeAlloc<stateNum>(&mc));
+  ctx->startSet(&cur);
+  for (size_t i = 0; i < len && !cur.empty(); i++) {
+    ctx->step(&cur[0], cur.size(), buf[i], &next);
+    cur.swap(next);
+  }
+  if (cur.empty())
+    return NO_TOKEN;
+  return ctx->acceptToken(&cur[0], cur.size());
+}
+
+void
+TC_ReverseDFA01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  {
+    Builder b(&mc);
+    b.addRegEx("ab+c", NULL);
+    b.addRegEx("[0-9]+", NULL);
+    b.addRegEx("x(yz)*", NULL);
+    DFA *rev = b.BuildReverseDFA(&mc, NULL);
+
+    size_t tok;
+    ASSERT_TRUE(rev->longestMatchReverse((const uchar *)"zzabbc", 6, &tok)
+		== 4 && tok == 0);
+    ASSERT_TRUE(rev->longestMatchReverse((const uchar *)"xyzyz", 5, &tok)
+		== 5 && tok == 2);
+    ASSERT_TRUE(rev->longestMatchReverse((const uchar *)"12ab", 2, &tok)
+		== 2 && tok == 1);
+    ASSERT_TRUE(rev->longestMatchReverse((const uchar *)"abc", 2, &tok)
+		== 0 && tok == NO_TOKEN);
+
+    /* tokenize backwards from the end */
+    const char *str = "abc123xyzabbbc";
+    size_t expTok[] = { 0, 2, 1, 0 };
+    size_t expLen[] = { 5, 3, 3, 3 };
+    size_t end = strlen(str);
+    for (size_t n = 0; n < 4; n++) {
+      size_t len = rev->longestMatchReverse((const uchar *)str, end, &tok);
+      ASSERT_TRUE(len == expLen[n] && tok == expTok[n]);
+      end -= len;
+    }
+    ASSERT_TRUE(end == 0);
+
+    rev->~DFA();
+    mc.deallocate(rev, sizeof(*rev));
+  }
+
+  {
+    /* every suffix against the NFA */
+    Builder b(&mc);
+    b.addRegEx("(ab|b)*c", NULL);
+    b.addRegEx("a+b", NULL);
+    b.addRegEx("c?a{2}", NULL);
+    NFA *nfa = b.BuildNFA(&mc, NULL);
+    DFA *rev = b.BuildReverseDFA(&mc, NULL);
+    {
+      NFAContext ctx(nfa, &mc);
+      uchar buf[7];
+      for (size_t v = 0; v < 3 * 3 * 3 * 3 * 3 * 3 * 3; v++) {
+	size_t x = v;
+	for (size_t i = 0; i < sizeof(buf); i++) {
+	  buf[i] = (uchar)('a' + x % 3);
+	  x /= 3;
+	}
+	size_t expLen = 0, expTok = NO_TOKEN;
+	for (size_t l = 0; l <= sizeof(buf); l++) {
+	  size_t t = this->fullMatch(&ctx, buf + sizeof(buf) - l, l);
+	  if (t != NO_TOKEN) {
+	    expLen = l;
+	    expTok = t;
+	  }
+	}
+	size_t tok;
+	size_t len = rev->longestMatchReverse(buf, sizeof(buf), &tok);
+	ASSERT_TRUE(tok == expTok);
+	ASSERT_TRUE(tok == NO_TOKEN || len == expLen);
+      }
+    }
+    rev->~DFA();
+    mc.deallocate(rev, sizeof(*rev));
+    nfa->~NFA();
+    mc.deallocate(nfa, sizeof(*nfa));
+  }
+
+  {
+    Builder b(&mc);
+    b.addRegEx("cat", NULL);
+    b.addRegEx("[0-9]+", NULL);
+    DFA *fwd = b.BuildSearchDFA(&mc, NULL);
+    DFA *rev = b.BuildReverseDFA(&mc, NULL);
+
+    size_t start, end, tok;
+    const char *s1 = "the cat sat 42";
+    ASSERT_TRUE(DFA::search(fwd, rev, (const uchar *)s1, strlen(s1),
+			    &start, &end, &tok));
+    ASSERT_TRUE(start == 4 && end == 7 && tok == 0);
+
+    /* the first match to end wins */
+    const char *s2 = "xx 42 cat";
+    ASSERT_TRUE(DFA::search(fwd, rev, (const uchar *)s2, strlen(s2),
+			    &start, &end, &tok));
+    ASSERT_TRUE(start == 3 && end == 4 && tok == 1);
+
+    const char *s3 = "ca t";
+    ASSERT_TRUE(!DFA::search(fwd, rev, (const uchar *)s3, strlen(s3),
+			     &start, &end, &tok));
+
+    rev->~DFA();
+    mc.deallocate(rev, sizeof(*rev));
+    fwd->~DFA();
+    mc.deallocate(fwd, sizeof(*fwd));
+  }
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_DFAProfile01 : public TestCase {
+  TC_DFAProfile01() : TestCase("TC_DFAProfile01") {;};
+  DFA *build(MemoryControl *mc);
+  void run();
+};
+
+DFA *
+TC_DFAProfile01::build(MemoryControl *mc)
+{
+  Builder b(mc);
+  b.addRegEx("if", NULL);
+  b.addRegEx("while", NULL);
+  b.addRegEx("[a-z]+", NULL);
+  b.addRegEx("[0-9]+(\\.[0-9]+)?", NULL);
+  b.addRegEx(" +", NULL);
+  return b.BuildDFA(mc, NULL);
+}
+
+void
+TC_DFAProfile01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  DFA *ref = this->build(&mc);
+  DFA *dfa = this->build(&mc);
+  ASSERT_TRUE(dfa->fingerprint() == ref->fingerprint());
+
+  /* numbers are the hot path of the sample */
+  const char *sample = "12.5 3 whilex 77.25 if 1 2 3 4.0";
+  std::ostringstream saved;
+  stateNum hottest;
+  {
+    DFAProfile prof(&mc, dfa);
+    ASSERT_TRUE(prof.matches(dfa));
+    size_t len = strlen(sample);
+    for (size_t i = 0; i < len; ) {
+      size_t tok;
+      size_t n = prof.longestMatch(dfa, (const uchar *)sample + i,
+				   len - i, &tok);
+      ASSERT_TRUE(n > 0);
+      i += n;
+    }
+    hottest = DFA_DEAD_STATE;
+    for (stateNum s = 1; s < dfa->getNumStates(); s++)
+      if (hottest == DFA_DEAD_STATE
+	  || prof.getStateCount(s) > prof.getStateCount(hottest))
+	hottest = s;
+    ASSERT_TRUE(prof.getTransitionCount(dfa->getStartState(),
+					dfa->getByteClass('1')) > 0);
+    prof.save(saved);
+
+    ASSERT_TRUE(dfa->relayout(prof));
+    /* the profile was for the old numbering */
+    ASSERT_TRUE(!prof.matches(dfa));
+    ASSERT_TRUE(!dfa->relayout(prof));
+  }
+
+  /* same behaviour, new numbering with the hottest state first */
+  ASSERT_TRUE(dfa->getNumStates() == ref->getNumStates());
+  ASSERT_TRUE(dfa->getTableWidth() != 0);
+  ASSERT_TRUE(dfa->getAcceptToken(1) == ref->getAcceptToken(hottest));
+  const char *strs[] = { "if", "iff", "while", "1.5", "1.", "   x", "",
+			 "whil", "#", NULL };
+  for (size_t i = 0; strs[i]; i++) {
+    size_t t1, t2;
+    size_t l1 = dfa->longestMatch((const uchar *)strs[i],
+				  strlen(strs[i]), &t1);
+    size_t l2 = ref->longestMatch((const uchar *)strs[i],
+				  strlen(strs[i]), &t2);
+    ASSERT_TRUE(t1 == t2 && l1 == l2);
+  }
+
+  /* a fresh build of the same rules takes the saved profile */
+  DFA *again = this->build(&mc);
+  {
+    DFAProfile prof(&mc, again);
+    std::istringstream in(saved.str());
+    ASSERT_TRUE(prof.load(in));
+    ASSERT_TRUE(again->relayout(prof));
+  }
+  ASSERT_TRUE(again->fingerprint() == dfa->fingerprint());
+
+  /* but a different rule set does not */
+  {
+    Builder b(&mc);
+    b.addRegEx("[a-z]+", NULL);
+    DFA *other = b.BuildDFA(&mc, NULL);
+    DFAProfile prof(&mc, other);
+    std::istringstream in(saved.str());
+    ASSERT_TRUE(!prof.load(in));
+
+    /* nor a profile made for another DFA */
+    DFAProfile refProf(&mc, ref);
+    size_t fp = other->fingerprint();
+    ASSERT_TRUE(!other->relayout(refProf));
+    ASSERT_TRUE(other->fingerprint() == fp);
+    other->~DFA();
+    mc.deallocate(other, sizeof(*other));
+  }
+
+  again->~DFA();
+  mc.deallocate(again, sizeof(*again));
+  dfa->~DFA();
+  mc.deallocate(dfa, sizeof(*dfa));
+  ref->~DFA();
+  mc.deallocate(ref, sizeof(*ref));
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_DFAIncr01 : public TestCase {
+  TC_DFAIncr01() : TestCase("TC_DFAIncr01") {;};
+  void same(DFA *d1, DFA *d2);
+  void run();
+};
+
+/* both minimal, so equal up to numbering - compare by matching */
+void
+TC_DFAIncr01::same(DFA *d1, DFA *d2)
+{
+  ASSERT_TRUE(d1->getNumStates() == d2->getNumStates());
+
+  uchar buf[6];
+  const char alphabet[] = "ab1_ ";
+  for (size_t len = 0; len <= 5; len++) {
+    size_t n = 1;
+    for (size_t i = 0; i < len; i++)
+      n *= 5;
+    for (size_t v = 0; v < n; v++) {
+      size_t x = v;
+      for (size_t i = 0; i < len; i++) {
+	buf[i] = (uchar)alphabet[x % 5];
+	x /= 5;
+      }
+      size_t t1, t2;
+      size_t l1 = d1->longestMatch(buf, len, &t1);
+      size_t l2 = d2->longestMatch(buf, len, &t2);
+      ASSERT_TRUE(t1 == t2);
+      ASSERT_TRUE(t1 == NO_TOKEN || l1 == l2);
+    }
+  }
+}
+
+void
+TC_DFAIncr01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  const char *rules[] = { "ab", "[a-b]+", "1+", "a_?1", " ", "(ab)*b1",
+			  NULL };
+  {
+    Builder inc(&mc);
+    for (size_t r = 0; rules[r]; r++) {
+      inc.addRegEx(rules[r], NULL);
+      DFA *d1 = inc.BuildDFAIncremental(&mc, NULL);
+
+      Builder full(&mc);
+      for (size_t i = 0; i <= r; i++)
+	full.addRegEx(rules[i], NULL);
+      DFA *d2 = full.BuildDFA(&mc, NULL);
+
+      this->same(d1, d2);
+
+      d2->~DFA();
+      mc.deallocate(d2, sizeof(*d2));
+      d1->~DFA();
+      mc.deallocate(d1, sizeof(*d1));
+    }
+
+    /* nothing new, same DFA again */
+    DFA *d1 = inc.BuildDFAIncremental(&mc, NULL);
+    DFA *d2 = inc.BuildDFA(&mc, NULL);
+    this->same(d1, d2);
+    d2->~DFA();
+    mc.deallocate(d2, sizeof(*d2));
+    d1->~DFA();
+    mc.deallocate(d1, sizeof(*d1));
+  }
+
+  {
+    /* a failed update drops the kept state, the next call recovers */
+    Builder inc(&mc);
+    inc.addRegEx("ab", NULL);
+    DFA *d1 = inc.BuildDFAIncremental(&mc, NULL);
+    d1->~DFA();
+    mc.deallocate(d1, sizeof(*d1));
+
+    inc.addRegEx("(a", NULL);
+    try {
+      inc.BuildDFAIncremental(&mc, NULL);
+      ASSERT_TRUE(false);
+    }
+    catch (const SyntaxError &e) {
+      ASSERT_TRUE(true);
+    }
+  }
+
+  {
+    /* a change of semantics is not lost on the kept NFA */
+    Builder inc(&mc);
+    inc.addRegEx("ab", NULL);
+    inc.addRegEx("abcd", NULL);
+    DFA *d1 = inc.BuildDFAIncremental(&mc, NULL);
+    d1->~DFA();
+    mc.deallocate(d1, sizeof(*d1));
+
+    inc.setMatchSemantics(SHORTEST_MATCH);
+    inc.addRegEx("x", NULL);
+    d1 = inc.BuildDFAIncremental(&mc, NULL);
+    DFA *d2 = inc.BuildDFA(&mc, NULL);
+    size_t tok;
+    ASSERT_TRUE(d1->longestMatch((const uchar *)"abcd", 4, &tok) == 2);
+    ASSERT_TRUE(tok == 0);
+    this->same(d1, d2);
+    d2->~DFA();
+    mc.deallocate(d2, sizeof(*d2));
+    d1->~DFA();
+    mc.deallocate(d1, sizeof(*d1));
+  }
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_ParallelDFA01 : public TestCase {
+  TC_ParallelDFA01() : TestCase("TC_ParallelDFA01") {;};
+  bool same(DFA *d1, DFA *d2);
+  void run();
+};
+
+/* identical, state numbers included */
+bool
+TC_ParallelDFA01::same(DFA *d1, DFA *d2)
+{
+  if (d1->getNumStates() != d2->getNumStates()
+      || d1->getStartState() != d2->getStartState()
+      || d1->getNumClasses() != d2->getNumClasses())
+    return false;
+  for (stateNum s = 0; s < d1->getNumStates(); s++) {
+    if (d1->getAcceptToken(s) != d2->getAcceptToken(s))
+      return false;
+    for (size_t c = 0; c < d1->getNumClasses(); c++)
+      if (d1->getClassNextState(s, c) != d2->getClassNextState(s, c))
+	return false;
+  }
+  return true;
+}
+
+void
+TC_ParallelDFA01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  const char *rules[] = { "(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)",
+			  "if", "int", "[a-z]+", "[0-9]+(\\.[0-9]+)?",
+			  NULL };
+  Builder b(&mc);
+  for (size_t i = 0; rules[i]; i++)
+    b.addRegEx(rules[i], NULL);
+
+  {
+    NFA *nfa = b.BuildNFA(&mc, NULL);
+    DFA *d1 = new (&mc) DFA(&mc);
+    {
+      SubsetBuilder sb(nfa, &mc, NULL);
+      sb.build(d1);
+    }
+    ASSERT_TRUE(d1->getNumStates() > 128);
+
+    size_t numThreads[] = { 1, 2, 4, 7, 0 };
+    for (size_t i = 0; i < 5; i++) {
+      DFA *d2 = new (&mc) DFA(&mc);
+      {
+	ParallelSubsetBuilder psb(nfa, &mc, NULL, numThreads[i]);
+	ASSERT_TRUE(psb.getNumThreads() > 0);
+	psb.build(d2);
+      }
+      ASSERT_TRUE(this->same(d1, d2));
+      d2->~DFA();
+      mc.deallocate(d2, sizeof(*d2));
+    }
+
+    d1->~DFA();
+    mc.deallocate(d1, sizeof(*d1));
+    nfa->~NFA();
+    mc.deallocate(nfa, sizeof(*nfa));
+  }
+
+  {
+    DFA *d1 = b.BuildDFA(&mc, NULL);
+    DFA *d2 = b.BuildDFA(&mc, NULL, 4);
+    ASSERT_TRUE(this->same(d1, d2));
+    d2->~DFA();
+    mc.deallocate(d2, sizeof(*d2));
+    d1->~DFA();
+    mc.deallocate(d1, sizeof(*d1));
+  }
+
+  {
+    BuilderLimits lim(0, 20);
+    try {
+      b.BuildDFA(&mc, &lim, 4);
+      ASSERT_TRUE(false);
+    }
+    catch (const LimitExceeded &e) {
+      ASSERT_TRUE(true);
+    }
+  }
+
+  /* the split of work varies, so some limits may not be reached */
+  MemoryControlWithFailure mc2;
+  mc2.resetCounters();
+  mc2.disableLimit();
+  {
+    Builder b2(&mc2);
+    for (size_t i = 0; rules[i]; i++)
+      b2.addRegEx(rules[i], NULL);
+    DFA *d = b2.BuildDFA(&mc2, NULL, 3);
+    d->~DFA();
+    mc2.deallocate(d, sizeof(*d));
+  }
+
+  size_t numAllocs = mc2.m_numAllocs;
+  for (size_t lim = 0; lim < numAllocs; lim += 7) {
+    mc2.resetCounters();
+    mc2.setLimit(lim);
+    try {
+      Builder b2(&mc2);
+      for (size_t i = 0; rules[i]; i++)
+	b2.addRegEx(rules[i], NULL);
+      DFA *d = b2.BuildDFA(&mc2, NULL, 3);
+      d->~DFA();
+      mc2.deallocate(d, sizeof(*d));
+    }
+    catch (const bad_alloc &e) {
+      ASSERT_TRUE(true);
+    }
+    ASSERT_TRUE(mc2.m_numAllocs == mc2.m_numDeallocs);
+  }
+  mc2.disableLimit();
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_ParallelMin01 : public TestCase {
+  TC_ParallelMin01() : TestCase("TC_ParallelMin01") {;};
+  void run();
+};
+
+void
+TC_ParallelMin01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  const char *ruleSets[][5] = {
+    { "(a|b)*abb", "b+", "a{2,3}c", NULL },
+    { "(a|b)*a(a|b)(a|b)(a|b)(a|b)", "if", "int", "[a-z]+", NULL },
+    { "abcdefghij", "abcdefghix", "[a-j]*k", NULL },
+    { "x", NULL }
+  };
+
+  for (size_t r = 0; r < 4; r++) {
+    Builder b(&mc);
+    for (size_t i = 0; ruleSets[r][i]; i++)
+      b.addRegEx(ruleSets[r][i], NULL);
+
+    NFA *nfa = b.BuildNFA(&mc, NULL);
+    DFA *full = new (&mc) DFA(&mc);
+    {
+      SubsetBuilder sb(nfa, &mc, NULL);
+      sb.build(full);
+    }
+    nfa->~NFA();
+    mc.deallocate(nfa, sizeof(*nfa));
+
+    DFA *d1 = new (&mc) DFA(&mc);
+    d1->copyFrom(full);
+    {
+      DFAMinimizer dm(&mc);
+      dm.minimize(d1);
+    }
+
+    size_t numThreads[] = { 1, 3, 8 };
+    for (size_t i = 0; i < 3; i++) {
+      DFA *d2 = new (&mc) DFA(&mc);
+      d2->copyFrom(full);
+      {
+	ParallelDFAMinimizer pdm(&mc, numThreads[i]);
+	ASSERT_TRUE(pdm.getNumThreads() == numThreads[i]);
+	pdm.minimize(d2);
+      }
+
+      ASSERT_TRUE(d1->getNumStates() == d2->getNumStates());
+      ASSERT_TRUE(d1->getStartState() == d2->getStartState());
+      for (stateNum s = 0; s < d1->getNumStates(); s++) {
+	ASSERT_TRUE(d1->getAcceptToken(s) == d2->getAcceptToken(s));
+	for (size_t c = 0; c < d1->getNumClasses(); c++)
+	  ASSERT_TRUE(d1->getClassNextState(s, c)
+		      == d2->getClassNextState(s, c));
+      }
+
+      d2->~DFA();
+      mc.deallocate(d2, sizeof(*d2));
+    }
+
+    d1->~DFA();
+    mc.deallocate(d1, sizeof(*d1));
+    full->~DFA();
+    mc.deallocate(full, sizeof(*full));
+  }
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_DerivDFA01 : public TestCase {
+  TC_DerivDFA01() : TestCase("TC_DerivDFA01") {;};
+  void run();
+};
+
+void
+TC_DerivDFA01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  const char *ruleSets[][6] = {
+    { "(a|b)*abb", "b+", "a{2,3}c", NULL },
+    { "if", "int", "[a-z]+", "[0-9]+", "x?y*", NULL },
+    { "(ab|a)(bc|c)*", "a{0}b", "(a*b*)*c", "b{2,}", NULL },
+    { "", "a", NULL },
+    { NULL }
+  };
+
+  for (size_t r = 0; r < 5; r++) {
+    Builder b(&mc);
+    for (size_t i = 0; ruleSets[r][i]; i++)
+      b.addRegEx(ruleSets[r][i], NULL);
+
+    DFA *d1 = b.BuildDFA(&mc, NULL);
+    DFA *d2 = b.BuildDerivativeDFA(&mc, NULL);
+    ASSERT_TRUE(d1->getNumStates() == d2->getNumStates());
+
+    /* every string over {a,b,c,i,n,t,0} up to length 4 */
+    const char alphabet[] = "abcint0";
+    uchar buf[4];
+    for (size_t len = 0; len <= 4; len++) {
+      size_t total = 1;
+      for (size_t i = 0; i < len; i++)
+	total *= 7;
+      for (size_t v = 0; v < total; v++) {
+	size_t x = v;
+	for (size_t i = 0; i < len; i++) {
+	  buf[i] = (uchar)alphabet[x % 7];
+	  x /= 7;
+	}
+	size_t t1, t2;
+	size_t l1 = d1->longestMatch(buf, len, &t1);
+	size_t l2 = d2->longestMatch(buf, len, &t2);
+	ASSERT_TRUE(t1 == t2);
+	ASSERT_TRUE(t1 == NO_TOKEN || l1 == l2);
+      }
+    }
+
+    d2->~DFA();
+    mc.deallocate(d2, sizeof(*d2));
+    d1->~DFA();
+    mc.deallocate(d1, sizeof(*d1));
+  }
+
+  {
+    Builder b(&mc);
+    b.addRegEx("a{3,2}", NULL);
+    try {
+      b.BuildDerivativeDFA(&mc, NULL);
+      ASSERT_TRUE(false);
+    }
+    catch (const SyntaxError &e) {
+      ASSERT_TRUE(true);
+    }
+  }
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_DerivDFA02 : public TestCase {
+  TC_DerivDFA02() : TestCase("TC_DerivDFA02") {;};
+  void run();
+};
+
+void
+TC_DerivDFA02::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  {
+    DerivativeBuilder db(&mc, NULL);
+
+    /* normal form - the same expression comes back */
+    size_t a = db.parse("a", 1);
+    size_t bc = db.parse("b|c", 3);
+    ASSERT_TRUE(db.mkOr(bc, a) == db.mkOr(a, bc));
+    ASSERT_TRUE(db.mkOr(a, db.mkOr(a, bc)) == db.mkOr(bc, a));
+    ASSERT_TRUE(db.mkNot(db.mkNot(a)) == a);
+    ASSERT_TRUE(db.mkStar(db.mkStar(a)) == db.mkStar(a));
+    ASSERT_TRUE(db.mkAnd(a, DerivativeBuilder::EXPR_EMPTY)
+		== DerivativeBuilder::EXPR_EMPTY);
+    ASSERT_TRUE(db.mkCat(a, DerivativeBuilder::EXPR_EPS) == a);
+    ASSERT_TRUE(db.parse("a|a", 3) == a);
+    ASSERT_TRUE(db.isNullable(db.mkNot(a)));
+  }
+
+  {
+    /* identifiers that are not keywords, and a comment that */
+    /* does not contain its terminator                         */
+    DerivativeBuilder db(&mc, NULL);
+    size_t ident = db.parse("[a-z]+", 6);
+    size_t kw = db.parse("if|int", 6);
+    db.addRule(db.mkAnd(ident, db.mkNot(kw)));
+    db.addRule(kw);
+
+    CharSet all;
+    all.clear();
+    for (unsigned int ch = 0; ch < 256; ch++)
+      all.add((uchar)ch);
+    size_t any = db.mkStar(db.mkSet(all));
+    size_t end = db.parse("\\*/", 3);
+    size_t body = db.mkNot(db.mkCat(any, db.mkCat(end, any)));
+    db.addRule(db.mkCat(db.parse("/\\*", 3), db.mkCat(body, end)));
+
+    DFA *dfa = new (&mc) DFA(&mc);
+    db.build(dfa);
+
+    size_t tok;
+    ASSERT_TRUE(dfa->longestMatch((const uchar *)"if", 2, &tok) == 2);
+    ASSERT_TRUE(tok == 1);
+    ASSERT_TRUE(dfa->longestMatch((const uchar *)"ifx", 3, &tok) == 3);
+    ASSERT_TRUE(tok == 0);
+    ASSERT_TRUE(dfa->longestMatch((const uchar *)"in", 2, &tok) == 2);
+    ASSERT_TRUE(tok == 0);
+    ASSERT_TRUE(dfa->longestMatch((const uchar *)"int ", 4, &tok) == 3);
+    ASSERT_TRUE(tok == 1);
+
+    const char *c = "/* a * b */ x */";
+    ASSERT_TRUE(dfa->longestMatch((const uchar *)c, strlen(c), &tok) == 11);
+    ASSERT_TRUE(tok == 2);
+
+    dfa->~DFA();
+    mc.deallocate(dfa, sizeof(*dfa));
+  }
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_BuildLimits01 : public TestCase {
+  TC_BuildLimits01() : TestCase("TC_BuildLimits01") {;};
+  void run();
+};
+
+void
+TC_BuildLimits01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  Builder b(&mc);
+  b.addRegEx("(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)", NULL);
+  b.addRegEx("b+c", NULL);
+
+  DFA *full = b.BuildDFA(&mc, NULL);
+
+  {
+    /* over the state limit - the scanner falls back to a lazy DFA */
+    BuilderLimits lim(0, 20);
+    try {
+      b.BuildDFA(&mc, &lim);
+      ASSERT_TRUE(false);
+    }
+    catch (const LimitExceeded &e) {
+      ASSERT_TRUE(strcmp(e.what(), "DFA state limit exceeded") == 0);
+    }
+
+    Scanner *sc = b.BuildScanner(&mc, &lim, 16);
+    ASSERT_TRUE(sc->isDegraded());
+    ASSERT_TRUE(sc->getLazyDFA() != NULL);
+
+    const char *tests[] = { "abababababa", "aaaaaaaaa", "bbbbc", "ba", "c",
+			    "babbbbbbbbbbaabab", NULL };
+    for (size_t i = 0; tests[i]; i++) {
+      size_t t1, t2;
+      size_t len = strlen(tests[i]);
+      size_t l1 = full->longestMatch((const uchar *)tests[i], len, &t1);
+      size_t l2 = sc->longestMatch((const uchar *)tests[i], len, &t2);
+      ASSERT_TRUE(t1 == t2);
+      ASSERT_TRUE(t1 == NO_TOKEN || l1 == l2);
+    }
+
+    sc->~Scanner();
+    mc.deallocate(sc, sizeof(*sc));
+  }
+
+  {
+    /* within the limits the scanner holds the DFA */
+    BuilderLimits lim(60, 10000, 1 << 20);
+    Scanner *sc = b.BuildScanner(&mc, &lim, 16);
+    ASSERT_TRUE(!sc->isDegraded());
+    ASSERT_TRUE(sc->getDFA()->getNumStates() == full->getNumStates());
+    sc->~Scanner();
+    mc.deallocate(sc, sizeof(*sc));
+  }
+
+  {
+    /* over the byte limit in subset construction and in the */
+    /* derivative builder                                     */
+    BuilderLimits lim(0, 0, 4000);
+    try {
+      b.BuildDFA(&mc, &lim);
+      ASSERT_TRUE(false);
+    }
+    catch (const LimitExceeded &e) {
+      ASSERT_TRUE(strcmp(e.what(), "build memory limit exceeded") == 0);
+    }
+    try {
+      b.BuildDerivativeDFA(&mc, &lim);
+      ASSERT_TRUE(false);
+    }
+    catch (const LimitExceeded &e) {
+      ASSERT_TRUE(strcmp(e.what(), "build memory limit exceeded") == 0);
+    }
+
+    Scanner *sc = b.BuildScanner(&mc, &lim, 16);
+    ASSERT_TRUE(sc->isDegraded());
+    sc->~Scanner();
+    mc.deallocate(sc, sizeof(*sc));
+  }
+
+  {
+    /* a cancelled build does not fall back */
+    BuilderLimits lim;
+    lim.cancel();
+    ASSERT_TRUE(lim.isCancelled());
+    try {
+      b.BuildScanner(&mc, &lim, 16);
+      ASSERT_TRUE(false);
+    }
+    catch (const LimitExceeded &e) {
+      ASSERT_TRUE(strcmp(e.what(), "build cancelled") == 0);
+    }
+    try {
+      b.BuildDerivativeDFA(&mc, &lim);
+      ASSERT_TRUE(false);
+    }
+    catch (const LimitExceeded &e) {
+      ASSERT_TRUE(strcmp(e.what(), "build cancelled") == 0);
+    }
+  }
+
+  full->~DFA();
+  mc.deallocate(full, sizeof(*full));
+
+  {
+    /* one rule that unrolls to a million NFA states is stopped */
+    /* while the NFA is built, so there is nothing to fall back on */
+    Builder b2(&mc);
+    b2.addRegEx("a{1000}{1000}", NULL);
+    BuilderLimits lim(0, 0, 1 << 20);
+    try {
+      b2.BuildScanner(&mc, &lim, 16);
+      ASSERT_TRUE(false);
+    }
+    catch (const LimitExceeded &e) {
+      ASSERT_TRUE(strcmp(e.what(), "build memory limit exceeded") == 0);
+    }
+  }
+
+  {
+    /* the unrolled size is checked before any copy is made */
+    Builder b2(&mc);
+    b2.addRegEx("a{1000}{1000}{1000}", NULL);
+    BuilderLimits lim(0, 1000, 1 << 20);
+    try {
+      b2.BuildHybridScanner(&mc, &lim, 100, 1 << 16, 16);
+      ASSERT_TRUE(false);
+    }
+    catch (const LimitExceeded &e) {
+      ASSERT_TRUE(strcmp(e.what(), "build memory limit exceeded") == 0);
+    }
+  }
+
+  {
+    /* a huge count is refused by the parser, not unrolled */
+    Builder b3(&mc);
+    b3.addRegEx("a{100000000000}", NULL);
+    try {
+      b3.BuildDFA(&mc, NULL);
+      ASSERT_TRUE(false);
+    }
+    catch (const SyntaxError &e) {
+      ASSERT_TRUE(true);
+    }
+  }
+
+  this->setStatus(true);
+}
+
+
+/********************/
+
+struct TC_HybridScanner01 : public TestCase {
+  TC_HybridScanner01() : TestCase("TC_HybridScanner01") {;};
+  void compare(MemoryControl *mc, NFA *nfa, Scanner *sc);
+  void run();
+};
+
+/* every string over a, b and c up to 8 bytes, against the NFA */
+void
+TC_HybridScanner01::compare(MemoryControl *mc, NFA *nfa, Scanner *sc)
+{
+  NFAContext ctx(nfa, mc);
+  uchar buf[8];
+  for (size_t len = 0; len <= 8; len++) {
+    size_t n = 1;
+    for (size_t i = 0; i < len; i++)
+      n *= 3;
+    for (size_t v = 0; v < n; v++) {
+      size_t x = v;
+      for (size_t i = 0; i < len; i++) {
+	buf[i] = (uchar)('a' + x % 3);
+	x /= 3;
+      }
+      size_t t1, t2;
+      size_t l1 = ctx.longestMatch(buf, len, &t1);
+      size_t l2 = sc->longestMatch(buf, len, &t2);
+      ASSERT_TRUE(t1 == t2);
+      ASSERT_TRUE(t1 == NO_TOKEN || l1 == l2);
+    }
+  }
+}
+
+void
+TC_HybridScanner01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  {
+    /* the counted repetition blows up alone, the rest stay a DFA */
+    Builder b(&mc);
+    b.addRegEx("ab", NULL);
+    b.addRegEx("(a|b)*a(a|b){9}", NULL);
+    b.addRegEx("a+", NULL);
+    b.addRegEx("(a|b|c)*c", NULL);
+    b.addRegEx("ba(a|b)", NULL);
+    NFA *nfa = b.BuildNFA(&mc, NULL);
+
+    Scanner *sc = b.BuildHybridScanner(&mc, NULL, 500, 1 << 16, 64);
+    ASSERT_TRUE(sc->isHybrid());
+    ASSERT_TRUE(!sc->isDegraded());
+    ASSERT_TRUE(sc->getDFA()->getNumStates() < 50);
+    this->compare(&mc, nfa, sc);
+
+    const char *s = "aababababa";
+    size_t tok;
+    ASSERT_TRUE(sc->longestMatch((const uchar *)s, strlen(s), &tok) == 10);
+    ASSERT_TRUE(tok == 1);
+    ASSERT_TRUE(sc->longestMatch((const uchar *)"bab", 3, &tok) == 3);
+    ASSERT_TRUE(tok == 4);
+    sc->~Scanner();
+    mc.deallocate(sc, sizeof(*sc));
+
+    /* with room for every rule there is no lazy part */
+    sc = b.BuildHybridScanner(&mc, NULL, 1 << 16, 1 << 16, 64);
+    ASSERT_TRUE(!sc->isHybrid() && !sc->isDegraded());
+    sc->~Scanner();
+    mc.deallocate(sc, sizeof(*sc));
+
+    nfa->~NFA();
+    mc.deallocate(nfa, sizeof(*nfa));
+  }
+
+  {
+    /* each rule fits alone, the limits only take the first two */
+    Builder b(&mc);
+    b.addRegEx("abc", NULL);
+    b.addRegEx("c+", NULL);
+    b.addRegEx("(a|b)*a(a|b){6}", NULL);
+    NFA *nfa = b.BuildNFA(&mc, NULL);
+
+    BuilderLimits lim(0, 40);
+    Scanner *sc = b.BuildHybridScanner(&mc, &lim, 1000, 1 << 16, 64);
+    ASSERT_TRUE(sc->isHybrid());
+    ASSERT_TRUE(sc->getDFA()->getNumStates() < 10);
+    this->compare(&mc, nfa, sc);
+    sc->~Scanner();
+    mc.deallocate(sc, sizeof(*sc));
+
+    /* cancelling still throws */
+    lim.cancel();
+    try {
+      b.BuildHybridScanner(&mc, &lim, 1000, 1 << 16, 64);
+      ASSERT_TRUE(false);
+    }
+    catch (const LimitExceeded &e) {
+      ASSERT_TRUE(strcmp(e.what(), "build cancelled") == 0);
+    }
+
+    nfa->~NFA();
+    mc.deallocate(nfa, sizeof(*nfa));
+  }
+
+  {
+    /* each rule fits alone, together they blow up even without limits */
+    Builder b(&mc);
+    b.addRegEx("(a|b|c)*a(a|b|c){3}", NULL);
+    b.addRegEx("(a|b|c)*b(a|b|c){3}", NULL);
+    b.addRegEx("(a|b|c)*c(a|b|c){3}", NULL);
+    b.addRegEx("(a|b|c)*a(a|b|c){2}", NULL);
+    b.addRegEx("(a|b|c)*b(a|b|c){2}", NULL);
+    b.addRegEx("(a|b|c)*c(a|b|c){2}", NULL);
+    NFA *nfa = b.BuildNFA(&mc, NULL);
+
+    Scanner *sc = b.BuildHybridScanner(&mc, NULL, 40, 30, 64);
+    ASSERT_TRUE(sc->isHybrid());
+    ASSERT_TRUE(sc->getDFA()->getNumStates() <= 30);
+    this->compare(&mc, nfa, sc);
+    sc->~Scanner();
+    mc.deallocate(sc, sizeof(*sc));
+
+    nfa->~NFA();
+    mc.deallocate(nfa, sizeof(*nfa));
+  }
+
+  this->setStatus(true);
+}
+/********************/
+
+struct TC_DFAChain01 : public TestCase {
+  TC_DFAChain01() : TestCase("TC_DFAChain01") {;};
+  void run();
+};
+
+void
+TC_DFAChain01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  Builder b(&mc);
+  b.addRegEx("typedef", NULL);
+  b.addRegEx("longkeyword", NULL);
+  b.addRegEx("longkey", NULL);
+  b.addRegEx("x(abcdefghijklmnopqrstuvwxyz0123456789)+y", NULL);
+  b.addRegEx("[0-9]+", NULL);
+  DFA *dfa = b.BuildDFA(&mc, NULL);
+  ASSERT_TRUE(dfa->getNumChains() > 0);
+
+  /* the copy is not packed, so it steps through every state */
+  DFA *plain = new (&mc) DFA(&mc);
+  plain->copyFrom(dfa);
+  ASSERT_TRUE(plain->getNumChains() == 0);
+
+  const char *words[] = { "typedef", "longkeyword", "longkey",
+			  "xabcdefghijklmnopqrstuvwxyz0123456789y",
+			  "xabcdefghijklmnopqrstuvwxyz0123456789"
+			  "abcdefghijklmnopqrstuvwxyz0123456789y",
+			  "123", NULL };
+  char buf[128];
+  for (size_t w = 0; words[w]; w++) {
+    size_t wlen = strlen(words[w]);
+    /* every prefix, and every single byte changed */
+    for (size_t cut = 0; cut <= wlen; cut++) {
+      for (size_t pos = 0; pos <= cut; pos++) {
+	memcpy(buf, words[w], cut);
+	buf[cut] = '1';
+	if (pos < cut)
+	  buf[pos] = (buf[pos] == 'e') ? 'q' : 'e';
+	for (size_t len = cut; len <= cut + 1; len++) {
+	  size_t t1, t2;
+	  size_t l1 = dfa->longestMatch((const uchar *)buf, len, &t1);
+	  size_t l2 = plain->longestMatch((const uchar *)buf, len, &t2);
+	  ASSERT_TRUE(t1 == t2);
+	  ASSERT_TRUE(l1 == l2);
+	}
+      }
+    }
+  }
+
+  size_t tok;
+  const char *s = "longkeywor";
+  ASSERT_TRUE(dfa->longestMatch((const uchar *)s, strlen(s), &tok) == 7);
+  ASSERT_TRUE(tok == 2);
+
+  plain->~DFA();
+  mc.deallocate(plain, sizeof(*plain));
+  dfa->~DFA();
+  mc.deallocate(dfa, sizeof(*dfa));
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_DFASpecial01 : public TestCase {
+  TC_DFASpecial01() : TestCase("TC_DFASpecial01") {;};
+  void compare(const char **rules, const char *alphabet);
+  void run();
+};
+
+/* the packed scan, fast path included, against the unpacked one */
+void
+TC_DFASpecial01::compare(const char **rules, const char *alphabet)
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  Builder b(&mc);
+  for (size_t i = 0; rules[i]; i++)
+    b.addRegEx(rules[i], NULL);
+  DFA *dfa = b.BuildDFA(&mc, NULL);
+  ASSERT_TRUE(dfa->getTableWidth() != 0);
+  ASSERT_TRUE(!dfa->usingShuffle());
+
+  size_t special = 1;
+  for (stateNum s = 1; s < dfa->getNumStates(); s++)
+    if (dfa->getAcceptToken(s) != NO_TOKEN || dfa->isAccelerated(s))
+      special++;
+  ASSERT_TRUE(dfa->getNumSpecialStates() >= special);
+  ASSERT_TRUE(dfa->getNumSpecialStates()
+	      <= special + dfa->getNumChains());
+  ASSERT_TRUE(dfa->getNumSpecialStates() < dfa->getNumStates());
+
+  DFA *plain = new (&mc) DFA(&mc);
+  plain->copyFrom(dfa);
+
+  size_t na = strlen(alphabet);
+  size_t seed = 12345;
+  uchar buf[64];
+  for (size_t rep = 0; rep < 2000; rep++) {
+    size_t len = rep % sizeof(buf);
+    for (size_t i = 0; i < len; i++) {
+      seed = seed * 1103515245 + 12345;
+      buf[i] = alphabet[(seed >> 16) % na];
+    }
+    size_t t1, t2;
+    size_t l1 = dfa->longestMatch(buf, len, &t1);
+    size_t l2 = plain->longestMatch(buf, len, &t2);
+    ASSERT_TRUE(t1 == t2);
+    ASSERT_TRUE(l1 == l2);
+  }
+
+  plain->~DFA();
+  mc.deallocate(plain, sizeof(*plain));
+  dfa->~DFA();
+  mc.deallocate(dfa, sizeof(*dfa));
+}
+
+void
+TC_DFASpecial01::run()
+{
+  const char *r1[] = { "(a|b)*a(a|b){6}", NULL };
+  this->compare(r1, "ab");
+
+  const char *r2[] = { "abababab(c|d)", "(ab)+cc", "b+a+d", NULL };
+  this->compare(r2, "abcd");
+
+  const char *r3[] = { "if", "else", "while", "return", "for", "do",
+		       "break", "case", "goto", "int", "long", "void",
+		       "[a-z_][a-z0-9_]*", "[0-9]+", " +",
+		       "\"[^\"]*\"", NULL };
+  this->compare(r3, "abcdefgilnortuvw_019 \"");
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_DFAComb01 : public TestCase {
+  TC_DFAComb01() : TestCase("TC_DFAComb01") {;};
+  void compare(const char **rules);
+  void run();
+};
+
+/* the compressed rows must give exactly the DFA's transitions */
+void
+TC_DFAComb01::compare(const char **rules)
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  Builder b(&mc);
+  for (size_t i = 0; rules[i]; i++)
+    b.addRegEx(rules[i], NULL);
+  DFA *dfa = b.BuildDFA(&mc, NULL);
+  CompressedDFA *cdfa = b.BuildCompressedDFA(&mc, NULL);
+
+  ASSERT_TRUE(cdfa->getNumStates() == dfa->getNumStates());
+  ASSERT_TRUE(cdfa->getStartState() == dfa->getStartState());
+  ASSERT_TRUE(cdfa->getNumRows(CompressedDFA::ROW_RANGE)
+	      + cdfa->getNumRows(CompressedDFA::ROW_SPARSE)
+	      + cdfa->getNumRows(CompressedDFA::ROW_COMB)
+	      == dfa->getNumStates());
+  for (stateNum s = 0; s < dfa->getNumStates(); s++) {
+    ASSERT_TRUE(cdfa->getAcceptToken(s) == dfa->getAcceptToken(s));
+    for (unsigned int ch = 0; ch < 256; ch++)
+      ASSERT_TRUE(cdfa->getNextState(s, (uchar)ch)
+		  == dfa->getNextState(s, (uchar)ch));
+  }
+  if (cdfa->getNumRows(CompressedDFA::ROW_RANGE))
+    ASSERT_TRUE(cdfa->getAvgProbes(CompressedDFA::ROW_RANGE) == 1.0);
+
+  const char *strs[] = { "while x", "whilex", "if9", "123abc", "x_1 ",
+			 "returns", "", "Q", NULL };
+  for (size_t i = 0; strs[i]; i++) {
+    size_t t1, t2;
+    size_t l1 = cdfa->longestMatch((const uchar *)strs[i],
+				   strlen(strs[i]), &t1);
+    size_t l2 = dfa->longestMatch((const uchar *)strs[i],
+				  strlen(strs[i]), &t2);
+    ASSERT_TRUE(t1 == t2);
+    ASSERT_TRUE(t1 == NO_TOKEN || l1 == l2);
+  }
+
+  cdfa->~CompressedDFA();
+  mc.deallocate(cdfa, sizeof(*cdfa));
+  dfa->~DFA();
+  mc.deallocate(dfa, sizeof(*dfa));
+}
+
+void
+TC_DFAComb01::run()
+{
+  const char *r1[] = { "abc", NULL };
+  this->compare(r1);
+
+  const char *r2[] = { "if", "else", "while", "return", "for", "do",
+		       "break", "case", "goto", "int", "long", "void",
+		       "[a-z_][a-z0-9_]*", "[0-9]+", " +", NULL };
+  this->compare(r2);
+
+  const char *r3[] = { "(a|b)*a(a|b){6}", "[c-z]+", NULL };
+  this->compare(r3);
+
+  /* the keyword start state fans out, it has to use the comb */
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+  Builder b(&mc);
+  for (size_t i = 0; r2[i]; i++)
+    b.addRegEx(r2[i], NULL);
+  CompressedDFA *cdfa = b.BuildCompressedDFA(&mc, NULL);
+  ASSERT_TRUE(cdfa->getNumRows(CompressedDFA::ROW_COMB) > 0);
+  ASSERT_TRUE(cdfa->getNumRows(CompressedDFA::ROW_RANGE) > 0);
+  ASSERT_TRUE(cdfa->getMemoryBytes()
+	      < cdfa->getNumStates() * 256 * sizeof(stateNum));
+  cdfa->~CompressedDFA();
+  mc.deallocate(cdfa, sizeof(*cdfa));
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_TieredDFA01 : public TestCase {
+  TC_TieredDFA01() : TestCase("TC_TieredDFA01") {;};
+  void compare(MemoryControl *mc, Builder &b, DFA *dfa,
+	       const DFAProfile *prof, size_t hot, size_t cacheRows);
+  void run();
+};
+
+/* the tiered DFA must scan exactly like the DFA */
+void
+TC_TieredDFA01::compare(MemoryControl *mc, Builder &b, DFA *dfa,
+			const DFAProfile *prof, size_t hot, size_t cacheRows)
+{
+  TieredDFA *tdfa = b.BuildTieredDFA(mc, NULL, prof, hot, cacheRows);
+  ASSERT_TRUE(tdfa->getNumStates() == dfa->getNumStates());
+  ASSERT_TRUE(tdfa->getNumHotStates() >= 1);
+  ASSERT_TRUE(tdfa->getNumHotStates() <= tdfa->getNumStates());
+
+  const char *strs[] = { "while x", "whilex", "if9", "123abc", "x_1 ",
+			 "returns", "", "Q", "break;", "   ", "goto1",
+			 "voids", "int", "longest_name_here", NULL };
+  for (size_t rep = 0; rep < 2; rep++)
+    for (size_t i = 0; strs[i]; i++) {
+      size_t t1, t2;
+      size_t l1 = tdfa->longestMatch((const uchar *)strs[i],
+				     strlen(strs[i]), &t1);
+      size_t l2 = dfa->longestMatch((const uchar *)strs[i],
+				    strlen(strs[i]), &t2);
+      ASSERT_TRUE(t1 == t2 && l1 == l2);
+    }
+  if (tdfa->getNumHotStates() == tdfa->getNumStates())
+    ASSERT_TRUE(tdfa->getCacheMisses() == 0);
+
+  tdfa->~TieredDFA();
+  mc->deallocate(tdfa, sizeof(*tdfa));
+}
+
+void
+TC_TieredDFA01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  {
+    Builder b(&mc);
+    const char *rules[] = { "if", "else", "while", "return", "for", "do",
+			    "break", "case", "goto", "int", "long", "void",
+			    "[a-z_][a-z0-9_]*", "[0-9]+", " +", NULL };
+    for (size_t i = 0; rules[i]; i++)
+      b.addRegEx(rules[i], NULL);
+    DFA *dfa = b.BuildDFA(&mc, NULL);
+    size_t n = dfa->getNumStates();
+
+    size_t hots[] = { 0, 1, 4, n / 2, n, n + 10 };
+    for (size_t i = 0; i < sizeof(hots) / sizeof(hots[0]); i++) {
+      this->compare(&mc, b, dfa, NULL, hots[i], 1);
+      this->compare(&mc, b, dfa, NULL, hots[i], 4);
+      this->compare(&mc, b, dfa, NULL, hots[i], 64);
+    }
+
+    /* every state the sample visits is hot, so scanning it never decodes */
+    const char *sample = "x_1 123 ab";
+    DFAProfile prof(&mc, dfa);
+    size_t len = strlen(sample);
+    for (size_t i = 0; i < len; ) {
+      size_t tok;
+      i += prof.longestMatch(dfa, (const uchar *)sample + i, len - i, &tok);
+    }
+    size_t visited = 0;
+    for (stateNum s = 1; s < n; s++)
+      if (prof.getStateCount(s))
+	visited++;
+    ASSERT_TRUE(visited + 1 < n);
+    this->compare(&mc, b, dfa, &prof, visited + 1, 2);
+
+    TieredDFA *tdfa = b.BuildTieredDFA(&mc, NULL, &prof, visited + 1, 2);
+    for (size_t i = 0; i < len; ) {
+      size_t tok;
+      i += tdfa->longestMatch((const uchar *)sample + i, len - i, &tok);
+    }
+    ASSERT_TRUE(tdfa->getCacheMisses() == 0);
+    ASSERT_TRUE(tdfa->getMemoryBytes()
+		< n * dfa->getNumClasses() * sizeof(stateNum));
+
+    /* a keyword the sample never had goes through the cache */
+    size_t tok;
+    ASSERT_TRUE(tdfa->longestMatch((const uchar *)"while", 5, &tok) == 5);
+    ASSERT_TRUE(tok == 2);
+    ASSERT_TRUE(tdfa->getCacheMisses() > 0);
+    tdfa->~TieredDFA();
+    mc.deallocate(tdfa, sizeof(*tdfa));
+
+    dfa->~DFA();
+    mc.deallocate(dfa, sizeof(*dfa));
+  }
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_PartitionedDFA01 : public TestCase {
+  TC_PartitionedDFA01() : TestCase("TC_PartitionedDFA01") {;};
+  void run();
+};
+
+void
+TC_PartitionedDFA01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  /*
+   * Each rule remembers where its letter was in the last three
+   * bytes. Together the DFA has to remember all of them.
+   */
+  Builder b(&mc);
+  b.addRegEx("[a-g]*a[a-g]{2}", NULL);
+  b.addRegEx("[a-g]*b[a-g]{2}", NULL);
+  b.addRegEx("[a-g]*c[a-g]{2}", NULL);
+  b.addRegEx("[a-g]*d[a-g]{2}", NULL);
+  b.addRegEx("[a-g]*e[a-g]{2}", NULL);
+  b.addRegEx("[a-g]*f[a-g]{2}", NULL);
+  b.addRegEx("gag", NULL);
+  DFA *full = b.BuildDFA(&mc, NULL);
+
+  PartitionedDFA *pdfa = b.BuildPartitionedDFA(&mc, NULL, 70);
+  ASSERT_TRUE(pdfa->getNumGroups() >= 2);
+  for (size_t g = 0; g < pdfa->getNumGroups(); g++)
+    ASSERT_TRUE(pdfa->getGroup(g)->getNumStates() <= 70);
+  for (size_t r = 0; r < 7; r++)
+    ASSERT_TRUE(pdfa->getRuleGroup(r) < pdfa->getNumGroups());
+  ASSERT_TRUE(pdfa->getNumStates() < full->getNumStates());
+
+  size_t seed = 4321;
+  uchar buf[12];
+  for (size_t rep = 0; rep < 3000; rep++) {
+    size_t len = rep % sizeof(buf);
+    for (size_t i = 0; i < len; i++) {
+      seed = seed * 1103515245 + 12345;
+      buf[i] = (uchar)('a' + (seed >> 16) % 8);
+    }
+    size_t t1, t2;
+    size_t l1 = pdfa->longestMatch(buf, len, &t1);
+    size_t l2 = full->longestMatch(buf, len, &t2);
+    ASSERT_TRUE(t1 == t2);
+    ASSERT_TRUE(l1 == l2);
+  }
+
+  /* a group big enough for everything is just the DFA */
+  PartitionedDFA *one = b.BuildPartitionedDFA(&mc, NULL, 100000);
+  ASSERT_TRUE(one->getNumGroups() == 1);
+  ASSERT_TRUE(one->getNumStates() == full->getNumStates());
+
+  {
+    /* a rule too big alone still gets a group, over the size */
+    Builder b2(&mc);
+    b2.addRegEx("abc", NULL);
+    b2.addRegEx("(a|b)*a(a|b){6}", NULL);
+    b2.addRegEx("c+", NULL);
+    PartitionedDFA *big = b2.BuildPartitionedDFA(&mc, NULL, 20);
+    ASSERT_TRUE(big->getNumGroups() == 2);
+    ASSERT_TRUE(big->getRuleGroup(0) == big->getRuleGroup(2));
+    size_t g = big->getRuleGroup(1);
+    ASSERT_TRUE(big->getGroup(g)->getNumStates() > 20);
+    ASSERT_TRUE(big->getGroup(1 - g)->getNumStates() <= 20);
+    big->~PartitionedDFA();
+    mc.deallocate(big, sizeof(*big));
+  }
+
+  one->~PartitionedDFA();
+  mc.deallocate(one, sizeof(*one));
+  pdfa->~PartitionedDFA();
+  mc.deallocate(pdfa, sizeof(*pdfa));
+  full->~DFA();
+  mc.deallocate(full, sizeof(*full));
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_LeftmostFirst01 : public TestCase {
+  TC_LeftmostFirst01() : TestCase("TC_LeftmostFirst01") {;};
+  void run();
+};
+
+void
+TC_LeftmostFirst01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  const char *rules[] = { "if", "[a-z]+", "[0-9]+", "[0-9]+\\.[0-9]+",
+			  "i[a-z]*f+", NULL };
+  const size_t numRules = 5;
+
+  /* the answer: the first rule that matches, alone */
+  DFA *single[numRules];
+  for (size_t r = 0; r < numRules; r++) {
+    Builder b(&mc);
+    b.addRegEx(rules[r], NULL);
+    single[r] = b.BuildDFA(&mc, NULL);
+  }
+
+  Builder b(&mc);
+  for (size_t r = 0; r < numRules; r++)
+    b.addRegEx(rules[r], NULL);
+  DFA *longest = b.BuildDFA(&mc, NULL);
+  b.setMatchSemantics(LEFTMOST_FIRST);
+  DFA *dfa = b.BuildDFA(&mc, NULL);
+  DFA *deriv = b.BuildDerivativeDFA(&mc, NULL);
+  LazyDFA *lazy = b.BuildLazyDFA(&mc, NULL, 8);
+  NFA *nfa = b.BuildNFA(&mc, NULL);
+  PartitionedDFA *part = b.BuildPartitionedDFA(&mc, NULL, 5);
+  Scanner *hyb = b.BuildHybridScanner(&mc, NULL, 4, 1 << 16, 8);
+  ASSERT_TRUE(part->getNumGroups() > 1);
+  ASSERT_TRUE(hyb->isHybrid());
+  ASSERT_TRUE(dfa->getNumStates() < longest->getNumStates());
+  ASSERT_TRUE(deriv->getNumStates() == dfa->getNumStates());
+
+  size_t tok;
+  ASSERT_TRUE(longest->longestMatch((const uchar *)"ifx", 3, &tok) == 3);
+  ASSERT_TRUE(tok == 1);
+  ASSERT_TRUE(dfa->longestMatch((const uchar *)"ifx", 3, &tok) == 2);
+  ASSERT_TRUE(tok == 0);
+  ASSERT_TRUE(dfa->longestMatch((const uchar *)"12.5", 4, &tok) == 2);
+  ASSERT_TRUE(tok == 2);
+
+  {
+    NFAContext ctx(nfa, &mc);
+    const char *alpha = "ifx1.";
+    uchar buf[6];
+    for (size_t len = 0; len <= 6; len++) {
+      size_t n = 1;
+      for (size_t i = 0; i < len; i++)
+	n *= 5;
+      for (size_t v = 0; v < n; v++) {
+	size_t x = v;
+	for (size_t i = 0; i < len; i++) {
+	  buf[i] = (uchar)alpha[x % 5];
+	  x /= 5;
+	}
+	size_t want = NO_TOKEN, wantLen = 0;
+	for (size_t r = 0; r < numRules && want == NO_TOKEN; r++) {
+	  size_t t;
+	  size_t l = single[r]->longestMatch(buf, len, &t);
+	  if (t != NO_TOKEN) {
+	    want = r;
+	    wantLen = l;
+	  }
+	}
+	size_t t1, t2, t3, t4, t5, t6;
+	size_t l1 = dfa->longestMatch(buf, len, &t1);
+	size_t l2 = deriv->longestMatch(buf, len, &t2);
+	size_t l3 = lazy->longestMatch(buf, len, &t3);
+	size_t l4 = ctx.longestMatch(buf, len, &t4);
+	size_t l5 = part->longestMatch(buf, len, &t5);
+	size_t l6 = hyb->longestMatch(buf, len, &t6);
+	ASSERT_TRUE(t1 == want && t2 == want && t3 == want && t4 == want);
+	ASSERT_TRUE(t5 == want && t6 == want);
+	if (want != NO_TOKEN)
+	  ASSERT_TRUE(l1 == wantLen && l2 == wantLen && l3 == wantLen
+		      && l4 == wantLen && l5 == wantLen && l6 == wantLen);
+      }
+    }
+  }
+
+  hyb->~Scanner();
+  mc.deallocate(hyb, sizeof(*hyb));
+  part->~PartitionedDFA();
+  mc.deallocate(part, sizeof(*part));
+  nfa->~NFA();
+  mc.deallocate(nfa, sizeof(*nfa));
+  lazy->~LazyDFA();
+  mc.deallocate(lazy, sizeof(*lazy));
+  deriv->~DFA();
+  mc.deallocate(deriv, sizeof(*deriv));
+  dfa->~DFA();
+  mc.deallocate(dfa, sizeof(*dfa));
+  longest->~DFA();
+  mc.deallocate(longest, sizeof(*longest));
+  for (size_t r = 0; r < numRules; r++) {
+    single[r]->~DFA();
+    mc.deallocate(single[r], sizeof(*single[r]));
+  }
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_ShortestMatch01 : public TestCase {
+  TC_ShortestMatch01() : TestCase("TC_ShortestMatch01") {;};
+  void run();
+};
+
+void
+TC_ShortestMatch01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  Builder b(&mc);
+  b.addRegEx("abc", NULL);
+  b.addRegEx("ab", NULL);
+  b.addRegEx("c[a-c]+", NULL);
+  b.addRegEx("b*a(a|b){3}", NULL);
+  b.addRegEx("cb*a", NULL);
+  DFA *longest = b.BuildDFA(&mc, NULL);
+  b.setMatchSemantics(SHORTEST_MATCH);
+  DFA *dfa = b.BuildDFA(&mc, NULL);
+  DFA *deriv = b.BuildDerivativeDFA(&mc, NULL);
+  LazyDFA *lazy = b.BuildLazyDFA(&mc, NULL, 8);
+  NFA *nfa = b.BuildNFA(&mc, NULL);
+  PartitionedDFA *part = b.BuildPartitionedDFA(&mc, NULL, 5);
+  Scanner *hyb = b.BuildHybridScanner(&mc, NULL, 5, 1 << 16, 8);
+  ASSERT_TRUE(part->getNumGroups() > 1);
+  ASSERT_TRUE(hyb->isHybrid());
+  ASSERT_TRUE(dfa->getNumStates() < longest->getNumStates());
+  ASSERT_TRUE(deriv->getNumStates() == dfa->getNumStates());
+
+  /* accepting states have no way out */
+  for (stateNum s = 0; s < dfa->getNumStates(); s++)
+    if (dfa->getAcceptToken(s) != NO_TOKEN)
+      for (unsigned int ch = 0; ch < 256; ch++)
+	ASSERT_TRUE(dfa->getNextState(s, (uchar)ch) == DFA_DEAD_STATE);
+
+  size_t tok;
+  ASSERT_TRUE(dfa->longestMatch((const uchar *)"abcab", 5, &tok) == 2);
+  ASSERT_TRUE(tok == 1);
+  ASSERT_TRUE(longest->longestMatch((const uchar *)"abcab", 5, &tok) == 3);
+  ASSERT_TRUE(tok == 0);
+
+  {
+    /* the longest match DFA scanned for its first accept is the answer */
+    NFAContext ctx(nfa, &mc);
+    uchar buf[7];
+    for (size_t len = 0; len <= 7; len++) {
+      size_t n = 1;
+      for (size_t i = 0; i < len; i++)
+	n *= 3;
+      for (size_t v = 0; v < n; v++) {
+	size_t x = v;
+	for (size_t i = 0; i < len; i++) {
+	  buf[i] = (uchar)('a' + x % 3);
+	  x /= 3;
+	}
+	size_t want;
+	size_t wantLen = longest->shortestMatch(buf, len, &want);
+	size_t t[7], l[7];
+	l[0] = dfa->longestMatch(buf, len, &t[0]);
+	l[1] = dfa->shortestMatch(buf, len, &t[1]);
+	l[2] = deriv->longestMatch(buf, len, &t[2]);
+	l[3] = lazy->longestMatch(buf, len, &t[3]);
+	l[4] = ctx.longestMatch(buf, len, &t[4]);
+	l[5] = part->longestMatch(buf, len, &t[5]);
+	l[6] = hyb->longestMatch(buf, len, &t[6]);
+	for (size_t e = 0; e < 7; e++) {
+	  ASSERT_TRUE(t[e] == want);
+	  ASSERT_TRUE(want == NO_TOKEN || l[e] == wantLen);
+	}
+      }
+    }
+  }
+
+  hyb->~Scanner();
+  mc.deallocate(hyb, sizeof(*hyb));
+  part->~PartitionedDFA();
+  mc.deallocate(part, sizeof(*part));
+  nfa->~NFA();
+  mc.deallocate(nfa, sizeof(*nfa));
+  lazy->~LazyDFA();
+  mc.deallocate(lazy, sizeof(*lazy));
+  deriv->~DFA();
+  mc.deallocate(deriv, sizeof(*deriv));
+  dfa->~DFA();
+  mc.deallocate(dfa, sizeof(*dfa));
+  longest->~DFA();
+  mc.deallocate(longest, sizeof(*longest));
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_RuleSetDFA01 : public TestCase {
+  TC_RuleSetDFA01() : TestCase("TC_RuleSetDFA01") {;};
+  void run();
+};
+
+void
+TC_RuleSetDFA01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  const char *pats[] = { "abc", "a[a-c]*", "[a-c]+", "b+c", "ca", "(ab)*" };
+  const size_t numPats = sizeof(pats) / sizeof(pats[0]);
+
+  /* leftmost first would hide most rules - the set DFA ignores it */
+  Builder b(&mc);
+  for (size_t r = 0; r < numPats; r++)
+    b.addRegEx(pats[r], NULL);
+  b.setMatchSemantics(LEFTMOST_FIRST);
+  RuleSetDFA *whole = b.BuildRuleSetDFA(&mc, NULL, false);
+  RuleSetDFA *any = b.BuildRuleSetDFA(&mc, NULL, true);
+
+  DFA *one[numPats];
+  for (size_t r = 0; r < numPats; r++) {
+    Builder b1(&mc);
+    b1.addRegEx(pats[r], NULL);
+    one[r] = b1.BuildDFA(&mc, NULL);
+  }
+
+  StateVec rules(makeAlloc<stateNum>(&mc));
+  ASSERT_TRUE(whole->matchWhole((const uchar *)"abc", 3, &rules) == 3);
+  ASSERT_TRUE(rules[0] == 0 && rules[1] == 1 && rules[2] == 2);
+  ASSERT_TRUE(whole->matchWhole((const uchar *)"", 0, &rules) == 1);
+  ASSERT_TRUE(rules[0] == 5);
+  ASSERT_TRUE(whole->matchWhole((const uchar *)"abd", 3, &rules) == 0);
+  ASSERT_TRUE(any->matchAny((const uchar *)"dcad", 4, &rules) == 4);
+  ASSERT_TRUE(rules[0] == 1 && rules[1] == 2 && rules[2] == 4);
+  ASSERT_TRUE(rules[3] == 5);
+  ASSERT_TRUE(whole->getNumLists() < whole->getDFA()->getNumStates());
+
+  /* one pass agrees with one match per rule */
+  StateVec want(makeAlloc<stateNum>(&mc));
+  size_t seed = 8765;
+  uchar buf[9];
+  for (size_t rep = 0; rep < 2000; rep++) {
+    size_t len = rep % sizeof(buf);
+    for (size_t i = 0; i < len; i++) {
+      seed = seed * 1103515245 + 12345;
+      buf[i] = (uchar)('a' + (seed >> 16) % 4);
+    }
+
+    want.clear();
+    for (size_t r = 0; r < numPats; r++) {
+      size_t tok;
+      if (one[r]->longestMatch(buf, len, &tok) == len && tok == 0)
+	want.push_back(r);
+    }
+    ASSERT_TRUE(whole->matchWhole(buf, len, &rules) == want.size());
+    ASSERT_TRUE(rules == want);
+
+    want.clear();
+    for (size_t r = 0; r < numPats; r++) {
+      size_t tok;
+      one[r]->longestMatch(buf, len, &tok);
+      if (tok == 0)
+	want.push_back(r);
+    }
+    ASSERT_TRUE(whole->matchAny(buf, len, &rules) == want.size());
+    ASSERT_TRUE(rules == want);
+
+    want.clear();
+    for (size_t r = 0; r < numPats; r++) {
+      for (size_t i = 0; i <= len; i++) {
+	size_t tok;
+	one[r]->longestMatch(buf + i, len - i, &tok);
+	if (tok == 0) {
+	  want.push_back(r);
+	  break;
+	}
+      }
+    }
+    ASSERT_TRUE(any->matchAny(buf, len, &rules) == want.size());
+    ASSERT_TRUE(rules == want);
+  }
+
+  for (size_t r = 0; r < numPats; r++) {
+    one[r]->~DFA();
+    mc.deallocate(one[r], sizeof(*one[r]));
+  }
+  any->~RuleSetDFA();
+  mc.deallocate(any, sizeof(*any));
+  whole->~RuleSetDFA();
+  mc.deallocate(whole, sizeof(*whole));
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_NFASim01 : public TestCase {
+  TC_NFASim01() : TestCase("TC_NFASim01") {;};
+  void run();
+};
+
+void
+TC_NFASim01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  Builder b(&mc);
+  b.addRegEx("(ab|ba)*c?", NULL);
+  b.addRegEx("(a|b|c)*cc", NULL);
+  b.addRegEx("a{2,3}", NULL);
+  NFA *nfa = b.BuildNFA(&mc, NULL);
+  DFA *dfa = b.BuildDFA(&mc, NULL);
+
+  {
+    NFAContext ctx(nfa, &mc);
+    uchar buf[6];
+    for (size_t len = 0; len <= 6; len++) {
+      size_t n = 1;
+      for (size_t i = 0; i < len; i++)
+	n *= 3;
+      for (size_t v = 0; v < n; v++) {
+	size_t x = v;
+	for (size_t i = 0; i < len; i++) {
+	  buf[i] = (uchar)('a' + x % 3);
+	  x /= 3;
+	}
+	size_t t1, t2;
+	size_t l1 = ctx.longestMatch(buf, len, &t1);
+	size_t l2 = dfa->longestMatch(buf, len, &t2);
+	ASSERT_TRUE(t1 == t2);
+	ASSERT_TRUE(t1 == NO_TOKEN || l1 == l2);
+      }
+    }
+  }
+
+  dfa->~DFA();
+  mc.deallocate(dfa, sizeof(*dfa));
+  nfa->~NFA();
+  mc.deallocate(nfa, sizeof(*nfa));
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_LazyDFA01 : public TestCase {
+  TC_LazyDFA01() : TestCase("TC_LazyDFA01") {;};
+  void run();
+};
+
+void
+TC_LazyDFA01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  Builder b(&mc);
+  b.addRegEx("abc", NULL);
+  b.addRegEx("[a-z]+", NULL);
+  b.addRegEx("[0-9]{1,3}", NULL);
+  LazyDFA *ldfa = b.BuildLazyDFA(&mc, NULL, 1000);
+
+  /* only the dead and start states exist before the first scan */
+  ASSERT_TRUE(ldfa->getNumCachedStates() == 2);
+
+  const char *strs[] = { "abc", "abcd", "ab", "x", "12345", "1a",
+			 "", "ABC", "abc!", NULL };
+  const size_t lens[] = { 3, 4, 2, 1, 3, 1, 0, 0, 3 };
+  const size_t toks[] = { 0, 1, 1, 1, 2, 2, NO_TOKEN, NO_TOKEN, 0 };
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t i = 0; strs[i]; i++) {
+      size_t tok;
+      size_t len = ldfa->longestMatch((const uchar *)strs[i],
+				      strlen(strs[i]), &tok);
+      ASSERT_TRUE(tok == toks[i]);
+      ASSERT_TRUE(tok == NO_TOKEN || len == lens[i]);
+    }
+  }
+  ASSERT_TRUE(ldfa->getNumCachedStates() > 2);
+  ASSERT_TRUE(ldfa->getNumFlushes() == 0);
+  ASSERT_TRUE(!ldfa->usingNFA());
+
+  ldfa->~LazyDFA();
+  mc.deallocate(ldfa, sizeof(*ldfa));
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_LazyDFA02 : public TestCase {
+  TC_LazyDFA02() : TestCase("TC_LazyDFA02") {;};
+  void run();
+};
+
+void
+TC_LazyDFA02::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  /* a cache smaller than the DFA has to be flushed to make progress */
+  Builder b(&mc);
+  b.addRegEx("(a|b)*abb", NULL);
+  b.addRegEx("b+", NULL);
+  DFA *dfa = b.BuildDFA(&mc, NULL);
+  LazyDFA *ldfa = b.BuildLazyDFA(&mc, NULL, 4);
+
+  uchar buf[8];
+  for (size_t len = 0; len <= 8; len++) {
+    for (size_t v = 0; v < ((size_t)1 << len); v++) {
+      for (size_t i = 0; i < len; i++)
+	buf[i] = (v & ((size_t)1 << i)) ? 'b' : 'a';
+      size_t t1, t2;
+      size_t l1 = ldfa->longestMatch(buf, len, &t1);
+      size_t l2 = dfa->longestMatch(buf, len, &t2);
+      ASSERT_TRUE(t1 == t2);
+      ASSERT_TRUE(t1 == NO_TOKEN || l1 == l2);
+    }
+  }
+  ASSERT_TRUE(ldfa->getNumFlushes() > 0);
+  ASSERT_TRUE(ldfa->getNumCachedStates() <= 4);
+
+  ldfa->~LazyDFA();
+  mc.deallocate(ldfa, sizeof(*ldfa));
+  dfa->~DFA();
+  mc.deallocate(dfa, sizeof(*dfa));
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_LazyDFA03 : public TestCase {
+  TC_LazyDFA03() : TestCase("TC_LazyDFA03") {;};
+  void run();
+};
+
+void
+TC_LazyDFA03::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  /* needs 2^9 DFA states, so a small cache thrashes */
+  Builder b(&mc);
+  b.addRegEx("(a|b)*a(a|b){8}", NULL);
+  DFA *dfa = b.BuildDFA(&mc, NULL);
+  LazyDFA *ldfa = b.BuildLazyDFA(&mc, NULL, 16);
+
+  const size_t bufLen = 4000;
+  uchar *buf = (uchar *)mc.allocate(bufLen);
+  unsigned int seed = 12345;
+  for (size_t i = 0; i < bufLen; i++) {
+    seed = seed * 1103515245 + 12345;
+    buf[i] = ((seed >> 16) & 1) ? 'a' : 'b';
+  }
+
+  for (size_t len = bufLen; len > 0; len /= 2) {
+    size_t t1, t2;
+    size_t l1 = ldfa->longestMatch(buf, len, &t1);
+    size_t l2 = dfa->longestMatch(buf, len, &t2);
+    ASSERT_TRUE(t1 == t2);
+    ASSERT_TRUE(t1 == NO_TOKEN || l1 == l2);
+  }
+  ASSERT_TRUE(ldfa->getNumFlushes() >= 3);
+  ASSERT_TRUE(ldfa->usingNFA());
+
+  mc.deallocate(buf, bufLen);
+  ldfa->~LazyDFA();
+  mc.deallocate(ldfa, sizeof(*ldfa));
+  dfa->~DFA();
+  mc.deallocate(dfa, sizeof(*dfa));
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_LazyDFA_MemFail01 : public TestCase {
+  TC_LazyDFA_MemFail01() : TestCase("TC_LazyDFA_MemFail01") {;};
+  void run();
+};
+
+void
+TC_LazyDFA_MemFail01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  {
+    Builder b(&mc);
+    b.addRegEx("a(b|c)*d", NULL);
+    LazyDFA *ldfa = b.BuildLazyDFA(&mc, NULL, 8);
+    ldfa->~LazyDFA();
+    mc.deallocate(ldfa, sizeof(*ldfa));
+  }
+
+  size_t numAllocs = mc.m_numAllocs;
+  for (size_t lim = 0; lim < numAllocs; lim++) {
+    mc.resetCounters();
+    mc.setLimit(lim);
+
+    try {
+      Builder b(&mc);
+      b.addRegEx("a(b|c)*d", NULL);
+      LazyDFA *ldfa = b.BuildLazyDFA(&mc, NULL, 8);
+      ldfa->~LazyDFA();
+      mc.deallocate(ldfa, sizeof(*ldfa));
+      ASSERT_TRUE(false);
+    }
+    catch (const bad_alloc &e) {
+      ASSERT_TRUE(true);
+    }
+    ASSERT_TRUE(mc.m_numAllocs == mc.m_numDeallocs);
+  }
+
+  mc.disableLimit();
+  this->setStatus(true);
+}
+
+/********************/
+
+struct TC_SharedLazyDFA01 : public TestCase {
+  TC_SharedLazyDFA01() : TestCase("TC_SharedLazyDFA01") {;};
+  void run();
+};
+
+void
+TC_SharedLazyDFA01::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  Builder b(&mc);
+  b.addRegEx("(a|b)*abb", NULL);
+  b.addRegEx("b+", NULL);
+  b.addRegEx("a{2,3}c", NULL);
+  DFA *dfa = b.BuildDFA(&mc, NULL);
+
+  /* a roomy cache and one too small to hold the whole DFA */
+  size_t sizes[] = { 100, 3 };
+  for (size_t k = 0; k < 2; k++) {
+    SharedLazyDFA *sdfa = b.BuildSharedLazyDFA(&mc, NULL, sizes[k]);
+    ASSERT_TRUE(sdfa->getNumStates() == 2);
+
+    {
+      SharedLazyScanner scan(sdfa, &mc);
+      uchar buf[8];
+      for (size_t len = 0; len <= 8; len++) {
+	size_t n = 1;
+	for (size_t i = 0; i < len; i++)
+	  n *= 3;
+	for (size_t v = 0; v < n; v++) {
+	  size_t x = v;
+	  for (size_t i = 0; i < len; i++) {
+	    buf[i] = (uchar)('a' + x % 3);
+	    x /= 3;
+	  }
+	  size_t t1, t2;
+	  size_t l1 = scan.longestMatch(buf, len, &t1);
+	  size_t l2 = dfa->longestMatch(buf, len, &t2);
+	  ASSERT_TRUE(t1 == t2);
+	  ASSERT_TRUE(t1 == NO_TOKEN || l1 == l2);
+	}
+      }
+    }
+    ASSERT_TRUE(sdfa->getNumStates() <= sizes[k]);
+    if (k == 1)
+      ASSERT_TRUE(sdfa->getNumStates() == 3);
+
+    sdfa->~SharedLazyDFA();
+    mc.deallocate(sdfa, sizeof(*sdfa));
+  }
+
+  dfa->~DFA();
+  mc.deallocate(dfa, sizeof(*dfa));
+
+  this->setStatus(true);
+}
+
+/********************/
+
+struct SharedScanArgs {
+  SharedLazyDFA *m_sdfa;
+  const DFA *m_dfa;
+  const uchar *m_buf;
+  size_t m_len;
+  bool m_ok;
+};
+
+static void *
+shared_scan_thread(void *arg)
+{
+  SharedScanArgs *a = (SharedScanArgs *)arg;
+  MemoryControl mc;
+  SharedLazyScanner scan(a->m_sdfa, &mc);
+
+  a->m_ok = true;
+  for (size_t pass = 0; pass < 4; pass++) {
+    for (size_t start = 0; start < a->m_len; start++) {
+      size_t t1, t2;
+      size_t l1 = scan.longestMatch(a->m_buf + start, a->m_len - start, &t1);
+      size_t l2 = a->m_dfa->longestMatch(a->m_buf + start,
+					 a->m_len - start, &t2);
+      if (t1 != t2 || (t1 != NO_TOKEN && l1 != l2))
+	a->m_ok = false;
+    }
+  }
+  return NULL;
+}
+
+struct TC_SharedLazyDFA02 : public TestCase {
+  TC_SharedLazyDFA02() : TestCase("TC_SharedLazyDFA02") {;};
+  void run();
+};
+
+void
+TC_SharedLazyDFA02::run()
+{
+  MemoryControlWithFailure mc;
+  mc.resetCounters();
+  mc.disableLimit();
+
+  Builder b(&mc);
+  b.addRegEx("[a-z]+", NULL);
+  b.addRegEx("[0-9]+", NULL);
+  b.addRegEx("(a|b)*a(a|b){5}", NULL);
+  b.addRegEx(" +", NULL);
+  DFA *dfa = b.BuildDFA(&mc, NULL);
+  SharedLazyDFA *sdfa = b.BuildSharedLazyDFA(&mc, NULL, 256);
+
+  const size_t numThreads = 8;
+  const size_t bufLen = 400;
+  uchar *buf = (uchar *)mc.allocate(bufLen);
+  unsigned int seed = 4321;
+  const char alphabet[] = "abab12 xz";
+  for (size_t i = 0; i < bufLen; i++) {
+    seed = seed * 1103515245 + 12345;
+    buf[i] = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+  }
+
+  pthread_t tids[numThreads];
+  SharedScanArgs args[numThreads];
+  for (size_t t = 0; t < numThreads; t++) {
+    args[t].m_sdfa = sdfa;
+    args[t].m_dfa = dfa;
+    args[t].m_buf = buf;
+    args[t].m_len = bufLen;
+    args[t].m_ok = false;
+    ASSERT_TRUE(pthread_create(&tids[t], NULL, shared_scan_thread,
+			       &args[t]) == 0);
+  }
+  for (size_t t = 0; t < numThreads; t++)
+    pthread_join(tids[t], NULL);
+  for (size_t t = 0; t < numThreads; t++)
+    ASSERT_TRUE(args[t].m_ok);
+  ASSERT_TRUE(sdfa->getNumStates() <= 256);
+
+  mc.deallocate(buf, bufLen);
+  sdfa->~SharedLazyDFA();
+  mc.deallocate(sdfa, sizeof(*sdfa));
+  dfa->~DFA();
+  mc.deallocate(dfa, sizeof(*dfa));
+
+  this->setStatus(true);
+}
+
+/****************************************************/
+/* top level                                        */
+/****************************************************/
+static TestSuite *
+make_suite_all_tests()
+{
+  TestSuite *s;
+
+  s = new TestSuite();
+
+  s->addTestCase(new TC_Basic01());
+  s->addTestCase(new TC_Basic02());
+
+  s->addTestCase(new TC_Tokens01());
+  s->addTestCase(new TC_Tokens02());
+  s->addTestCase(new TC_Tokens03());
+  s->addTestCase(new TC_Tokens04());
+  s->addTestCase(new TC_Tokens05());
+  s->addTestCase(new TC_Tokens06());
+  s->addTestCase(new TC_Tokens07());
+  s->addTestCase(new TC_Tokens08());
+
+  s->addTestCase(new TC_Tokens201());
+  s->addTestCase(new TC_Tokens202());
+  s->addTestCase(new TC_Tokens203());
+  s->addTestCase(new TC_Tokens204());
+  s->addTestCase(new TC_Tokens205());
+  s->addTestCase(new TC_Tokens206());
+  s->addTestCase(new TC_Tokens207());
+  s->addTestCase(new TC_Tokens208());
+  s->addTestCase(new TC_Tokens209());
+  s->addTestCase(new TC_Tokens210());
+
+  s->addTestCase(new TC_MemFail01());
+  s->addTestCase(new TC_MemFail02());
+  s->addTestCase(new TC_MemFail03());
+  s->addTestCase(new TC_MemFail04());
+  s->addTestCase(new TC_MemFail05());
+
+  s->addTestCase(new TC_MemFail2_02());
+  s->addTestCase(new TC_MemFail2_03());
+  s->addTestCase(new TC_MemFail2_04());
+  s->addTestCase(new TC_MemFail2_05());
+
+  s->addTestCase(new TC_Postfix01());
+  s->addTestCase(new TC_Postfix02());
+  s->addTestCase(new TC_Postfix03());
+  s->addTestCase(new TC_Postfix04());
+  s->addTestCase(new TC_Postfix05());
+
+  s->addTestCase(new TC_Postfix_MemFail_01());
+
+  s->addTestCase(new TC_BuilderBasic01());
+  s->addTestCase(new TC_BuilderBasic02());
+  s->addTestCase(new TC_BuilderBasic03());
+
+  s->addTestCase(new TC_NFA01());
+  s->addTestCase(new TC_DFA01());
+  s->addTestCase(new TC_DFA02());
+  s->addTestCase(new TC_DFA03());
+  s->addTestCase(new TC_DFA04());
+  s->addTestCase(new TC_DFA_MemFail01());
+
+  s->addTestCase(new TC_DFAMin01());
+  s->addTestCase(new TC_DFAMin02());
+
+  s->addTestCase(new TC_ByteClass01());
+  s->addTestCase(new TC_DFAPack01());
+  s->addTestCase(new TC_DFAAccel01());
+  s->addTestCase(new TC_DFAShuffle01());
+  s->addTestCase(new TC_DFAStride01());
+  s->addTestCase(new TC_ReverseDFA01());
+  s->addTestCase(new TC_DFAProfile01());
+  s->addTestCase(new TC_DFAIncr01());
+  s->addTestCase(new TC_ParallelDFA01());
+  s->addTestCase(new TC_ParallelMin01());
+  s->addTestCase(new TC_DerivDFA01());
+  s->addTestCase(new TC_DerivDFA02());
+  s->addTestCase(new TC_BuildLimits01());
+  s->addTestCase(new TC_HybridScanner01());
+  s->addTestCase(new TC_DFAChain01());
+  s->addTestCase(new TC_DFASpecial01());
+  s->addTestCase(new TC_DFAComb01());
+  s->addTestCase(new TC_TieredDFA01());
+  s->addTestCase(new TC_PartitionedDFA01());
+  s->addTestCase(new TC_LeftmostFirst01());
+  s->addTestCase(new TC_ShortestMatch01());
+  s->addTestCase(new TC_RuleSetDFA01());
+
+  s->addTestCase(new TC_NFASim01());
+  s->addTestCase(new TC_LazyDFA01());
+  s->addTestCase(new TC_LazyDFA02());
+  s->addTestCase(new TC_LazyDFA03());
+  s->addTestCase(new TC_LazyDFA_MemFail01());
+  s->addTestCase(new TC_SharedLazyDFA01());
+  s->addTestCase(new TC_SharedLazyDFA02());
 
   return s;
 }